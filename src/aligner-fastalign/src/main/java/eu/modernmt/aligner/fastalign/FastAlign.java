@@ -196,6 +196,67 @@ public class FastAlign implements Aligner {
 
     private native float[] align(long nativeHandle, boolean reversed, String[][] sources, String[][] targets, int strategy, int[][] outputAlignment);
 
+    /**
+     * Updates the model of the given language direction with new sentence pairs. Alignments computed
+     * concurrently are not blocked, and they see the update as soon as this method returns.
+     */
+    public void update(LanguageDirection language, List<? extends Sentence> sources, List<? extends Sentence> targets) throws AlignerException {
+        boolean reversed = false;
+
+        LanguageKey key = LanguageKey.parse(language);
+        Long nativeHandle = models.get(key);
+
+        if (nativeHandle == null) {
+            reversed = true;
+            nativeHandle = models.get(key.reversed());
+        }
+
+        if (nativeHandle == null)
+            throw new AlignerException("Language direction not supported: " + language);
+
+        String[][] sourceArray = new String[sources.size()][];
+        String[][] targetArray = new String[targets.size()][];
+
+        Iterator<? extends Sentence> sourceIterator = sources.iterator();
+        Iterator<? extends Sentence> targetIterator = targets.iterator();
+
+        int i = 0;
+        while (sourceIterator.hasNext() && targetIterator.hasNext()) {
+            sourceArray[i] = XUtils.toTokensArray(sourceIterator.next());
+            targetArray[i] = XUtils.toTokensArray(targetIterator.next());
+            i++;
+        }
+
+        update(nativeHandle, reversed, sourceArray, targetArray);
+    }
+
+    private native void update(long nativeHandle, boolean reversed, String[][] sources, String[][] targets);
+
+    /**
+     * Replaces the model of the language directions encoded in the file name with the one stored in the file.
+     * The new model is loaded in the calling thread while the current one keeps serving alignments, then it is
+     * swapped in atomically: requests in progress complete with the previous model, that is freed when the last
+     * of them returns. The online updates of the previous model are discarded.
+     */
+    public void reload(File modelFile) throws IOException {
+        Long nativeHandle = null;
+
+        for (LanguageDirection pair : parseLanguagesFromFilename(modelFile)) {
+            Long handle = models.get(LanguageKey.parse(pair));
+            if (handle == null || (nativeHandle != null && !nativeHandle.equals(handle)))
+                throw new IOException("FastAlign model does not match a loaded model: " + modelFile);
+
+            nativeHandle = handle;
+        }
+
+        logger.info("Reloading FastAlign model " + modelFile);
+        long now = System.currentTimeMillis();
+        reload(nativeHandle, modelFile.getAbsolutePath());
+        logger.info("Reloaded FastAlign model " + modelFile + " in " + (int) ((System.currentTimeMillis() - now) / 1000) + "s");
+    }
+
+    private native void reload(long nativeHandle, String modelFile) throws IOException;
+
     @Override
     protected void finalize() throws Throwable {
         super.finalize();
@@ -6,6 +6,7 @@
 #include <fstream>
 #include <fastalign/Corpus.h>
 #include <fastalign/FastAligner.h>
+#include <fastalign/Pipeline.h>
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 #include <thread>
@@ -103,19 +104,20 @@ void PrintAlignment(vector<alignment_t> &alignments, ofstream &out) {
             out << a->points[i].first << '-' << a->points[i].second;
         }
 
-        out << endl;
+        out << '\n';
     }
 }
 
 void PrintScore(vector<alignment_t> &alignments, ofstream &out) {
     for (auto a = alignments.begin(); a != alignments.end(); ++a) {
-        out << a->score << endl;
+        out << a->score << '\n';
     }
 }
 
 void AlignCorpus(const Corpus &corpus, size_t buffer_size, Symmetrization strategy, FastAligner &aligner,
                  const string &outputPath, bool printAlignments, bool printScores) {
-    CorpusReader reader(corpus, &aligner.GetVocabulary());
+    shared_ptr<const Vocabulary> vocabulary = aligner.GetVocabulary();
+    CorpusReader reader(corpus, vocabulary.get());
 
     vector<pair<wordvec_t, wordvec_t>> batch;
     vector<alignment_t> alignments;
@@ -131,17 +133,27 @@ void AlignCorpus(const Corpus &corpus, size_t buffer_size, Symmetrization strate
     if (printScores)
         scoreStream.open(scorePath.c_str(), ios_base::out);
 
-    while (reader.Read(batch, buffer_size)) {
-        aligner.GetAlignments(batch, alignments, strategy);
+    // Pipeline: lines are read and encoded in background while aligning, alignments are written in order
+    // by another thread
+    Prefetcher<vector<pair<wordvec_t, wordvec_t>>> batches([&reader, buffer_size](
+            vector<pair<wordvec_t, wordvec_t>> &b) {
+        return reader.Read(b, buffer_size);
+    });
 
+    AsyncConsumer<vector<alignment_t>> writer([&](vector<alignment_t> &output) {
         if (printAlignments)
-            PrintAlignment(alignments, alignStream);
+            PrintAlignment(output, alignStream);
         if (printScores)
-            PrintScore(alignments, scoreStream);
+            PrintScore(output, scoreStream);
+    });
 
+    while (batches.Next(batch)) {
         alignments.clear();
-        batch.clear();
+        aligner.GetAlignments(batch, alignments, strategy);
+        writer.Push(std::move(alignments));
     }
+
+    writer.Close();
 }
 
 int main(int argc, const char *argv[]) {
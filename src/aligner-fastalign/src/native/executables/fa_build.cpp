@@ -13,6 +13,7 @@
 // limitations under the License.
 //
 
+#include <cmath>
 #include <iostream>
 #include <getopt.h>
 #include <stdlib.h>
@@ -31,6 +32,9 @@ namespace {
     const size_t GENERIC_ERROR = 2;
     const size_t SUCCESS = 0;
 
+    // EM iterations when updating an existing model
+    const int kWarmStartIterations = 2;
+
     struct args_t {
         string source_lang;
         string target_lang;
@@ -54,14 +58,36 @@ bool ParseArgs(int argc, const char *argv[], args_t *args) {
             ("input,i", po::value<string>()->required(), "input folder containing the parallel files collection")
             ("model,m", po::value<string>()->required(), "the output path")
             ("threads,T", po::value<unsigned int>(), "number of threads (default is number of CPU)")
-            ("iterations,I", po::value<unsigned int>(), "number of iterations in EM training (default is 5)")
+            ("iterations,I", po::value<unsigned int>(), "number of iterations in EM training, the maximum one "
+                                                        "with --convergence-thr (default is 5, 2 with --base-model)")
+            ("convergence-thr", po::value<double>(), "stop the EM training when the relative improvement of the "
+                                                     "corpus log-likelihood is not above this threshold, "
+                                                     "e.g. 0.01 (default is 0, run all the iterations)")
             ("prune,p", po::value<double>(), "final model pruning threshold (default is 1.e-20)")
             ("vocabulary-thr,v", po::value<double>(), "keeps only the most relevant terms in vocabulary "
                                                       "(default is 0.9999 - only the terms that cover "
                                                       "the 99.99% of the input corpora)")
+            ("vocabulary-memory", po::value<size_t>(), "memory in MB for approximate vocabulary counting on very "
+                                                       "large corpora, the corpora are read twice "
+                                                       "(default is exact counting of all the terms)")
             ("max-length,l", po::value<size_t>(), "max sentence length (default is 80)")
+            ("quantize,q", po::value<int>(), "store translation scores with 8 or 16 bits codebooks "
+                                             "(default is 32 bits floats)")
             ("case-insensitive", "create a case insensitive model (default is case sensitive)")
-            ("no-favor-diagonal", "don't enforce diagonal form of alignment (default is use diagonal)");
+            ("no-favor-diagonal", "don't enforce diagonal form of alignment (default is use diagonal)")
+            ("joint", "train forward and backward models together, reading the corpus once per iteration")
+            ("max-memory", po::value<size_t>(), "max memory in MB for the training: if both models do not fit "
+                                                "they are trained one after the other, if a single model does not "
+                                                "fit its table is trained out-of-core (default is no limit)")
+            ("base-model,b", po::value<string>(), "existing model to update: the training starts from its "
+                                                  "probabilities, words that are not in the input corpora keep "
+                                                  "their translations and their ids in the vocabulary")
+            ("checkpoint", "save the training state after every iteration in the directory <model>.checkpoint, "
+                           "that is deleted when the model is stored")
+            ("resume", "resume the training from the checkpoint of a previous run with the same options, "
+                       "if there is one (implies --checkpoint)")
+            ("mmap-corpus", "keep the encoded training corpus in a memory-mapped temporary file "
+                            "instead of the main memory");
 
     po::variables_map vm;
     try {
@@ -80,19 +106,39 @@ bool ParseArgs(int argc, const char *argv[], args_t *args) {
 
         if (vm.count("threads"))
             args->options.threads = vm["threads"].as<unsigned int>();
+        if (vm.count("base-model"))
+            args->options.base_model = vm["base-model"].as<string>();
         if (vm.count("iterations"))
             args->options.iterations = vm["iterations"].as<unsigned int>();
+        else if (vm.count("base-model"))
+            args->options.iterations = kWarmStartIterations;
+        if (vm.count("convergence-thr"))
+            args->options.convergence_threshold = vm["convergence-thr"].as<double>();
         if (vm.count("prune"))
             args->options.pruning_threshold = vm["prune"].as<double>();
         if (vm.count("vocabulary-thr"))
             args->options.vocabulary_threshold = vm["vocabulary-thr"].as<double>();
+        if (vm.count("vocabulary-memory"))
+            args->options.vocabulary_memory = vm["vocabulary-memory"].as<size_t>() * 1024 * 1024;
         if (vm.count("max-length"))
             args->options.max_line_length = vm["max-length"].as<size_t>();
+        if (vm.count("quantize"))
+            args->options.score_bits = vm["quantize"].as<int>();
 
         if (vm.count("case-insensitive"))
             args->options.case_sensitive = false;
         if (vm.count("no-favor-diagonal"))
             args->options.favor_diagonal = false;
+        if (vm.count("joint"))
+            args->options.joint_training = true;
+        if (vm.count("max-memory"))
+            args->options.max_memory = vm["max-memory"].as<size_t>() * 1024 * 1024;
+        if (vm.count("mmap-corpus"))
+            args->options.mmap_corpus = true;
+        if (vm.count("checkpoint"))
+            args->options.checkpoint = true;
+        if (vm.count("resume"))
+            args->options.resume = true;
     } catch (po::error &e) {
         std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
         std::cerr << desc << std::endl;
@@ -113,10 +159,25 @@ public:
         stepBegin = GetTime();
     }
 
+    void VocabularyBuildProgress(size_t sentences) override {
+        // a dot every million sentence pairs
+        for (; reportedSentences + 1000000 <= sentences; reportedSentences += 1000000)
+            cerr << '.';
+    }
+
     void VocabularyBuildEnd() override {
         cerr << "DONE in " << (GetTime() - stepBegin) << "s" << endl;
     }
 
+    void CorpusEncodingBegin() override {
+        cerr << "Encoding corpora... ";
+        stepBegin = GetTime();
+    }
+
+    void CorpusEncodingEnd() override {
+        cerr << "DONE in " << (GetTime() - stepBegin) << "s" << endl;
+    }
+
     void Begin(bool forward) override {
         processBegin = GetTime();
         cerr << "== " << (forward ? "Forward" : "Backward") << " model training ==" << endl;
@@ -160,6 +221,12 @@ public:
         cerr << "DONE in " << (GetTime() - stepBegin) << "s" << endl;
     }
 
+    void IterationStatistics(bool forward, int iteration, const iteration_stats_t &stats) override {
+        cerr << "\t" << (forward ? "Forward" : "Backward") << " log-likelihood: " << stats.log_likelihood
+             << ", cross entropy: " << stats.cross_entropy << " bits, perplexity: " << exp2(stats.cross_entropy)
+             << ", t-table change: " << stats.ttable_change << endl;
+    }
+
     void IterationEnd(bool forward, int iteration) override {
         // Nothing to do
     }
@@ -180,6 +247,7 @@ public:
 private:
     double stepBegin = 0;
     double processBegin = 0;
+    size_t reportedSentences = 0;
 
     double GetTime() {
         struct timeval time{};
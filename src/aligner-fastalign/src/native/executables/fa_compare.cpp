@@ -0,0 +1,202 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <fastalign/Corpus.h>
+#include <fastalign/FastAligner.h>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <thread>
+#include <cmath>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+namespace {
+    const size_t ERROR_IN_COMMAND_LINE = 1;
+    const size_t GENERIC_ERROR = 2;
+    const size_t SUCCESS = 0;
+
+    struct args_t {
+        string model_path;
+        string reference_path;
+        string input_path;
+        string source_lang;
+        string target_lang;
+
+        Symmetrization strategy = GrowDiagonalFinalAnd;
+        size_t buffer_size = 100000;
+    };
+} // namespace
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+bool ParseArgs(int argc, const char *argv[], args_t *args) {
+    po::options_description desc("Compares the alignments of a FastAlign model (i.e. a quantized model) "
+                                 "with the ones of a reference model on a collection of parallel files");
+    desc.add_options()
+            ("help,h", "print this help message")
+            ("model,m", po::value<string>()->required(), "the FastAlign model path")
+            ("reference,r", po::value<string>()->required(), "the reference FastAlign model path")
+            ("source,s", po::value<string>()->required(), "source language")
+            ("target,t", po::value<string>()->required(), "target language")
+            ("input,i", po::value<string>()->required(), "input folder containing the parallel files collection")
+            ("strategy,a", po::value<size_t>(),
+             "symmetrization strategy, valid values are (1) GrowDiagonalFinalAnd, (2) GrowDiagonal, (3) Intersection "
+             "(4) Union. Default strategy is \"GrowDiagonalFinalAnd\"")
+            ("batch-size,b", po::value<size_t>(), "input batch size, expressed in number of lines");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return false;
+        }
+
+        po::notify(vm);
+
+        args->model_path = vm["model"].as<string>();
+        args->reference_path = vm["reference"].as<string>();
+        args->input_path = vm["input"].as<string>();
+        args->source_lang = vm["source"].as<string>();
+        args->target_lang = vm["target"].as<string>();
+
+        if (vm.count("strategy"))
+            args->strategy = (Symmetrization) vm["strategy"].as<size_t>();
+
+        if (vm.count("batch-size"))
+            args->buffer_size = vm["batch-size"].as<size_t>();
+    } catch (po::error &e) {
+        std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+        std::cerr << desc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+class Comparison {
+public:
+    void Add(const alignment_t &reference, const alignment_t &alignment) {
+        vector<pair<length_t, length_t>> expected = reference.points;
+        vector<pair<length_t, length_t>> actual = alignment.points;
+
+        std::sort(expected.begin(), expected.end());
+        std::sort(actual.begin(), actual.end());
+
+        vector<pair<length_t, length_t>> common;
+        std::set_intersection(expected.begin(), expected.end(), actual.begin(), actual.end(),
+                              back_inserter(common));
+
+        sentences++;
+        if (expected == actual)
+            identical++;
+
+        expected_points += expected.size();
+        actual_points += actual.size();
+        common_points += common.size();
+
+        if (!isnan(reference.score) && !isnan(alignment.score)) {
+            double diff = fabs(reference.score - alignment.score);
+            score_diff_sum += diff;
+            score_diff_max = max(score_diff_max, diff);
+            scores++;
+        }
+    }
+
+    void Print(ostream &out) const {
+        double precision = actual_points > 0 ? ((double) common_points) / actual_points : 1.;
+        double recall = expected_points > 0 ? ((double) common_points) / expected_points : 1.;
+        double f1 = precision + recall > 0 ? 2 * precision * recall / (precision + recall) : 0;
+
+        out << "sentences=" << sentences << "\n";
+        out << "identical_alignments=" << (sentences > 0 ? ((double) identical) / sentences : 1.) << "\n";
+        out << "points_precision=" << precision << "\n";
+        out << "points_recall=" << recall << "\n";
+        out << "points_f1=" << f1 << "\n";
+        out << "score_avg_abs_diff=" << (scores > 0 ? score_diff_sum / scores : 0.) << "\n";
+        out << "score_max_abs_diff=" << score_diff_max << "\n";
+    }
+
+private:
+    size_t sentences = 0;
+    size_t identical = 0;
+    size_t expected_points = 0;
+    size_t actual_points = 0;
+    size_t common_points = 0;
+    size_t scores = 0;
+    double score_diff_sum = 0;
+    double score_diff_max = 0;
+};
+
+void CompareCorpus(FastAligner &reference, FastAligner &aligner, const Corpus &corpus,
+                   size_t buffer_size, Symmetrization strategy, Comparison &comparison) {
+    CorpusReader reader(corpus);
+
+    vector<pair<sentence_t, sentence_t>> batch;
+    vector<alignment_t> expected;
+    vector<alignment_t> actual;
+
+    while (reader.Read(batch, buffer_size)) {
+        reference.GetAlignments(batch, expected, strategy);
+        aligner.GetAlignments(batch, actual, strategy);
+
+        for (size_t i = 0; i < batch.size(); ++i)
+            comparison.Add(expected[i], actual[i]);
+
+        expected.clear();
+        actual.clear();
+        batch.clear();
+    }
+}
+
+int main(int argc, const char *argv[]) {
+    int threads = 1;
+
+#ifdef _OPENMP
+    threads = thread::hardware_concurrency();
+
+    omp_set_dynamic(0);
+    omp_set_num_threads(threads);
+#endif
+
+    args_t args;
+
+    if (!ParseArgs(argc, argv, &args))
+        return ERROR_IN_COMMAND_LINE;
+
+    if (!fs::exists(args.input_path) || !fs::is_directory(args.input_path)) {
+        cerr << "ERROR: input path is not a valid directory" << endl;
+        return GENERIC_ERROR;
+    }
+
+    if (!fs::is_regular(args.model_path) || !fs::is_regular(args.reference_path)) {
+        cerr << "ERROR: model path is not a valid file" << endl;
+        return GENERIC_ERROR;
+    }
+
+    vector<Corpus> corpora;
+    Corpus::List(args.input_path, args.source_lang, args.target_lang, corpora);
+
+    FastAligner reference(args.reference_path, threads);
+    FastAligner aligner(args.model_path, threads);
+    Comparison comparison;
+
+    for (auto corpus = corpora.begin(); corpus != corpora.end(); ++corpus)
+        CompareCorpus(reference, aligner, *corpus, args.buffer_size, args.strategy, comparison);
+
+    comparison.Print(cout);
+
+    return SUCCESS;
+}
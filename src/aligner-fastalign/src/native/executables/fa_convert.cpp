@@ -0,0 +1,95 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include <iostream>
+#include <fastalign/ModelFile.h>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+namespace {
+    const size_t ERROR_IN_COMMAND_LINE = 1;
+    const size_t GENERIC_ERROR = 2;
+    const size_t SUCCESS = 0;
+
+    struct args_t {
+        string input_path;
+        string output_path;
+        int score_bits = kScoreBitsFloat;
+    };
+} // namespace
+
+namespace po = boost::program_options;
+namespace fs = boost::filesystem;
+
+bool ParseArgs(int argc, const char *argv[], args_t *args) {
+    po::options_description desc("Converts a FastAlign model to the memory-mapped model format");
+    desc.add_options()
+            ("help,h", "print this help message")
+            ("input,i", po::value<string>()->required(), "the input model path")
+            ("output,o", po::value<string>()->required(), "the output model path")
+            ("quantize,q", po::value<int>(), "store translation scores with 8 or 16 bits codebooks "
+                                             "(default is 32 bits floats)");
+
+    po::variables_map vm;
+    try {
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << std::endl;
+            return false;
+        }
+
+        po::notify(vm);
+
+        args->input_path = vm["input"].as<string>();
+        args->output_path = vm["output"].as<string>();
+
+        if (vm.count("quantize"))
+            args->score_bits = vm["quantize"].as<int>();
+    } catch (po::error &e) {
+        std::cerr << "ERROR: " << e.what() << std::endl << std::endl;
+        std::cerr << desc << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, const char *argv[]) {
+    args_t args;
+
+    if (!ParseArgs(argc, argv, &args))
+        return ERROR_IN_COMMAND_LINE;
+
+    if (!fs::is_regular(args.input_path)) {
+        cerr << "ERROR: input model path is not a valid file" << endl;
+        return GENERIC_ERROR;
+    }
+
+    if (fs::exists(args.output_path) && fs::equivalent(args.input_path, args.output_path)) {
+        cerr << "ERROR: input and output model must be different files" << endl;
+        return GENERIC_ERROR;
+    }
+
+    if (args.score_bits != 8 && args.score_bits != 16 && args.score_bits != kScoreBitsFloat) {
+        cerr << "ERROR: quantization must be 8 or 16 bits" << endl;
+        return ERROR_IN_COMMAND_LINE;
+    }
+
+    quantization_error_t fwd_error{0, 0}, bwd_error{0, 0};
+    ModelFile::Convert(args.input_path, args.output_path, args.score_bits, &fwd_error, &bwd_error);
+
+    if (args.score_bits != kScoreBitsFloat) {
+        cout << "forward_log_prob_avg_abs_error=" << fwd_error.mean << "\n";
+        cout << "forward_log_prob_max_abs_error=" << fwd_error.max << "\n";
+        cout << "backward_log_prob_avg_abs_error=" << bwd_error.mean << "\n";
+        cout << "backward_log_prob_max_abs_error=" << bwd_error.max << "\n";
+    }
+
+    return SUCCESS;
+}
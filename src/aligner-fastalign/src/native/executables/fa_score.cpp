@@ -128,7 +128,8 @@ void ShiftBatch(vector<pair<wordvec_t, wordvec_t>> &batch) {
 
 void ScoreCorpus(FastAligner &aligner, Sequence &goodScores, Sequence &badScores,
                  const Corpus &corpus, size_t buffer_size, const string &outputPath) {
-    CorpusReader reader(corpus, &aligner.GetVocabulary());
+    shared_ptr<const Vocabulary> vocabulary = aligner.GetVocabulary();
+    CorpusReader reader(corpus, vocabulary.get());
 
     vector<pair<wordvec_t, wordvec_t>> batch;
     vector<alignment_t> alignments;
@@ -3,16 +3,211 @@
 //
 
 #include "BidirectionalModel.h"
+#include <cassert>
 
 using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
 
-BidirectionalModel::BidirectionalModel(shared_ptr<bitable_t> table, bool forward, bool use_null,
+BidirectionalModel::BidirectionalModel(shared_ptr<TranslationTable> table, bool forward, bool use_null,
                                        bool favor_diagonal, double prob_align_null, double diagonal_tension)
         : Model(!forward, use_null, favor_diagonal, prob_align_null, diagonal_tension), table(table) {
 }
 
+void BidirectionalModel::Gather(const wordvec_t &source, const wordvec_t &target,
+                                const OnlineTable::Snapshot &snapshot, probability_matrix_t &output) const {
+    output.Reset(source.size(), target.size());
+
+    const auto kNullPair = pair<float, float>((float) kNullProbability, (float) kNullProbability);
+    size_t index;
+
+    // Row 0 holds P(t|NULL) in the forward direction, column 0 holds P(s|NULL) in the backward one
+    output.At(0, 0) = kNullPair;
+    for (size_t t = 0; t < target.size(); ++t) {
+        output.At(0, t + 1) = kNullPair;
+        if (table->Find(kNullWord, target[t], &index))
+            output.At(0, t + 1).first = table->GetForward(index);
+    }
+
+    for (size_t s = 0; s < source.size(); ++s) {
+        pair<float, float> *row = &output.At(s + 1, 0);
+
+        row[0] = kNullPair;
+        if (table->Find(source[s], kNullWord, &index))
+            row[0].second = table->GetBackward(index);
+
+        for (size_t t = 0; t < target.size(); ++t) {
+            if (table->Find(source[s], target[t], &index))
+                row[t + 1] = pair<float, float>(table->GetForward(index), table->GetBackward(index));
+            else
+                row[t + 1] = kNullPair;
+        }
+    }
+
+    if (snapshot.IsEmpty())
+        return;
+
+    // online updates of the words of the sentence pair
+    vector<const OnlineTable::record_t *> sources(source.size() + 1);
+    vector<const OnlineTable::record_t *> targets(target.size() + 1);
+
+    sources[0] = snapshot.Get(kNullWord);
+    for (size_t s = 0; s < source.size(); ++s)
+        sources[s + 1] = snapshot.Get(source[s]);
+
+    targets[0] = snapshot.Get(kNullWord);
+    for (size_t t = 0; t < target.size(); ++t)
+        targets[t + 1] = snapshot.Get(target[t]);
+
+    for (size_t t = 0; t < target.size(); ++t)
+        output.At(0, t + 1) = snapshot.Adjust(output.At(0, t + 1), sources[0], targets[t + 1], target[t]);
+
+    for (size_t s = 0; s < source.size(); ++s) {
+        pair<float, float> *row = &output.At(s + 1, 0);
+
+        row[0] = snapshot.Adjust(row[0], sources[s + 1], targets[0], kNullWord);
+        for (size_t t = 0; t < target.size(); ++t)
+            row[t + 1] = snapshot.Adjust(row[t + 1], sources[s + 1], targets[t + 1], target[t]);
+    }
+}
+
+struct BidirectionalModel::SentenceAlignmentJob {
+    const BidirectionalModel *forward;
+    const BidirectionalModel *backward;
+    const wordvec_t &source;
+    const wordvec_t &target;
+    alignment_t *outForward;
+    alignment_t *outBackward;
+    const Vocabulary *vocab;
+    const OnlineTable::Snapshot &snapshot;
+
+    template<bool kUseNull, bool kFavorDiagonal>
+    double Run() {
+        probability_matrix_t probabilities;
+        forward->Gather(source, target, snapshot, probabilities);
+
+        forward->ComputeViterbi<kUseNull, kFavorDiagonal>(source, target, probabilities, outForward, vocab);
+        backward->ComputeViterbi<kUseNull, kFavorDiagonal>(source, target, probabilities, outBackward, vocab);
+        return 0;
+    }
+};
+
+struct BidirectionalModel::BatchAlignmentJob {
+    const BidirectionalModel *forward;
+    const BidirectionalModel *backward;
+    const vector<pair<wordvec_t, wordvec_t>> &batch;
+    vector<alignment_t> &outForward;
+    vector<alignment_t> &outBackward;
+    const Vocabulary *vocab;
+    const OnlineTable::Snapshot &snapshot;
+
+    template<bool kUseNull, bool kFavorDiagonal>
+    double Run() {
+#pragma omp parallel
+        {
+            probability_matrix_t probabilities;
+
+#pragma omp for schedule(dynamic)
+            for (size_t i = 0; i < batch.size(); ++i) {
+                const wordvec_t &source = batch[i].first;
+                const wordvec_t &target = batch[i].second;
+
+                forward->Gather(source, target, snapshot, probabilities);
+                forward->ComputeViterbi<kUseNull, kFavorDiagonal>(source, target, probabilities, &outForward[i], vocab);
+                backward->ComputeViterbi<kUseNull, kFavorDiagonal>(source, target, probabilities, &outBackward[i],
+                                                                   vocab);
+            }
+        }
+
+        return 0;
+    }
+};
+
+struct BidirectionalModel::ExpectationJob {
+    const BidirectionalModel *forward;
+    const BidirectionalModel *backward;
+    const vector<pair<wordvec_t, wordvec_t>> &batch;
+    OnlineTable::counts_t &counts;
+
+    template<bool kUseNull, bool kFavorDiagonal>
+    double Run() {
+        OnlineTable::Snapshot snapshot(forward->online.get());
+        probability_matrix_t probabilities;
+
+        // the updates are computed by the calling thread only, alignments keep all the other threads
+        for (size_t n = 0; n < batch.size(); ++n) {
+            const wordvec_t &source = batch[n].first;
+            const wordvec_t &target = batch[n].second;
+
+            forward->Gather(source, target, snapshot, probabilities);
+
+            auto forward_probability = [&probabilities](length_t i, length_t j) -> double {
+                return probabilities.At(i, j + 1).first;
+            };
+            auto forward_count = [this, &source, &target](length_t i, length_t j, double p) {
+                word_t s = i == 0 ? kNullWord : source[i - 1];
+                counts.cells[((uint64_t) s << 32) | target[j]].first += p;
+                counts.totals[s].first += p;
+            };
+            forward->Model::ComputeAlignment<true, false, kUseNull, kFavorDiagonal>(
+                    source, target, forward_probability, forward_count, nullptr, nullptr);
+
+            auto backward_probability = [&probabilities](length_t i, length_t j) -> double {
+                return probabilities.At(j + 1, i).second;
+            };
+            auto backward_count = [this, &source, &target](length_t i, length_t j, double p) {
+                word_t t = i == 0 ? kNullWord : target[i - 1];
+                counts.cells[((uint64_t) source[j] << 32) | t].second += p;
+                counts.totals[t].second += p;
+            };
+            backward->Model::ComputeAlignment<true, false, kUseNull, kFavorDiagonal>(
+                    target, source, backward_probability, backward_count, nullptr, nullptr);
+        }
+
+        return 0;
+    }
+};
+
+void BidirectionalModel::ComputeAlignment(const BidirectionalModel *forward, const BidirectionalModel *backward,
+                                          const wordvec_t &source, const wordvec_t &target,
+                                          alignment_t *outForward, alignment_t *outBackward,
+                                          const Vocabulary *vocab) {
+    assert(forward->table == backward->table);
+
+    OnlineTable::Snapshot snapshot(forward->online.get());
+
+    SentenceAlignmentJob job{forward, backward, source, target, outForward, outBackward, vocab, snapshot};
+    bool flags[] = {forward->use_null, forward->favor_diagonal};
+    KernelDispatcher<SentenceAlignmentJob, 2>::Run(job, flags);
+}
+
+void BidirectionalModel::ComputeAlignments(const BidirectionalModel *forward, const BidirectionalModel *backward,
+                                           const vector<pair<wordvec_t, wordvec_t>> &batch,
+                                           vector<alignment_t> &outForward, vector<alignment_t> &outBackward,
+                                           const Vocabulary *vocab) {
+    assert(forward->table == backward->table);
+
+    outForward.resize(batch.size());
+    outBackward.resize(batch.size());
+
+    // the whole batch is aligned with the same version of the model
+    OnlineTable::Snapshot snapshot(forward->online.get());
+
+    BatchAlignmentJob job{forward, backward, batch, outForward, outBackward, vocab, snapshot};
+    bool flags[] = {forward->use_null, forward->favor_diagonal};
+    KernelDispatcher<BatchAlignmentJob, 2>::Run(job, flags);
+}
+
+void BidirectionalModel::ComputeExpectedCounts(const BidirectionalModel *forward, const BidirectionalModel *backward,
+                                               const vector<pair<wordvec_t, wordvec_t>> &batch,
+                                               OnlineTable::counts_t &counts) {
+    assert(forward->table == backward->table);
+
+    ExpectationJob job{forward, backward, batch, counts};
+    bool flags[] = {forward->use_null, forward->favor_diagonal};
+    KernelDispatcher<ExpectationJob, 2>::Run(job, flags);
+}
+
 void BidirectionalModel::Open(istream &in, Model **outForward, Model **outBackward) {
     bool use_null;
     bool favor_diagonal;
@@ -26,12 +221,12 @@ void BidirectionalModel::Open(istream &in, Model **outForward, Model **outBackwa
     in.read((char *) &fwd_diagonal_tension, sizeof(double));
     in.read((char *) &bwd_diagonal_tension, sizeof(double));
 
-    shared_ptr<bitable_t> table(new bitable_t);
+    shared_ptr<TranslationTable> table(new TranslationTable);
 
     size_t ttable_size;
     in.read((char *) &ttable_size, sizeof(size_t));
 
-    table->resize(ttable_size);
+    vector<TranslationTable::entry_t> row;
 
     while (true) {
         word_t sourceWord;
@@ -43,21 +238,20 @@ void BidirectionalModel::Open(istream &in, Model **outForward, Model **outBackwa
         size_t row_size;
         in.read((char *) &row_size, sizeof(size_t));
 
-        unordered_map<word_t, pair<float, float>> &row = table->at(sourceWord);
-        row.reserve(row_size);
+        row.resize(row_size);
 
         for (size_t i = 0; i < row_size; ++i) {
-            word_t targetWord;
-            float first, second;
-
-            in.read((char *) &targetWord, sizeof(word_t));
-            in.read((char *) &first, sizeof(float));
-            in.read((char *) &second, sizeof(float));
-
-            row[targetWord] = pair<float, float>(first, second);
+            in.read((char *) &row[i].first, sizeof(word_t));
+            in.read((char *) &row[i].second.first, sizeof(float));
+            in.read((char *) &row[i].second.second, sizeof(float));
         }
+
+        table->AppendRow(sourceWord, row);
     }
 
+    table->Resize(ttable_size);
+    table->ShrinkToFit();
+
     *outForward = new BidirectionalModel(table, true, use_null, favor_diagonal, prob_align_null, fwd_diagonal_tension);
     *outBackward = new BidirectionalModel(table, false, use_null, favor_diagonal, prob_align_null,
                                           bwd_diagonal_tension);
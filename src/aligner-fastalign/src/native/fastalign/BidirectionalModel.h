@@ -11,39 +11,129 @@
 
 #include "Model.h"
 #include "Vocabulary.h"
+#include "TranslationTable.h"
+#include "OnlineTable.h"
 
 namespace mmt {
     namespace fastalign {
 
         typedef std::vector<std::unordered_map<word_t, std::pair<float, float>>> bitable_t;
 
+        /**
+         * Sentence-local matrix of (forward, backward) translation probabilities: one row for each
+         * source word and one column for each target word, row and column 0 are the null word.
+         */
+        struct probability_matrix_t {
+            size_t columns;
+            std::vector<std::pair<float, float>> cells;
+
+            inline void Reset(size_t source_size, size_t target_size) {
+                columns = target_size + 1;
+                cells.resize((source_size + 1) * columns);
+            }
+
+            inline std::pair<float, float> &At(size_t source, size_t target) {
+                return cells[source * columns + target];
+            }
+
+            inline const std::pair<float, float> &At(size_t source, size_t target) const {
+                return cells[source * columns + target];
+            }
+        };
+
         class BidirectionalModel : public Model {
+            friend class ModelFile;
+
         public:
-            BidirectionalModel(std::shared_ptr<bitable_t> table, bool forward, bool use_null,
+            BidirectionalModel(std::shared_ptr<TranslationTable> table, bool forward, bool use_null,
                                bool favor_diagonal, double prob_align_null, double diagonal_tension);
 
             inline double GetProbability(word_t source, word_t target) override {
                 if (is_reverse)
                     std::swap(source, target);
 
-                if (table->empty())
-                    return kNullProbability;
-                if (source >= table->size())
+                size_t index;
+                if (!table->Find(source, target, &index))
                     return kNullProbability;
 
-                std::unordered_map<word_t, std::pair<float, float>> &row = table->at(source);
-                auto ptr = row.find(target);
-                return ptr == row.end() ? kNullProbability : (is_reverse ? ptr->second.second : ptr->second.first);
+                return is_reverse ? table->GetBackward(index) : table->GetForward(index);
             }
 
             inline void IncrementProbability(word_t source, word_t target, double amount) override {
                 // no-op
             }
 
+            inline const std::shared_ptr<TranslationTable> &GetTable() const {
+                return table;
+            }
+
+            /**
+             * Enables the online updates of the model, "forward" and "backward" must share the same table.
+             */
+            inline void SetOnlineTable(std::shared_ptr<OnlineTable> online) {
+                this->online = online;
+            }
+
+            /**
+             * Reads from the translation table all the (forward, backward) probabilities needed to align
+             * the given sentence pair: both directions share the same cells, so every pair of words is
+             * looked up only once. Probabilities include the online updates visible in the snapshot.
+             */
+            void Gather(const wordvec_t &source, const wordvec_t &target, const OnlineTable::Snapshot &snapshot,
+                        probability_matrix_t &output) const;
+
+            /**
+             * Computes the forward and backward alignments with a single table lookup per pair of words,
+             * "forward" and "backward" must share the same translation table.
+             */
+            static void ComputeAlignment(const BidirectionalModel *forward, const BidirectionalModel *backward,
+                                         const wordvec_t &source, const wordvec_t &target,
+                                         alignment_t *outForward, alignment_t *outBackward,
+                                         const Vocabulary *vocab = nullptr);
+
+            static void ComputeAlignments(const BidirectionalModel *forward, const BidirectionalModel *backward,
+                                          const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                                          std::vector<alignment_t> &outForward, std::vector<alignment_t> &outBackward,
+                                          const Vocabulary *vocab = nullptr);
+
+            /**
+             * E-step of the online updates: adds to "counts" the expected counts of the batch in both directions,
+             * computed with the current probabilities of the model.
+             */
+            static void ComputeExpectedCounts(const BidirectionalModel *forward, const BidirectionalModel *backward,
+                                              const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                                              OnlineTable::counts_t &counts);
+
             static void Open(std::istream &in, Model **outForward, Model **outBackward);
 
         private:
-            const std::shared_ptr<bitable_t> table;
+            const std::shared_ptr<TranslationTable> table;
+            std::shared_ptr<OnlineTable> online;
+
+            struct SentenceAlignmentJob;
+            struct BatchAlignmentJob;
+            struct ExpectationJob;
+
+            template<bool kUseNull, bool kFavorDiagonal>
+            inline void ComputeViterbi(const wordvec_t &source, const wordvec_t &target,
+                                       const probability_matrix_t &probabilities, alignment_t *outAlignment,
+                                       const Vocabulary *vocab) const {
+                auto count = [](length_t, length_t, double) {};
+
+                if (is_reverse) {
+                    auto probability = [&probabilities](length_t i, length_t j) -> double {
+                        return probabilities.At(j + 1, i).second;
+                    };
+                    Model::ComputeAlignment<false, true, kUseNull, kFavorDiagonal>(target, source, probability, count,
+                                                                                   outAlignment, vocab);
+                } else {
+                    auto probability = [&probabilities](length_t i, length_t j) -> double {
+                        return probabilities.At(i, j + 1).first;
+                    };
+                    Model::ComputeAlignment<false, true, kUseNull, kFavorDiagonal>(source, target, probability, count,
+                                                                                   outAlignment, vocab);
+                }
+            }
         };
     }
 }
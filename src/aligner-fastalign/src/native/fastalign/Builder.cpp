@@ -3,14 +3,23 @@
 //
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <thread>
+#include <cstring>
 #include <assert.h>
 #include <unordered_set>
+#include <limits>
 #include <boost/filesystem.hpp>
 #include "DiagonalAlignment.h"
 #include "Builder.h"
 #include "BidirectionalModel.h"
+#include "ModelFile.h"
 #include "ioutils.h"
+#include "hashutils.h"
+#include "Pipeline.h"
+#include "ShardedTable.h"
+#include "Checkpoint.h"
 
 #include <math.h>       /* isnormal */
 
@@ -43,80 +52,436 @@ inline double digamma(double x) {
     return result;
 }
 
-class BuilderModel : public Model {
+/*
+ * The M-step kernels below have no branches and no library calls, so that loops over them are
+ * vectorized. Selections are done with arithmetic: with the default -ftrapping-math the compiler
+ * does not if-convert floating point conditionals.
+ */
+
+/**
+ * exp(y) with relative error below 1e-14, y is clamped to [-700, 700].
+ */
+inline double exp_kernel(double y) {
+    static const double kShifter = 6755399441055744.0;  // 1.5 * 2^52, rounds to integer when added
+
+    double low = (double) (y < -700.), high = (double) (y > 700.);
+    y = y * (1. - low - high) - 700. * low + 700. * high;
+
+    // y = k ln2 + f, |f| <= ln2 / 2
+    double kd = y * 1.4426950408889634 + kShifter;
+    double k = kd - kShifter;
+    double f = y - k * 6.93147180369123816490e-01 - k * 1.90821492927058770002e-10;
+
+    double p = 1. / 39916800.;
+    p = p * f + 1. / 3628800.;
+    p = p * f + 1. / 362880.;
+    p = p * f + 1. / 40320.;
+    p = p * f + 1. / 5040.;
+    p = p * f + 1. / 720.;
+    p = p * f + 1. / 120.;
+    p = p * f + 1. / 24.;
+    p = p * f + 1. / 6.;
+    p = p * f + 0.5;
+    p = p * f + 1.;
+    p = p * f + 1.;
+
+    // 2^k from the low bits of kd
+    uint64_t bits;
+    memcpy(&bits, &kd, sizeof(bits));
+    bits = (bits + 1023) << 52;
+
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+
+    return p * scale;
+}
+
+/**
+ * exp(digamma(x) - shift) for x > 0. The recurrence digamma(x) = digamma(x + 1) - 1/x raises x over 7
+ * in at most 7 steps, then the log(x) term of the asymptotic series cancels out with the exp.
+ */
+inline double exp_digamma_kernel(double x, double shift) {
+    double result = 0, xx, xx2, xx4;
+    for (int step = 0; step < 7; ++step) {
+        double increment = (double) (x < 7);
+        result -= increment / x;
+        x += increment;
+    }
+    x -= 1.0 / 2.0;
+    xx = 1.0 / x;
+    xx2 = xx * xx;
+    xx4 = xx2 * xx2;
+    result += (1. / 24.) * xx2 - (7.0 / 960.0) * xx4 + (31.0 / 8064.0) * xx4 * xx2 -
+              (127.0 / 30720.0) * xx4 * xx4;
+    return x * exp_kernel(result - shift);
+}
+
+/**
+ * Per-thread sparse buffer of expected counts, keyed by the address of the table cell.
+ * Cells are split in shards by address, so that the buffers of all the threads can be merged
+ * in parallel without atomics: every shard is merged by a single thread.
+ */
+class CountBuffer {
 public:
-    vector<unordered_map<word_t, pair<double, double>>> data;
+    explicit CountBuffer(size_t shards = 1) : shards(shards) {
+    }
 
-    BuilderModel(bool is_reverse, bool use_null, bool favor_diagonal, double prob_align_null, double diagonal_tension)
-            : Model(is_reverse, use_null, favor_diagonal, prob_align_null, diagonal_tension) {
+    inline void Add(double *cell, double amount) {
+        uint64_t hash = hash_mix((uint64_t) cell);
+        shards[hash_reduce(hash, shards.size())].Add(cell, hash, amount);
     }
 
-    ~BuilderModel() {};
+    /**
+     * Adds the counts of the given shard to the table cells, then clears the shard.
+     */
+    inline void Flush(size_t shard) {
+        shards[shard].Flush();
+    }
+
+private:
+    // Open addressing with linear probing, the capacity is a power of 2
+    struct shard_t {
+        vector<pair<double *, double>> slots;
+        size_t size = 0;
+
+        inline void Add(double *cell, uint64_t hash, double amount) {
+            if ((size + 1) * 2 > slots.size())
+                Grow();
+
+            size_t mask = slots.size() - 1;
+            size_t index = hash & mask;
+            while (slots[index].first != nullptr && slots[index].first != cell)
+                index = (index + 1) & mask;
+
+            if (slots[index].first == nullptr) {
+                slots[index].first = cell;
+                size++;
+            }
+
+            slots[index].second += amount;
+        }
+
+        void Grow() {
+            vector<pair<double *, double>> old(max(slots.size() * 2, (size_t) 1024),
+                                               pair<double *, double>(nullptr, 0));
+            old.swap(slots);
+
+            size_t mask = slots.size() - 1;
+            for (auto slot = old.begin(); slot != old.end(); ++slot) {
+                if (slot->first == nullptr)
+                    continue;
 
-    double GetProbability(word_t source, word_t target) override {
-        if (data.empty())
-            return kNullProbability;
-        if (source >= data.size())
-            return kNullProbability;
+                size_t index = hash_mix((uint64_t) slot->first) & mask;
+                while (slots[index].first != nullptr)
+                    index = (index + 1) & mask;
+                slots[index] = *slot;
+            }
+        }
 
-        unordered_map<word_t, pair<double, double>> &row = data[source];
-        auto ptr = row.find(target);
-        return ptr == row.end() ? kNullProbability : ptr->second.first;
+        void Flush() {
+            if (size == 0)
+                return;
+
+            for (auto slot = slots.begin(); slot != slots.end(); ++slot) {
+                if (slot->first != nullptr) {
+                    *slot->first += slot->second;
+                    *slot = pair<double *, double>(nullptr, 0);
+                }
+            }
+
+            size = 0;
+        }
+    };
+
+    vector<shard_t> shards;
+};
+
+/**
+ * M-step on a single row: the expected counts become the new probabilities, counts are reset.
+ * If keepUnseen is true, a row without counts keeps its probabilities.
+ * Returns the total variation distance between the previous and the new probabilities of the row.
+ */
+static inline double NormalizeCells(double *counts, float *probs, size_t size, double alpha, bool keepUnseen) {
+    if (keepUnseen) {
+        bool seen = false;
+        for (size_t i = 0; i < size; ++i)
+            seen |= counts[i] != 0;
+
+        if (!seen)
+            return 0;
     }
 
-    void IncrementProbability(word_t source, word_t target, double amount) override {
-#pragma omp atomic
-        data[source][target].second += amount;
+    double change = 0;
+
+    double row_norm = 0;
+    for (size_t i = 0; i < size; ++i)
+        row_norm += counts[i] + alpha;
+
+    if (row_norm == 0) row_norm = 1;
+
+    if (alpha > 0) {
+        row_norm = digamma(row_norm);
+        assert(isnormal(row_norm));
+
+#pragma omp simd reduction(+:change)
+        for (size_t i = 0; i < size; ++i) {
+            auto probability = (float) exp_digamma_kernel(counts[i] + alpha, row_norm);
+            change += fabs((double) probability - probs[i]);
+            probs[i] = probability;
+            counts[i] = 0;
+        }
+    } else {
+        assert(isnormal(row_norm));
+
+#pragma omp simd reduction(+:change)
+        for (size_t i = 0; i < size; ++i) {
+            auto probability = (float) (counts[i] / row_norm);
+            change += fabs((double) probability - probs[i]);
+            probs[i] = probability;
+            counts[i] = 0;
+        }
     }
 
-    void Prune(double threshold = 1e-20) {
-#pragma omp parallel for schedule(dynamic)
-        for (size_t i = 0; i < data.size(); ++i) {
-            unordered_map<word_t, pair<double, double>> &row = data[i];
-
-            for (auto cell = row.cbegin(); cell != row.cend(); /* no increment */) {
-                if (cell->second.first <= threshold)
-                    cell = row.erase(cell);
-                else
-                    ++cell;
+    return change / 2;
+}
+
+/**
+ * Calls cell(source, target, probability) for the cells of a base model table that belong to the rows
+ * [begin, end) of the given direction. The base table has the rows of the forward direction, cells
+ * missing in a direction have the null probability and are skipped.
+ */
+template<typename Cell>
+static void ForEachBaseCell(const TranslationTable &base, bool reverse, word_t begin, word_t end, const Cell &cell) {
+    const uint64_t *offsets = base.GetOffsets();
+    const word_t *targets = base.GetTargets();
+    const auto null_probability = (float) kNullProbability;
+
+    if (reverse) {
+        for (word_t source = 0; source < base.RowsCount(); ++source) {
+            for (uint64_t i = offsets[source]; i < offsets[source + 1]; ++i) {
+                if (targets[i] < begin || targets[i] >= end)
+                    continue;
+
+                float probability = base.GetBackward(i);
+                if (probability > null_probability)
+                    cell(targets[i], source, probability);
+            }
+        }
+    } else {
+        for (word_t source = begin; source < end && source < base.RowsCount(); ++source) {
+            for (uint64_t i = offsets[source]; i < offsets[source + 1]; ++i) {
+                float probability = base.GetForward(i);
+                if (probability > null_probability)
+                    cell(source, targets[i], probability);
             }
         }
     }
+}
+
+/**
+ * Base class of the models trained by the Builder.
+ *
+ * The EM iterations can read the table in shards: an iteration runs one E-step pass over the
+ * corpus for every shard, and only the counts of the cells of the current shard are accumulated.
+ * Tables kept in memory have a single shard.
+ */
+class TrainingModel : public Model {
+public:
+    static const size_t kNotFound = SIZE_MAX;
+
+    TrainingModel(bool is_reverse, bool use_null, bool favor_diagonal, double prob_align_null,
+                  double diagonal_tension)
+            : Model(is_reverse, use_null, favor_diagonal, prob_align_null, diagonal_tension) {
+    }
 
-    void Normalize(double alpha = 0) {
-        for (size_t i = 0; i < data.size(); ++i) {
-            unordered_map<word_t, pair<double, double>> &row = data[i];
-            double row_norm = 0;
+    /**
+     * E-step: accumulates the expected counts of the batch in the cells of the current shard, and adds
+     * the log-likelihood of the batch to outLogLikelihood.
+     */
+    virtual double ComputeExpectedCounts(const vector<pair<wordvec_t, wordvec_t>> &batch,
+                                         double *outLogLikelihood) = 0;
 
-            for (auto cell = row.begin(); cell != row.end(); ++cell)
-                row_norm += cell->second.first + alpha;
+    virtual size_t ShardsCount() const {
+        return 1;
+    }
 
-            if (row_norm == 0) row_norm = 1;
+    virtual void BeginShard(size_t shard) {
+    }
 
-            if (alpha > 0)
-                row_norm = digamma(row_norm);
+    /**
+     * Called when the counts of the shard are complete.
+     */
+    virtual void EndShard(size_t shard, double alpha) {
+    }
 
-            assert(isnormal(row_norm));
+    /**
+     * M-step: the expected counts become the new probabilities. If prune is true, the table is also
+     * pruned as Prune() does. Returns the mean total variation distance between the previous and the
+     * new probabilities of the rows.
+     */
+    virtual double Normalize(double alpha = 0, bool prune = false, double threshold = 1e-20) = 0;
+
+    virtual void Prune(double threshold = 1e-20) = 0;
+
+    /**
+     * Warm start: sets the probabilities of the cells that are also in the table of the base model.
+     * After this call, rows that get no counts in an iteration keep their probabilities.
+     */
+    virtual void Seed(const TranslationTable &base) = 0;
+
+    /**
+     * Returns a job that writes the probabilities of the cells, in table order, to the given file:
+     * the job can run in another thread while the training goes on.
+     */
+    virtual function<void()> SnapshotProbabilities(const string &filename) = 0;
+
+    /**
+     * Sets the probabilities of the cells from a file written by SnapshotProbabilities().
+     */
+    virtual void Restore(const string &filename, bool keepUnseen) = 0;
+
+    inline bool KeepsUnseen() const {
+        return keep_unseen;
+    }
 
-            for (auto cell = row.begin(); cell != row.end(); ++cell)
-                cell->second.first =
-                        alpha > 0 ?
-                        exp(digamma(cell->second.first + alpha) - row_norm) :
-                        cell->second.first / row_norm;
-        }
+    /**
+     * Approximate heap memory used by the translation table, in bytes.
+     */
+    virtual size_t GetMemoryUsage() const = 0;
+
+    /**
+     * Writes the table as model parameters, rows count, then every non-empty row as source word,
+     * row size and (target word, probability) cells.
+     */
+    virtual void Store(const string &filename) = 0;
+
+    /**
+     * Releases the translation table, only the model parameters are kept.
+     */
+    virtual void Release() = 0;
+
+    virtual bool IsSharded() const {
+        return false;
     }
 
-    void Swap() {
+protected:
+    vector<CountBuffer> count_buffers;
+    bool keep_unseen = false;
+
+    /**
+     * E-step over a batch. TModel provides Find(), GetCellProbability() and GetCounts(); the class
+     * is final, so the kernel calls are not virtual.
+     */
+    template<typename TModel>
+    struct ExpectationJob {
+        TModel *model;
+        const vector<pair<wordvec_t, wordvec_t>> &batch;
+        double *log_likelihood;
+
+        template<bool kTrain, bool kViterbi, bool kUseNull, bool kFavorDiagonal>
+        double Run() {
+            double emp_feat = 0.0;
+            double batch_log_likelihood = 0.0;
+
+#ifdef _OPENMP
+            auto threads = (size_t) omp_get_max_threads();
+#else
+            size_t threads = 1;
+#endif
+            vector<CountBuffer> &buffers = model->count_buffers;
+            if (buffers.size() != threads)
+                buffers.assign(threads, CountBuffer(threads));
+
+            // with a single thread counts are added directly to the table
+            const bool direct = threads == 1;
+
+            // counts of the cells in [counts_begin, counts_begin + counts_size)
+            size_t counts_begin, counts_size;
+            double *counts = model->GetCounts(&counts_begin, &counts_size);
+
+#pragma omp parallel reduction(+:emp_feat, batch_log_likelihood)
+            {
+#ifdef _OPENMP
+                CountBuffer &buffer = buffers[omp_get_thread_num()];
+#else
+                CountBuffer &buffer = buffers[0];
+#endif
+                // The kernel reads all the probabilities of a target word before its counts,
+                // so every count reuses the cell found by the probability lookup
+                vector<size_t> cells;
+
+#pragma omp for schedule(dynamic)
+                for (size_t n = 0; n < batch.size(); ++n) {
+                    const wordvec_t &src = model->is_reverse ? batch[n].second : batch[n].first;
+                    const wordvec_t &trg = model->is_reverse ? batch[n].first : batch[n].second;
+
+                    cells.resize(src.size() + 1);
+
+                    auto probability = [this, &src, &trg, &cells](length_t i, length_t j) -> double {
+                        size_t cell = model->Find(i == 0 ? kNullWord : src[i - 1], trg[j]);
+                        cells[i] = cell;
+                        return cell == kNotFound ? kNullProbability : model->GetCellProbability(cell);
+                    };
+                    auto count = [&cells, &buffer, counts, counts_begin, counts_size, direct]
+                            (length_t i, length_t, double p) {
+                        // skips cells of other shards and, with kNotFound, missing cells: all the pairs
+                        // of the corpus have a cell since the initial pass
+                        size_t cell = cells[i] - counts_begin;
+                        if (cell >= counts_size)
+                            return;
+
+                        if (direct)
+                            counts[cell] += p;
+                        else
+                            buffer.Add(&counts[cell], p);
+                    };
+
+                    emp_feat += model->template ComputeAlignment<kTrain, kViterbi, kUseNull, kFavorDiagonal>(
+                            src, trg, probability, count, nullptr, nullptr, &batch_log_likelihood);
+                }
+            }
+
+            // Owner-computes merge: every shard is flushed by a single thread
 #pragma omp parallel for schedule(dynamic)
-        for (size_t i = 0; i < data.size(); ++i) {
-            for (auto cell = data[i].begin(); cell != data[i].end(); ++cell) {
-                cell->second.first = cell->second.second;
-                cell->second.second = 0;
+            for (size_t shard = 0; shard < threads; ++shard) {
+                for (auto buffer = buffers.begin(); buffer != buffers.end(); ++buffer)
+                    buffer->Flush(shard);
             }
+
+            assert(isnormal(emp_feat));
+            *log_likelihood += batch_log_likelihood;
+            return emp_feat;
         }
+    };
+
+    static void WriteProbabilities(const string &filename, const float *probs, size_t size) {
+        ofstream out(filename, ios::binary | ios::out);
+        out.write((const char *) probs, size * sizeof(float));
+        out.close();
+
+        if (!out)
+            throw runtime_error("unable to write the checkpoint file: " + filename);
+    }
+
+    static void ReadProbabilities(istream &in, const string &filename, float *probs, size_t size) {
+        in.read((char *) probs, size * sizeof(float));
+        if (!in)
+            throw runtime_error("corrupted checkpoint file: " + filename);
     }
 
-    void Store(const string &filename) {
+    template<typename TModel>
+    double RunExpectation(TModel *model, const vector<pair<wordvec_t, wordvec_t>> &batch, double *outLogLikelihood) {
+        ExpectationJob<TModel> job{model, batch, outLogLikelihood};
+        bool flags[] = {use_null, favor_diagonal};
+        return KernelDispatcher<ExpectationJob<TModel>, 2, true, false>::Run(job, flags);
+    }
+
+    /**
+     * Writes the table in the format of Store(), skipping the cells with probability lower or equal
+     * to threshold if prune is true.
+     */
+    void StoreTable(const string &filename, size_t rows, const uint64_t *offsets, const word_t *targets,
+                    const float *probs, bool prune, double threshold) const {
         ofstream out(filename, ios::binary | ios::out);
 
         io_write(out, use_null);
@@ -124,24 +489,423 @@ public:
         io_write(out, prob_align_null);
         io_write(out, diagonal_tension);
 
-        io_write(out, data.size());
+        io_write(out, rows);
 
-        for (word_t sourceWord = 0; sourceWord < data.size(); ++sourceWord) {
-            unordered_map<word_t, pair<double, double>> &row = data[sourceWord];
+        for (word_t sourceWord = 0; sourceWord < rows; ++sourceWord) {
+            size_t row_size = 0;
+            for (uint64_t i = offsets[sourceWord]; i < offsets[sourceWord + 1]; ++i)
+                row_size += (!prune || probs[i] > threshold) ? 1 : 0;
 
-            if (!row.empty()) {
+            if (row_size > 0) {
                 io_write(out, sourceWord);
-                io_write(out, row.size());
+                io_write(out, row_size);
+
+                for (uint64_t i = offsets[sourceWord]; i < offsets[sourceWord + 1]; ++i) {
+                    if (!prune || probs[i] > threshold) {
+                        io_write(out, targets[i]);
+                        io_write(out, probs[i]);
+                    }
+                }
+            }
+        }
+
+        if (!out)
+            throw runtime_error("unable to write the model file: " + filename);
+    }
+};
+
+/**
+ * Training translation table in CSR form: the cells of every source word are sorted by target word.
+ * The sparsity pattern is set by the initial pass and never changes during the EM iterations; a cell
+ * takes 16 bytes: target word, float probability and double expected count.
+ */
+class BuilderModel final : public TrainingModel {
+public:
+    vector<uint64_t> offsets;
+    vector<word_t> targets;
+    vector<float> probs;
+    vector<double> counts;
+
+    BuilderModel(bool is_reverse, bool use_null, bool favor_diagonal, double prob_align_null, double diagonal_tension)
+            : TrainingModel(is_reverse, use_null, favor_diagonal, prob_align_null, diagonal_tension) {
+    }
+
+    ~BuilderModel() {};
+
+    /**
+     * Memory needed to train a table with the given number of cells and rows, in bytes.
+     */
+    static size_t EstimateMemoryUsage(size_t size, size_t rows) {
+        return size * (sizeof(word_t) + sizeof(float) + sizeof(double)) + (rows + 1) * sizeof(uint64_t);
+    }
+
+    inline size_t RowsCount() const {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+
+    /**
+     * Returns the index of the cell, or kNotFound.
+     */
+    inline size_t Find(word_t source, word_t target) const {
+        if (source >= RowsCount())
+            return kNotFound;
+
+        // branch-free lower bound: rows of frequent words are long and their lookups unpredictable
+        const word_t *cell = targets.data() + offsets[source];
+        size_t length = offsets[source + 1] - offsets[source];
 
-                for (auto entry = row.begin(); entry != row.end(); ++entry) {
-                    io_write(out, entry->first);
-                    io_write(out, (float) (entry->second.first));
+        if (length == 0)
+            return kNotFound;
+
+        while (length > 1) {
+            size_t half = length / 2;
+            cell = (cell[half] <= target) ? cell + half : cell;
+            length -= half;
+        }
+
+        return *cell == target ? (size_t) (cell - targets.data()) : kNotFound;
+    }
+
+    inline float GetCellProbability(size_t cell) const {
+        return probs[cell];
+    }
+
+    inline double *GetCounts(size_t *outBegin, size_t *outSize) {
+        *outBegin = 0;
+        *outSize = counts.size();
+        return counts.data();
+    }
+
+    inline double GetProbability(word_t source, word_t target) override {
+        size_t cell = Find(source, target);
+        return cell == kNotFound ? kNullProbability : probs[cell];
+    }
+
+    inline void IncrementProbability(word_t source, word_t target, double amount) override {
+        // all the pairs of the corpus have a cell since the initial pass
+        size_t cell = Find(source, target);
+        if (cell != kNotFound) {
+#pragma omp atomic
+            counts[cell] += amount;
+        }
+    }
+
+    /**
+     * Replaces the table cells with the given (source << 32 | target) keys, that must be sorted and unique.
+     */
+    void Assign(const vector<uint64_t> &keys) {
+        size_t rows = keys.empty() ? 0 : (size_t) (keys.back() >> 32) + 1;
+
+        offsets.assign(rows + 1, 0);
+        targets.resize(keys.size());
+        probs.assign(keys.size(), (float) kNullProbability);
+        counts.assign(keys.size(), 0.);
+
+        for (size_t i = 0; i < keys.size(); ++i) {
+            offsets[(keys[i] >> 32) + 1]++;
+            targets[i] = (word_t) (keys[i] & 0xffffffff);
+        }
+
+        for (size_t row = 0; row < rows; ++row)
+            offsets[row + 1] += offsets[row];
+    }
+
+    double ComputeExpectedCounts(const vector<pair<wordvec_t, wordvec_t>> &batch,
+                                 double *outLogLikelihood) override {
+        return RunExpectation(this, batch, outLogLikelihood);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return offsets.capacity() * sizeof(uint64_t) + targets.capacity() * sizeof(word_t) +
+               probs.capacity() * sizeof(float) + counts.capacity() * sizeof(double);
+    }
+
+    void Prune(double threshold = 1e-20) override {
+        vector<uint64_t> kept(RowsCount() + 1, 0);
+
+#pragma omp parallel for schedule(dynamic, 256)
+        for (size_t row = 0; row < RowsCount(); ++row)
+            kept[row + 1] = CountAbove(row, threshold);
+
+        Compact(kept, threshold);
+    }
+
+    void Release() override {
+        vector<uint64_t>().swap(offsets);
+        vector<word_t>().swap(targets);
+        vector<float>().swap(probs);
+        vector<double>().swap(counts);
+    }
+
+    /**
+     * Rows are normalized in parallel, pruning is done in the same pass.
+     */
+    double Normalize(double alpha = 0, bool prune = false, double threshold = 1e-20) override {
+        vector<uint64_t> kept(prune ? RowsCount() + 1 : 0, 0);
+        double change = 0;
+
+#pragma omp parallel for schedule(dynamic, 256) reduction(+:change)
+        for (size_t row = 0; row < RowsCount(); ++row) {
+            change += NormalizeCells(counts.data() + offsets[row], probs.data() + offsets[row],
+                                     offsets[row + 1] - offsets[row], alpha, keep_unseen);
+
+            if (prune)
+                kept[row + 1] = CountAbove(row, threshold);
+        }
+
+        if (prune)
+            Compact(kept, threshold);
+
+        return RowsCount() > 0 ? change / RowsCount() : 0;
+    }
+
+    void Seed(const TranslationTable &base) override {
+        ForEachBaseCell(base, is_reverse, 0, (word_t) RowsCount(), [this](word_t source, word_t target, float p) {
+            size_t cell = Find(source, target);
+            if (cell != kNotFound)
+                probs[cell] = p;
+        });
+
+        keep_unseen = true;
+    }
+
+    function<void()> SnapshotProbabilities(const string &filename) override {
+        shared_ptr<vector<float>> snapshot(new vector<float>(probs));
+        return [snapshot, filename]() {
+            WriteProbabilities(filename, snapshot->data(), snapshot->size());
+        };
+    }
+
+    void Restore(const string &filename, bool keepUnseen) override {
+        ifstream in(filename, ios::binary | ios::in);
+        ReadProbabilities(in, filename, probs.data(), probs.size());
+        keep_unseen = keepUnseen;
+    }
+
+    void Store(const string &filename) override {
+        StoreTable(filename, RowsCount(), offsets.data(), targets.data(), probs.data(), false, 0);
+    }
+
+private:
+    inline uint64_t CountAbove(size_t row, double threshold) const {
+        uint64_t count = 0;
+        for (uint64_t i = offsets[row]; i < offsets[row + 1]; ++i)
+            count += probs[i] > threshold ? 1 : 0;
+        return count;
+    }
+
+    /**
+     * Keeps only the cells with probability greater than threshold, given the number of kept cells
+     * of every row in kept[row + 1]. Counts are released, the table cannot be trained anymore.
+     */
+    void Compact(vector<uint64_t> &kept, double threshold) {
+        vector<double>().swap(counts);
+
+        for (size_t row = 0; row < RowsCount(); ++row)
+            kept[row + 1] += kept[row];
+
+        vector<word_t> kept_targets(kept.back());
+        vector<float> kept_probs(kept.back());
+
+#pragma omp parallel for schedule(dynamic, 256)
+        for (size_t row = 0; row < RowsCount(); ++row) {
+            uint64_t size = kept[row];
+
+            for (uint64_t i = offsets[row]; i < offsets[row + 1]; ++i) {
+                if (probs[i] > threshold) {
+                    kept_targets[size] = targets[i];
+                    kept_probs[size] = probs[i];
+                    size++;
                 }
             }
         }
+
+        offsets.swap(kept);
+        targets.swap(kept_targets);
+        probs.swap(kept_probs);
     }
 };
 
+/**
+ * Out-of-core training model: the table is a ShardedTable on disk, only the expected counts of the
+ * current shard are kept in memory. Every shard is normalized as soon as its counts are complete,
+ * Normalize() publishes the new probabilities of all the shards.
+ */
+class ShardedBuilderModel final : public TrainingModel {
+public:
+    ShardedBuilderModel(bool is_reverse, bool use_null, bool favor_diagonal, double prob_align_null,
+                        double diagonal_tension, const string &path, PairSet &pairs, size_t memoryBudget)
+            : TrainingModel(is_reverse, use_null, favor_diagonal, prob_align_null, diagonal_tension),
+              table(new ShardedTable(path, pairs, memoryBudget, (float) kNullProbability)) {
+    }
+
+    inline size_t Find(word_t source, word_t target) const {
+        return table->Find(source, target);
+    }
+
+    inline float GetCellProbability(size_t cell) const {
+        return table->GetProbabilities()[cell];
+    }
+
+    inline double *GetCounts(size_t *outBegin, size_t *outSize) {
+        *outBegin = counts_begin;
+        *outSize = counts.size();
+        return counts.data();
+    }
+
+    inline double GetProbability(word_t source, word_t target) override {
+        size_t cell = Find(source, target);
+        return cell == kNotFound ? kNullProbability : GetCellProbability(cell);
+    }
+
+    inline void IncrementProbability(word_t source, word_t target, double amount) override {
+        size_t cell = Find(source, target) - counts_begin;
+        if (cell < counts.size()) {
+#pragma omp atomic
+            counts[cell] += amount;
+        }
+    }
+
+    double ComputeExpectedCounts(const vector<pair<wordvec_t, wordvec_t>> &batch,
+                                 double *outLogLikelihood) override {
+        return RunExpectation(this, batch, outLogLikelihood);
+    }
+
+    size_t ShardsCount() const override {
+        return table->ShardsCount();
+    }
+
+    void BeginShard(size_t shard) override {
+        const uint64_t *offsets = table->GetOffsets();
+
+        counts_begin = offsets[table->GetShardBegin(shard)];
+        counts.assign(offsets[table->GetShardBegin(shard + 1)] - counts_begin, 0.);
+    }
+
+    void EndShard(size_t shard, double alpha) override {
+        const uint64_t *offsets = table->GetOffsets();
+        word_t begin = table->GetShardBegin(shard);
+        word_t end = table->GetShardBegin(shard + 1);
+
+        shard_probs.resize(counts.size());
+
+        // previous probabilities are kept by the rows without counts and measure the change of the others
+        const float *probs = table->GetProbabilities() + counts_begin;
+        copy(probs, probs + counts.size(), shard_probs.begin());
+
+        double change = 0;
+
+#pragma omp parallel for schedule(dynamic, 256) reduction(+:change)
+        for (word_t row = begin; row < end; ++row) {
+            uint64_t cell = offsets[row] - counts_begin;
+            change += NormalizeCells(counts.data() + cell, shard_probs.data() + cell,
+                                     offsets[row + 1] - offsets[row], alpha, keep_unseen);
+        }
+
+        table_change += change;
+
+        table->WriteShard(shard, shard_probs.data());
+        counts.clear();
+    }
+
+    double Normalize(double alpha = 0, bool prune = false, double threshold = 1e-20) override {
+        table->Commit();
+
+        if (prune)
+            Prune(threshold);
+
+        double change = table->RowsCount() > 0 ? table_change / table->RowsCount() : 0;
+        table_change = 0;
+
+        return change;
+    }
+
+    void Prune(double threshold = 1e-20) override {
+        // cells are skipped by Store()
+        pruned = true;
+        pruning_threshold = threshold;
+    }
+
+    void Seed(const TranslationTable &base) override {
+        const uint64_t *offsets = table->GetOffsets();
+
+        // the seeded probabilities are written shard by shard, as the iterations do
+        for (size_t shard = 0; shard < ShardsCount(); ++shard) {
+            word_t begin = table->GetShardBegin(shard);
+            uint64_t cells_begin = offsets[begin];
+
+            shard_probs.assign(offsets[table->GetShardBegin(shard + 1)] - cells_begin, (float) kNullProbability);
+            ForEachBaseCell(base, is_reverse, begin, table->GetShardBegin(shard + 1),
+                            [this, cells_begin](word_t source, word_t target, float p) {
+                                size_t cell = Find(source, target);
+                                if (cell != kNotFound)
+                                    shard_probs[cell - cells_begin] = p;
+                            });
+
+            table->WriteShard(shard, shard_probs.data());
+        }
+
+        table->Commit();
+        keep_unseen = true;
+    }
+
+    function<void()> SnapshotProbabilities(const string &filename) override {
+        // a committed file is never modified, Commit() replaces it: a hard link is a snapshot
+        boost::system::error_code error;
+        fs::remove(filename);
+        fs::create_hard_link(table->GetProbabilitiesPath(), filename, error);
+        if (error)
+            fs::copy_file(table->GetProbabilitiesPath(), filename);
+
+        return []() {};
+    }
+
+    void Restore(const string &filename, bool keepUnseen) override {
+        const uint64_t *offsets = table->GetOffsets();
+        ifstream in(filename, ios::binary | ios::in);
+
+        for (size_t shard = 0; shard < ShardsCount(); ++shard) {
+            shard_probs.resize(offsets[table->GetShardBegin(shard + 1)] - offsets[table->GetShardBegin(shard)]);
+            ReadProbabilities(in, filename, shard_probs.data(), shard_probs.size());
+            table->WriteShard(shard, shard_probs.data());
+        }
+
+        table->Commit();
+        keep_unseen = keepUnseen;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return table->RowsCount() * sizeof(uint64_t) + counts.capacity() * sizeof(double) +
+               shard_probs.capacity() * sizeof(float);
+    }
+
+    void Store(const string &filename) override {
+        StoreTable(filename, table->RowsCount(), table->GetOffsets(), table->GetTargets(),
+                   table->GetProbabilities(), pruned, pruning_threshold);
+    }
+
+    void Release() override {
+        table.reset();
+        vector<double>().swap(counts);
+        vector<float>().swap(shard_probs);
+    }
+
+    bool IsSharded() const override {
+        return true;
+    }
+
+private:
+    unique_ptr<ShardedTable> table;
+
+    size_t counts_begin = 0;
+    vector<double> counts;
+    vector<float> shard_probs;
+    double table_change = 0; // of the shards normalized in the current iteration
+
+    bool pruned = false;
+    double pruning_threshold = 0;
+};
+
 Builder::Builder(Options options) : case_sensitive(options.case_sensitive),
                                     initial_diagonal_tension(options.initial_diagonal_tension),
                                     iterations(options.iterations),
@@ -155,10 +919,23 @@ Builder::Builder(Options options) : case_sensitive(options.case_sensitive),
                                     pruning(options.pruning_threshold),
                                     max_length(options.max_line_length),
                                     vocabulary_threshold(options.vocabulary_threshold),
+                                    vocabulary_memory(options.vocabulary_memory),
                                     threads((options.threads == 0) ? (int) thread::hardware_concurrency()
-                                                                   : options.threads) {
+                                                                   : options.threads),
+                                    score_bits(options.score_bits),
+                                    mmap_corpus(options.mmap_corpus),
+                                    joint_training(options.joint_training),
+                                    max_memory(options.max_memory),
+                                    base_model(options.base_model),
+                                    save_checkpoints(options.checkpoint || options.resume),
+                                    resume(options.resume),
+                                    convergence_threshold(options.convergence_threshold) {
     if (variational_bayes && alpha <= 0.0)
         throw invalid_argument("Parameter 'alpha' must be greather than 0");
+    if (score_bits != 8 && score_bits != 16 && score_bits != kScoreBitsFloat)
+        throw invalid_argument("Parameter 'score_bits' must be 8, 16 or 32");
+    if (convergence_threshold < 0)
+        throw invalid_argument("Parameter 'convergence_threshold' must be greater or equal to 0");
 
 #ifdef _OPENMP
     omp_set_dynamic(0);
@@ -170,75 +947,336 @@ void Builder::setListener(Builder::Listener *listener) {
     Builder::listener = listener;
 }
 
-void Builder::AllocateTTableSpace(Model *_model, const unordered_map<word_t, wordvec_t> &values,
-                                  const word_t sourceWordMaxValue) {
-    BuilderModel *model = (BuilderModel *) _model;
-    if (model->data.size() <= sourceWordMaxValue)
-        model->data.resize(sourceWordMaxValue + 1);
+/**
+ * Reads the model parameters at the beginning of a file written by TrainingModel::Store().
+ */
+static void ReadStoredParameters(istream &in, bool *outUseNull, bool *outFavorDiagonal, double *outProbAlignNull,
+                                 double *outDiagonalTension) {
+    *outUseNull = io_read<bool>(in);
+    *outFavorDiagonal = io_read<bool>(in);
+    *outProbAlignNull = io_read<double>(in);
+    *outDiagonalTension = io_read<double>(in);
+}
 
-#pragma omp parallel for schedule(dynamic)
-    for (size_t bucket = 0; bucket < values.bucket_count(); ++bucket) {
-        for (auto row_ptr = values.begin(bucket); row_ptr != values.end(bucket); ++row_ptr) {
-            word_t sourceWord = row_ptr->first;
+/**
+ * Calls cell(row, column, probability) for every cell of a file written by TrainingModel::Store(),
+ * in ascending row order.
+ */
+template<typename Cell>
+static void ForEachStoredCell(const string &path, const Cell &cell) {
+    ifstream in(path, ios::binary | ios::in);
+    if (!in)
+        throw runtime_error("unable to read the model file: " + path);
+
+    bool use_null, favor_diagonal;
+    double prob_align_null, diagonal_tension;
+    ReadStoredParameters(in, &use_null, &favor_diagonal, &prob_align_null, &diagonal_tension);
+    io_read<size_t>(in);
+
+    while (true) {
+        auto row = io_read<word_t>(in);
+        if (in.eof())
+            break;
 
-            for (auto targetWord = row_ptr->second.begin(); targetWord != row_ptr->second.end(); ++targetWord)
-                model->data[sourceWord][*targetWord] = pair<double, double>(kNullProbability, 0);
+        auto row_size = io_read<size_t>(in);
+        for (size_t i = 0; i < row_size; ++i) {
+            auto column = io_read<word_t>(in);
+            auto probability = io_read<float>(in);
+            cell(row, column, probability);
         }
+
+        if (!in)
+            throw runtime_error("corrupted model file: " + path);
     }
 }
 
-void Builder::InitialPass(const Vocabulary &vocab, Model *_model, const std::vector<Corpus> &corpora,
-                          double *n_target_tokens, vector<pair<pair<length_t, length_t>, size_t>> *size_counts) {
-    auto *model = (BuilderModel *) _model;
+/**
+ * Returns a model with the parameters of a file written by TrainingModel::Store() and an empty table.
+ */
+static TrainingModel *ReadStoredModel(const string &path, bool reverse) {
+    ifstream in(path, ios::binary | ios::in);
 
-    unordered_map<pair<length_t, length_t>, size_t, LengthPairHash> size_counts_;
+    bool use_null, favor_diagonal;
+    double prob_align_null, diagonal_tension;
+    ReadStoredParameters(in, &use_null, &favor_diagonal, &prob_align_null, &diagonal_tension);
 
-    unordered_map<word_t, wordvec_t> buffer;
-    word_t maxSourceWord = 0;
-    size_t buffer_items = 0;
-    wordvec_t src, trg;
+    if (!in)
+        throw runtime_error("corrupted model file: " + path);
 
-    for (auto corpus = corpora.begin(); corpus != corpora.end(); ++corpus) {
-        CorpusReader reader(*corpus, &vocab, max_length, true);
+    return new BuilderModel(reverse, use_null, favor_diagonal, prob_align_null, diagonal_tension);
+}
 
-        while (reader.Read(src, trg)) {
-            if (model->is_reverse)
-                swap(src, trg);
+/**
+ * Rows of the final bidirectional table, merged on the fly from the forward table and the transposed
+ * backward one.
+ *
+ * A table that has been released, to make room for the training of the other direction or because it
+ * has been trained out-of-core, is read sequentially from the file written by TrainingModel::Store().
+ * In that case the backward table is transposed in ranges of source words that fit the memory budget,
+ * every range with a scan of the file.
+ */
+class MergedRows : public ModelFile::RowSource {
+public:
+    MergedRows(const TrainingModel &forward, const string &forward_path, TrainingModel &backward,
+               const string &backward_path, size_t memoryBudget)
+            : forward(forward_path.empty() ? (const BuilderModel *) &forward : nullptr),
+              forward_path(forward_path),
+              backward(backward_path.empty() ? (BuilderModel *) &backward : nullptr),
+              backward_path(backward_path) {
+        size_t rows = forward_path.empty() ? this->forward->RowsCount() : ReadRowsCount(forward_path);
+
+        ScanBackward([this](word_t, word_t source, float) {
+            if (source >= sizes.size())
+                sizes.resize((size_t) source + 1, 0);
+            sizes[source]++;
+        });
+
+        rows = max(rows, sizes.size());
+        sizes.resize(rows, 0);
+
+        // ranges of source words, a transposed cell takes 8 bytes
+        uint64_t range_limit = (backward_path.empty() || memoryBudget == 0) ? UINT64_MAX :
+                               max(memoryBudget / (sizeof(word_t) + sizeof(float)), (size_t) 1);
+
+        uint64_t range_size = 0;
+        ranges.push_back(0);
+        for (word_t source = 0; source < rows; ++source) {
+            if (range_size + sizes[source] > range_limit && source > ranges.back()) {
+                ranges.push_back(source);
+                range_size = 0;
+            }
 
-            *n_target_tokens += trg.size();
+            range_size += sizes[source];
+        }
+        ranges.push_back((word_t) rows);
 
-            if (use_null) {
-                for (size_t idxf = 0; idxf < trg.size(); ++idxf) {
-                    buffer[kNullWord].push_back(trg[idxf]);
-                }
+        LoadRange(0);
+        if (backward_path.empty())
+            this->backward->Release();
+    }
 
-                buffer_items += trg.size();
-            }
+    size_t RowsCount() override {
+        return sizes.size();
+    }
 
-            for (size_t idxe = 0; idxe < src.size(); ++idxe) {
-                for (size_t idxf = 0; idxf < trg.size(); ++idxf) {
-                    maxSourceWord = max(maxSourceWord, src[idxe]);
-                    buffer[src[idxe]].push_back(trg[idxf]);
-                }
-                buffer_items += trg.size();
+    void GetRow(word_t source, vector<TranslationTable::entry_t> &entries) override {
+        entries.clear();
+
+        if (source < ranges[range] || source >= ranges[range + 1])
+            LoadRange((size_t) (upper_bound(ranges.begin(), ranges.end(), source) - ranges.begin()) - 1);
+
+        const word_t *fwd_targets = nullptr;
+        const float *fwd_probs = nullptr;
+        size_t fwd_size = GetForwardRow(source, &fwd_targets, &fwd_probs);
+
+        size_t i = 0;
+        uint64_t j = offsets[source - ranges[range]];
+        uint64_t end = offsets[source - ranges[range] + 1];
+
+        const auto null_probability = (float) kNullProbability;
+
+        while (i < fwd_size || j < end) {
+            if (j == end || (i < fwd_size && fwd_targets[i] < targets[j])) {
+                entries.emplace_back(fwd_targets[i], make_pair(fwd_probs[i], null_probability));
+                i++;
+            } else if (i == fwd_size || targets[j] < fwd_targets[i]) {
+                entries.emplace_back(targets[j], make_pair(null_probability, probs[j]));
+                j++;
+            } else {
+                entries.emplace_back(targets[j], make_pair(fwd_probs[i], probs[j]));
+                i++;
+                j++;
             }
+        }
+    }
+
+private:
+    const BuilderModel *forward;
+    const string forward_path;
+    BuilderModel *backward;
+    const string backward_path;
+
+    // backward cells of every source word, and the ranges of source words
+    vector<uint64_t> sizes;
+    vector<word_t> ranges;
+
+    // backward cells of the current range, transposed
+    size_t range = 0;
+    vector<uint64_t> offsets;
+    vector<word_t> targets;
+    vector<float> probs;
+
+    // forward rows read from file
+    ifstream forward_in;
+    word_t next_row = 0;
+    bool has_next_row = false;
+    vector<word_t> row_targets;
+    vector<float> row_probs;
+
+    static void ReadHeader(istream &in) {
+        bool use_null, favor_diagonal;
+        double prob_align_null, diagonal_tension;
+        ReadStoredParameters(in, &use_null, &favor_diagonal, &prob_align_null, &diagonal_tension);
+    }
 
-            if (buffer_items > buffer_size * 100) {
-                AllocateTTableSpace(model, buffer, maxSourceWord);
-                buffer_items = 0;
-                maxSourceWord = 0;
-                buffer.clear();
+    static size_t ReadRowsCount(const string &path) {
+        ifstream in(path, ios::binary | ios::in);
+        ReadHeader(in);
+        return io_read<size_t>(in);
+    }
+
+    /**
+     * Calls cell(target, source, probability) for every backward cell, in ascending target order.
+     */
+    template<typename Cell>
+    void ScanBackward(const Cell &cell) const {
+        if (backward_path.empty()) {
+            for (word_t target = 0; target < backward->RowsCount(); ++target) {
+                for (uint64_t i = backward->offsets[target]; i < backward->offsets[target + 1]; ++i)
+                    cell(target, backward->targets[i], backward->probs[i]);
             }
+        } else {
+            ForEachStoredCell(backward_path, cell);
+        }
+    }
+
+    /**
+     * Transposes the backward cells of the given range: the scan order keeps the rows sorted.
+     */
+    void LoadRange(size_t index) {
+        range = index;
+
+        word_t begin = ranges[range];
+        word_t end = ranges[range + 1];
+
+        offsets.assign((size_t) (end - begin) + 1, 0);
+        for (word_t source = begin; source < end; ++source)
+            offsets[source - begin + 1] = offsets[source - begin] + sizes[source];
+
+        targets.resize(offsets.back());
+        probs.resize(offsets.back());
+
+        vector<uint64_t> positions(offsets.begin(), offsets.end() - 1);
+        ScanBackward([&](word_t target, word_t source, float probability) {
+            if (source < begin || source >= end)
+                return;
 
+            uint64_t position = positions[source - begin]++;
+            targets[position] = target;
+            probs[position] = probability;
+        });
+    }
+
+    size_t GetForwardRow(word_t source, const word_t **outTargets, const float **outProbs) {
+        if (forward_path.empty()) {
+            if (source >= forward->RowsCount())
+                return 0;
+
+            *outTargets = forward->targets.data() + forward->offsets[source];
+            *outProbs = forward->probs.data() + forward->offsets[source];
+            return forward->offsets[source + 1] - forward->offsets[source];
+        }
+
+        if (source == 0) {
+            // every section reads the rows from the beginning
+            forward_in.close();
+            forward_in.clear();
+            forward_in.open(forward_path, ios::binary | ios::in);
+            if (!forward_in)
+                throw runtime_error("unable to read the forward model file: " + forward_path);
+
+            ReadHeader(forward_in);
+            io_read<size_t>(forward_in);
+            ReadNextRow();
+        }
+
+        if (!has_next_row || next_row != source)
+            return 0;
+
+        auto row_size = io_read<size_t>(forward_in);
+        row_targets.resize(row_size);
+        row_probs.resize(row_size);
+
+        for (size_t i = 0; i < row_size; ++i) {
+            row_targets[i] = io_read<word_t>(forward_in);
+            row_probs[i] = io_read<float>(forward_in);
+        }
+
+        if (!forward_in)
+            throw runtime_error("corrupted forward model file: " + forward_path);
+
+        ReadNextRow();
+
+        *outTargets = row_targets.data();
+        *outProbs = row_probs.data();
+        return row_size;
+    }
+
+    void ReadNextRow() {
+        next_row = io_read<word_t>(forward_in);
+        has_next_row = !forward_in.eof();
+    }
+};
+
+void Builder::InitialPass(const EncodedCorpus &corpus, bool reverse, PairSet &pairs, double *n_target_tokens,
+                          vector<pair<pair<length_t, length_t>, size_t>> *size_counts) {
+#ifdef _OPENMP
+    auto threads = (size_t) omp_get_max_threads();
+#else
+    size_t threads = 1;
+#endif
+
+    unordered_map<pair<length_t, length_t>, size_t, LengthPairHash> size_counts_;
+
+    // Co-occurrences are collected as (source << 32 | target) keys
+    vector<vector<uint64_t>> local_chunks(threads);
+    vector<pair<wordvec_t, wordvec_t>> batch;
+
+    EncodedCorpus::Reader reader(corpus);
+
+    while (reader.Read(batch, buffer_size)) {
+        for (auto sentence = batch.begin(); sentence != batch.end(); ++sentence) {
+            const wordvec_t &src = reverse ? sentence->second : sentence->first;
+            const wordvec_t &trg = reverse ? sentence->first : sentence->second;
+
+            *n_target_tokens += trg.size();
             ++size_counts_[make_pair<length_t, length_t>((length_t) trg.size(), (length_t) src.size())];
         }
+
+#pragma omp parallel
+        {
+#ifdef _OPENMP
+            vector<uint64_t> &keys = local_chunks[omp_get_thread_num()];
+#else
+            vector<uint64_t> &keys = local_chunks[0];
+#endif
+
+#pragma omp for schedule(dynamic, 64)
+            for (size_t n = 0; n < batch.size(); ++n) {
+                const wordvec_t &src = reverse ? batch[n].second : batch[n].first;
+                const wordvec_t &trg = reverse ? batch[n].first : batch[n].second;
+
+                if (use_null) {
+                    for (size_t idxf = 0; idxf < trg.size(); ++idxf)
+                        keys.push_back(((uint64_t) kNullWord << 32) | trg[idxf]);
+                }
+
+                for (size_t idxe = 0; idxe < src.size(); ++idxe) {
+                    for (size_t idxf = 0; idxf < trg.size(); ++idxf)
+                        keys.push_back(((uint64_t) src[idxe] << 32) | trg[idxf]);
+                }
+            }
+        }
+
+        for (auto keys = local_chunks.begin(); keys != local_chunks.end(); ++keys)
+            pairs.Add(*keys);
     }
 
+    pairs.Finish();
+
     for (auto p = size_counts_.begin(); p != size_counts_.end(); ++p) {
         size_counts->push_back(*p);
     }
-
-    AllocateTTableSpace(model, buffer, maxSourceWord);
 }
 
 void Builder::Build(const std::vector<Corpus> &corpora, const string &path) {
@@ -246,18 +1284,27 @@ void Builder::Build(const std::vector<Corpus> &corpora, const string &path) {
         std::ostringstream opts;
         opts << "{"
              << "alpha=" << alpha << ", "
+             << "base_model=" << base_model << ", "
              << "buffer_size=" << buffer_size << ", "
              << "case_sensitive=" << (case_sensitive ? "true" : "false") << ", "
+             << "checkpoint=" << (save_checkpoints ? "true" : "false") << ", "
+             << "convergence_threshold=" << convergence_threshold << ", "
              << "favor_diagonal=" << (favor_diagonal ? "true" : "false") << ", "
              << "initial_diagonal_tension=" << initial_diagonal_tension << ", "
              << "iterations=" << iterations << ", "
+             << "joint_training=" << (joint_training ? "true" : "false") << ", "
              << "max_length=" << max_length << ", "
+             << "max_memory=" << max_memory << ", "
+             << "mmap_corpus=" << (mmap_corpus ? "true" : "false") << ", "
              << "optimize_tension=" << (optimize_tension ? "true" : "false") << ", "
              << "prob_align_null=" << prob_align_null << ", "
              << "pruning=" << pruning << ", "
+             << "resume=" << (resume ? "true" : "false") << ", "
+             << "score_bits=" << score_bits << ", "
              << "threads=" << threads << ", "
              << "use_null=" << (use_null ? "true" : "false") << ", "
              << "variational_bayes=" << (variational_bayes ? "true" : "false") << ", "
+             << "vocabulary_memory=" << vocabulary_memory << ", "
              << "vocabulary_threshold=" << vocabulary_threshold
              << "}";
 
@@ -265,214 +1312,482 @@ void Builder::Build(const std::vector<Corpus> &corpora, const string &path) {
     }
 
     fs::path model_path = fs::absolute(fs::path(path));
-    fs::path fwd_model_filename = model_path.parent_path() / fs::path("fwd_model.tmp");
-    fs::path bwd_model_filename = model_path.parent_path() / fs::path("bwd_model.tmp");
 
-    if (listener) listener->VocabularyBuildBegin();
+    unique_ptr<Checkpoint> training_checkpoint;
+    if (save_checkpoints) {
+        // the options that change the trained tables
+        std::ostringstream opts;
+        opts << "alpha=" << alpha << " base_model=" << base_model << " case_sensitive=" << case_sensitive
+             << " favor_diagonal=" << favor_diagonal << " initial_diagonal_tension=" << initial_diagonal_tension
+             << " max_length=" << max_length << " optimize_tension=" << optimize_tension
+             << " prob_align_null=" << prob_align_null << " pruning=" << pruning << " use_null=" << use_null
+             << " variational_bayes=" << variational_bayes << " vocabulary_memory=" << vocabulary_memory
+             << " vocabulary_threshold=" << vocabulary_threshold;
+
+        training_checkpoint.reset(new Checkpoint(model_path.string() + ".checkpoint", opts.str(), resume));
+    }
+
+    Checkpoint *checkpoint = training_checkpoint.get();
+    bool resumed_vocabulary = checkpoint && checkpoint->HasVocabulary();
+
     Vocabulary vocab(case_sensitive);
-    vocab.BuildFromCorpora(corpora, max_length, vocabulary_threshold);
-    if (listener) listener->VocabularyBuildEnd();
+    if (resumed_vocabulary) {
+        checkpoint->LoadVocabulary(vocab);
+    } else {
+        if (listener) listener->VocabularyBuildBegin();
+        vocab.BuildFromCorpora(corpora, max_length, vocabulary_threshold, vocabulary_memory,
+                               [this](size_t sentences) {
+                                   if (listener) listener->VocabularyBuildProgress(sentences);
+                               });
+        if (listener) listener->VocabularyBuildEnd();
+    }
 
-    auto *forward = (BuilderModel *) BuildModel(vocab, corpora, true);
-    forward->Store(fwd_model_filename.string());
-    delete forward;
+    // Warm start: the terms of the base model keep their ids, new terms are appended
+    unique_ptr<Model> base_forward, base_backward;
 
-    auto *backward = (BuilderModel *) BuildModel(vocab, corpora, false);
-    backward->Store(bwd_model_filename.string());
-    delete backward;
+    if (!base_model.empty()) {
+        Vocabulary base_vocab;
+        Model *forward_model, *backward_model;
+
+        if (ModelFile::IsModelFile(base_model)) {
+            ModelFile::Open(base_model, &base_vocab, &forward_model, &backward_model);
+        } else {
+            ifstream in(base_model, ios::binary | ios::in);
+            if (!in)
+                throw invalid_argument("file not found: " + base_model);
+
+            base_vocab = Vocabulary(in);
+            BidirectionalModel::Open(in, &forward_model, &backward_model);
+        }
+
+        base_forward.reset(forward_model);
+        base_backward.reset(backward_model);
+
+        // a vocabulary restored from the checkpoint has already been extended
+        if (!resumed_vocabulary) {
+            base_vocab.Extend(vocab);
+            vocab = base_vocab;
+        }
+    }
+
+    if (checkpoint && !resumed_vocabulary)
+        checkpoint->StoreVocabulary(vocab);
+
+    // Corpora are tokenized and encoded only once, then read by every EM iteration of both directions
+    if (listener) listener->CorpusEncodingBegin();
+    fs::path corpus_filename = model_path.parent_path() / fs::path("corpus.tmp");
+    EncodedCorpus corpus(corpora, vocab, max_length, buffer_size, mmap_corpus ? corpus_filename.string() : "");
+    if (listener) listener->CorpusEncodingEnd();
+
+    string temp_dir = model_path.parent_path().string();
+
+    auto *base_fwd = (const BidirectionalModel *) base_forward.get();
+    auto *base_bwd = (const BidirectionalModel *) base_backward.get();
+
+    TrainingModel *forward = nullptr;
+    TrainingModel *backward = nullptr;
+    string forward_path;
+    string backward_path;
+
+    vector<direction_t> directions(1);
+
+    if (checkpoint && checkpoint->HasFile("forward.model")) {
+        // the training of the forward model is complete, the final merge reads its table from the checkpoint
+        forward_path = checkpoint->GetPath("forward.model");
+        forward = ReadStoredModel(forward_path, false);
+    } else {
+        Prepare(corpus, true, base_fwd, temp_dir, checkpoint, directions[0]);
+
+        // the backward table has the same entries of the forward one, transposed
+        forward = (TrainingModel *) directions[0].model;
+        size_t training_memory = forward->GetMemoryUsage();
+
+        // a resumed joint training needs both the directions at the same iteration
+        Checkpoint::state_t backward_state;
+        int backward_iteration = (checkpoint && checkpoint->LoadState("backward", &backward_state)) ?
+                                 backward_state.iteration : 0;
+
+        if (joint_training && !forward->IsSharded() && backward_iteration == directions[0].iteration) {
+            if (max_memory == 0 || 2 * training_memory <= max_memory) {
+                directions.resize(2);
+                Prepare(corpus, false, base_bwd, temp_dir, checkpoint, directions[1]);
+            }
+        }
+
+        // the base model file is no longer needed after the last setup, and it can be overwritten
+        if (directions.size() == 2) {
+            base_forward.reset();
+            base_backward.reset();
+        }
+
+        Train(corpus, directions, checkpoint);
+
+        if (directions.size() == 2) {
+            backward = (TrainingModel *) directions[1].model;
+        } else {
+            // the trained forward table is kept in memory for the final merge, unless it has been trained
+            // out-of-core or it does not fit together with the backward training table
+            bool release = forward->IsSharded() ||
+                           (max_memory > 0 && forward->GetMemoryUsage() + training_memory > max_memory);
+
+            if (checkpoint) {
+                string temp = checkpoint->GetPath("forward.model.tmp");
+                forward->Store(temp);
+                checkpoint->Commit(temp, "forward.model");
+                checkpoint->RemoveState("forward");
+
+                if (release)
+                    forward_path = checkpoint->GetPath("forward.model");
+            } else if (release) {
+                forward_path = (model_path.parent_path() / fs::path("fwd_model.tmp")).string();
+                forward->Store(forward_path);
+            }
+
+            if (release)
+                forward->Release();
+        }
+    }
+
+    if (!backward) {
+        directions[0] = direction_t();
+        Prepare(corpus, false, base_bwd, temp_dir, checkpoint, directions[0]);
+
+        base_forward.reset();
+        base_backward.reset();
+        Train(corpus, directions, checkpoint);
+
+        backward = (TrainingModel *) directions[0].model;
+
+        if (backward->IsSharded()) {
+            backward_path = (model_path.parent_path() / fs::path("bwd_model.tmp")).string();
+            backward->Store(backward_path);
+            backward->Release();
+        }
+    }
 
     if (listener) listener->ModelDumpBegin();
-    ofstream out(model_path.string(), ios::binary | ios::out);
-    vocab.Store(out);
-    MergeAndStore(out, fwd_model_filename.string(), bwd_model_filename.string());
-    out.close();
+    MergeAndStore(vocab, forward, forward_path, backward, backward_path, model_path.string());
 
-    if (remove(fwd_model_filename.c_str()) != 0)
-        throw runtime_error("Error deleting the forward model file");
+    delete forward;
+    delete backward;
+
+    if (checkpoint) {
+        if (!forward_path.empty() && forward_path == checkpoint->GetPath("forward.model"))
+            forward_path.clear();
+
+        checkpoint->Remove();
+    }
 
-    if (remove(bwd_model_filename.c_str()) != 0)
+    if (!forward_path.empty() && remove(forward_path.c_str()) != 0)
+        throw runtime_error("Error deleting the forward model file");
+    if (!backward_path.empty() && remove(backward_path.c_str()) != 0)
         throw runtime_error("Error deleting the backward model file");
 
     if (listener) listener->ModelDumpEnd();
 }
 
-Model *Builder::BuildModel(const Vocabulary &vocab, const std::vector<Corpus> &corpora, bool forward) {
-    auto *model = new BuilderModel(!forward, use_null, favor_diagonal, prob_align_null, initial_diagonal_tension);
+void Builder::Setup(const EncodedCorpus &corpus, bool forward, const BidirectionalModel *base, const string &tempDir,
+                    direction_t &direction) {
+    direction.forward = forward;
 
     if (listener) listener->Begin(forward);
 
-    vector<pair<pair<length_t, length_t>, size_t>> size_counts;
-    double n_target_tokens = 0;
-
     if (listener) listener->Begin(forward, kBuilderStepSetup, 0);
-    InitialPass(vocab, model, corpora, &n_target_tokens, &size_counts);
-    if (listener) listener->End(forward, kBuilderStepSetup, 0);
+    PairSet pairs(tempDir + "/pairs.tmp", buffer_size * 100, max_memory);
+
+    // with a warm start the table also keeps the cells of the base model
+    if (base) {
+        vector<uint64_t> keys;
+        ForEachBaseCell(*base->GetTable(), !forward, 0, numeric_limits<word_t>::max(),
+                        [&](word_t source, word_t target, float) {
+                            keys.push_back(((uint64_t) source << 32) | target);
+                            if (keys.size() >= buffer_size * 100)
+                                pairs.Add(keys);
+                        });
+        pairs.Add(keys);
+    }
 
-    for (int iter = 0; iter < iterations; ++iter) {
-        if (listener) listener->IterationBegin(forward, iter + 1);
+    InitialPass(corpus, !forward, pairs, &direction.n_target_tokens, &direction.size_counts);
 
-        double emp_feat = 0.0;
+    double tension = base ? base->diagonal_tension : initial_diagonal_tension;
+    auto *model = (TrainingModel *) CreateModel(pairs, forward, tension, tempDir);
 
-        vector<pair<wordvec_t, wordvec_t>> batch;
+    if (base)
+        model->Seed(*base->GetTable());
 
-        if (listener) listener->Begin(forward, kBuilderStepAligning, iter + 1);
-        for (auto corpus = corpora.begin(); corpus != corpora.end(); ++corpus) {
-            CorpusReader reader(*corpus, &vocab, max_length, true);
+    direction.model = model;
+    if (listener) listener->End(forward, kBuilderStepSetup, 0);
+}
 
-            while (reader.Read(batch, buffer_size)) {
-                emp_feat += model->ComputeAlignments(batch, model, nullptr);
-                batch.clear();
-            }
-        }
-        if (listener) listener->End(forward, kBuilderStepAligning, iter + 1);
+Model *Builder::CreateModel(PairSet &pairs, bool forward, double tension, const string &tempDir) {
+    bool in_memory = pairs.IsInMemory();
+    if (in_memory && max_memory > 0) {
+        const vector<uint64_t> &keys = pairs.GetKeys();
+        size_t rows = keys.empty() ? 0 : (size_t) (keys.back() >> 32) + 1;
 
-        emp_feat /= n_target_tokens;
+        // the keys are still in memory while the table is built
+        in_memory = BuilderModel::EstimateMemoryUsage(keys.size(), rows) + keys.size() * sizeof(uint64_t) <=
+                    max_memory;
+    }
 
-        if (favor_diagonal && optimize_tension) {
-            if (listener) listener->Begin(forward, kBuilderStepOptimizingDiagonalTension, iter + 1);
+    if (in_memory) {
+        auto *table = new BuilderModel(!forward, use_null, favor_diagonal, prob_align_null, tension);
+        table->Assign(pairs.GetKeys());
+        return table;
+    } else {
+        string path = tempDir + (forward ? "/fwd_table.tmp" : "/bwd_table.tmp");
+        return new ShardedBuilderModel(!forward, use_null, favor_diagonal, prob_align_null, tension, path, pairs,
+                                       max_memory);
+    }
+}
 
-            for (int ii = 0; ii < 8; ++ii) {
-                double mod_feat = 0;
-#pragma omp parallel for reduction(+:mod_feat)
-                for (size_t i = 0; i < size_counts.size(); ++i) {
-                    const pair<length_t, length_t> &p = size_counts[i].first;
-                    double _tmp_mod_feat = 0.0;
-                    for (length_t j = 1; j <= p.first; ++j)
-                        _tmp_mod_feat += DiagonalAlignment::ComputeDLogZ(j, p.first, p.second, model->diagonal_tension);
-                    mod_feat += size_counts[i].second * _tmp_mod_feat;
-                }
+void Builder::Prepare(const EncodedCorpus &corpus, bool forward, const BidirectionalModel *base,
+                      const string &tempDir, Checkpoint *checkpoint, direction_t &direction) {
+    string name = forward ? "forward" : "backward";
+    Checkpoint::state_t state;
 
-                mod_feat /= n_target_tokens;
-                model->diagonal_tension += (emp_feat - mod_feat) * 20.0;
-                if (model->diagonal_tension <= 0.1) model->diagonal_tension = 0.1;
-                if (model->diagonal_tension > 14) model->diagonal_tension = 14;
-            }
+    if (!checkpoint || !checkpoint->LoadState(name, &state)) {
+        Setup(corpus, forward, base, tempDir, direction);
 
-            if (listener) listener->End(forward, kBuilderStepOptimizingDiagonalTension, iter + 1);
-        }
+        if (checkpoint) {
+            // the cells are saved once, the probabilities after every iteration
+            string temp = checkpoint->GetPath(name + ".cells.tmp");
+            ((TrainingModel *) direction.model)->Store(temp);
+            checkpoint->Commit(temp, name + ".cells");
 
-        if (listener) listener->Begin(forward, kBuilderStepNormalizing, iter + 1);
-        model->Swap();
-        model->Normalize(variational_bayes ? alpha : 0);
-        if (listener) listener->End(forward, kBuilderStepNormalizing, iter + 1);
+            checkpoint->Run(SaveState(checkpoint, direction));
+        }
 
-        if (listener) listener->IterationEnd(forward, iter + 1);
+        return;
     }
 
-    if (listener) listener->Begin(forward, kBuilderStepPruning, 0);
-    model->Prune(pruning);
-    if (listener) listener->End(forward, kBuilderStepPruning, 0);
+    direction.forward = forward;
 
-    if (listener) listener->End(forward);
+    if (listener) listener->Begin(forward);
 
-    return model;
+    if (listener) listener->Begin(forward, kBuilderStepSetup, 0);
+    PairSet pairs(tempDir + "/pairs.tmp", buffer_size * 100, max_memory);
+
+    vector<uint64_t> keys;
+    ForEachStoredCell(checkpoint->GetPath(name + ".cells"), [&](word_t source, word_t target, float) {
+        keys.push_back(((uint64_t) source << 32) | target);
+        if (keys.size() >= buffer_size * 100)
+            pairs.Add(keys);
+    });
+    pairs.Add(keys);
+    pairs.Finish();
+
+    auto *model = (TrainingModel *) CreateModel(pairs, forward, state.diagonal_tension, tempDir);
+    model->Restore(checkpoint->GetProbabilitiesPath(name, state.iteration), state.keep_unseen);
+
+    direction.model = model;
+    direction.iteration = state.iteration;
+    direction.log_likelihood = state.log_likelihood;
+    direction.n_target_tokens = state.n_target_tokens;
+    direction.size_counts = state.size_counts;
+    if (listener) listener->End(forward, kBuilderStepSetup, 0);
 }
 
-void Builder::MergeAndStore(std::ostream &out, const string &fwd_path, const string &bwd_path) {
-    // creating the bitable
-    auto *table = new bitable_t;
+function<void()> Builder::SaveState(Checkpoint *checkpoint, const direction_t &direction) {
+    auto *model = (TrainingModel *) direction.model;
+    string name = direction.forward ? "forward" : "backward";
 
-    // opening forward model file for reading
-    ifstream fwd_in(fwd_path, ios::binary | ios::in);
+    Checkpoint::state_t state;
+    state.iteration = direction.iteration;
+    state.diagonal_tension = model->diagonal_tension;
+    state.keep_unseen = model->KeepsUnseen();
+    state.log_likelihood = direction.log_likelihood;
+    state.n_target_tokens = direction.n_target_tokens;
+    state.size_counts = direction.size_counts;
 
-    // loading forward header
-    auto fwd_use_null = io_read<bool>(fwd_in);
-    auto fwd_favor_diagonal = io_read<bool>(fwd_in);
-    auto fwd_prob_align_null = io_read<double>(fwd_in);
-    auto fwd_diagonal_tension = io_read<double>(fwd_in);
-    auto fwd_ttable_size = io_read<size_t>(fwd_in);
+    function<void()> write = model->SnapshotProbabilities(checkpoint->GetProbabilitiesPath(name, state.iteration));
 
-    if (fwd_ttable_size == 0)
-        throw runtime_error("The forward model is empty");
+    return [checkpoint, name, state, write]() {
+        write();
+        checkpoint->StoreState(name, state);
+    };
+}
 
-    // resizing the bitable
-    table->resize(fwd_ttable_size);
+void Builder::Train(const EncodedCorpus &corpus, vector<direction_t> &directions, Checkpoint *checkpoint) {
+    // with joint training the shared steps are notified once, see Listener
+    bool forward = directions[0].forward;
+    bool pruned = false;
 
-    // loading forward entries and fill the bitable
-    while (true) {
-        auto src_word = io_read<word_t>(fwd_in);
-        if (fwd_in.eof())
-            break;
+    // a resumed training starts after the last saved iteration, all the directions are at the same one
+    for (int iter = directions[0].iteration; iter < iterations; ++iter) {
+        if (listener) listener->IterationBegin(forward, iter + 1);
 
-        auto row_size = io_read<size_t>(fwd_in);
-        table->at(src_word).reserve(row_size);
+        vector<double> emp_feats(directions.size(), 0.0);
+        vector<double> log_likelihoods(directions.size(), 0.0);
 
-        for (size_t i = 0; i < row_size; ++i) {
-            auto tgt_word = io_read<word_t>(fwd_in);
-            auto score = io_read<float>(fwd_in);
+        vector<pair<wordvec_t, wordvec_t>> batch;
+
+        // out-of-core tables read the corpus once for every shard
+        size_t passes = 1;
+        for (auto direction = directions.begin(); direction != directions.end(); ++direction)
+            passes = max(passes, ((TrainingModel *) direction->model)->ShardsCount());
+
+        if (listener) listener->Begin(forward, kBuilderStepAligning, iter + 1);
+        for (size_t pass = 0; pass < passes; ++pass) {
+            for (size_t d = 0; d < directions.size(); ++d) {
+                auto *model = (TrainingModel *) directions[d].model;
+                if (pass < model->ShardsCount())
+                    model->BeginShard(pass);
+            }
+
+            EncodedCorpus::Reader reader(corpus);
+            size_t limit = buffer_size;
+
+            // the next batch is read while the current one is aligned
+            Prefetcher<vector<pair<wordvec_t, wordvec_t>>> batches(
+                    [&reader, limit](vector<pair<wordvec_t, wordvec_t>> &b) {
+                        return reader.Read(b, limit);
+                    });
+
+            while (batches.Next(batch)) {
+                for (size_t d = 0; d < directions.size(); ++d) {
+                    auto *model = (TrainingModel *) directions[d].model;
+                    if (pass >= model->ShardsCount())
+                        continue;
+
+                    // the alignment probabilities are the same in every pass
+                    double log_likelihood = 0;
+                    double emp_feat = model->ComputeExpectedCounts(batch, &log_likelihood);
+                    if (pass == 0) {
+                        emp_feats[d] += emp_feat;
+                        log_likelihoods[d] += log_likelihood;
+                    }
+                }
+            }
 
-            table->at(src_word)[tgt_word] = pair<float, float>(score, kNullProbability);
+            for (size_t d = 0; d < directions.size(); ++d) {
+                auto *model = (TrainingModel *) directions[d].model;
+                if (pass < model->ShardsCount())
+                    model->EndShard(pass, variational_bayes ? alpha : 0);
+            }
         }
-    }
+        if (listener) listener->End(forward, kBuilderStepAligning, iter + 1);
 
-    // closing forward model file
-    fwd_in.close();
+        // the log-likelihood never decreases with EM: the iterations stop when every direction has converged
+        bool converged = convergence_threshold > 0;
+        for (size_t d = 0; d < directions.size(); ++d) {
+            double previous = directions[d].log_likelihood;
+            converged &= previous < 0 && log_likelihoods[d] - previous <= convergence_threshold * -previous;
+        }
 
-    // opening backward model file for reading
-    ifstream bwd_in(bwd_path, ios::binary | ios::in);
+        bool last = iter + 1 == iterations || converged;
 
-    // loading backward header
-    auto bwd_use_null = io_read<bool>(bwd_in);
-    auto bwd_favor_diagonal = io_read<bool>(bwd_in);
-    auto bwd_prob_align_null = io_read<double>(bwd_in);
-    auto bwd_diagonal_tension = io_read<double>(bwd_in);
-    auto bwd_ttable_size = io_read<size_t>(bwd_in);
+        for (size_t d = 0; d < directions.size(); ++d) {
+            auto *model = (TrainingModel *) directions[d].model;
+            const vector<pair<pair<length_t, length_t>, size_t>> &size_counts = directions[d].size_counts;
+            double n_target_tokens = directions[d].n_target_tokens;
+            double emp_feat = emp_feats[d] / n_target_tokens;
 
-    // checking consistency of forward and backward models
-    assert(fwd_use_null == bwd_use_null);
-    assert(fwd_favor_diagonal == bwd_favor_diagonal);
-    assert(fwd_prob_align_null == bwd_prob_align_null);
-    assert(fwd_ttable_size == bwd_ttable_size);
+            if (favor_diagonal && optimize_tension) {
+                if (listener) listener->Begin(directions[d].forward, kBuilderStepOptimizingDiagonalTension, iter + 1);
 
-    if (bwd_ttable_size == 0)
-        throw runtime_error("The backward model is empty");
+                for (int ii = 0; ii < 8; ++ii) {
+                    double mod_feat = 0;
+#pragma omp parallel for reduction(+:mod_feat)
+                    for (size_t i = 0; i < size_counts.size(); ++i) {
+                        const pair<length_t, length_t> &p = size_counts[i].first;
+                        double _tmp_mod_feat = 0.0;
+                        for (length_t j = 1; j <= p.first; ++j)
+                            _tmp_mod_feat += DiagonalAlignment::ComputeDLogZ(j, p.first, p.second,
+                                                                             model->diagonal_tension);
+                        mod_feat += size_counts[i].second * _tmp_mod_feat;
+                    }
+
+                    mod_feat /= n_target_tokens;
+                    double tension = model->diagonal_tension + (emp_feat - mod_feat) * 20.0;
+                    if (tension <= 0.1) tension = 0.1;
+                    if (tension > 14) tension = 14;
+                    model->SetDiagonalTension(tension);
+                }
 
-    // loading backward entries and fill the bitable
-    while (true) {
-        auto tgt_word = io_read<word_t>(bwd_in);
-        if (bwd_in.eof())
-            break;
+                if (listener) listener->End(directions[d].forward, kBuilderStepOptimizingDiagonalTension, iter + 1);
+            }
 
-        auto row_size = io_read<size_t>(bwd_in);
+            // the last normalization also prunes the table
+            if (listener) listener->Begin(directions[d].forward, kBuilderStepNormalizing, iter + 1);
+            double change = model->Normalize(variational_bayes ? alpha : 0, last, pruning);
+            if (listener) listener->End(directions[d].forward, kBuilderStepNormalizing, iter + 1);
+
+            if (listener) {
+                iteration_stats_t stats;
+                stats.log_likelihood = log_likelihoods[d];
+                stats.cross_entropy = -log_likelihoods[d] / log(2.) / n_target_tokens;
+                stats.ttable_change = change;
+                listener->IterationStatistics(directions[d].forward, iter + 1, stats);
+            }
 
-        for (size_t i = 0; i < row_size; ++i) {
-            auto src_word = io_read<word_t>(bwd_in);
-            auto score = io_read<float>(bwd_in);
+            directions[d].iteration = iter + 1;
+            directions[d].log_likelihood = log_likelihoods[d];
+        }
+
+        pruned = last;
+
+        // the state after the last iteration is not saved: its table is pruned, Build() saves the final model
+        if (checkpoint && !pruned) {
+            // the previous state is written before taking the new one, so that at most one is in memory
+            checkpoint->Wait();
 
-            assert(src_word < table->size());
+            vector<function<void()>> jobs;
+            for (auto direction = directions.begin(); direction != directions.end(); ++direction)
+                jobs.push_back(SaveState(checkpoint, *direction));
 
-            auto cell = table->at(src_word).emplace(tgt_word, pair<float, float>(kNullProbability, kNullProbability));
-            pair<float, float> &el = cell.first->second;
-            el.second = score;
+            checkpoint->Run([jobs]() {
+                for (auto job = jobs.begin(); job != jobs.end(); ++job)
+                    (*job)();
+            });
         }
 
+        if (listener) listener->IterationEnd(forward, iter + 1);
+
+        if (last)
+            break;
     }
 
-    // closing backward model file
-    bwd_in.close();
+    if (checkpoint)
+        checkpoint->Wait();
+
+    for (auto direction = directions.begin(); direction != directions.end(); ++direction) {
+        if (!pruned) {
+            if (listener) listener->Begin(direction->forward, kBuilderStepPruning, 0);
+            ((TrainingModel *) direction->model)->Prune(pruning);
+            if (listener) listener->End(direction->forward, kBuilderStepPruning, 0);
+        }
+
+        if (listener) listener->End(direction->forward);
+    }
+}
 
-    // writing header
-    io_write(out, fwd_use_null);
-    io_write(out, fwd_favor_diagonal);
-    io_write(out, fwd_prob_align_null);
-    io_write(out, fwd_diagonal_tension);
-    io_write(out, bwd_diagonal_tension);
-    io_write(out, fwd_ttable_size);
+void Builder::MergeAndStore(const Vocabulary &vocab, Model *forward, const string &forward_path, Model *backward,
+                            const string &backward_path, const string &path) {
+    MergedRows rows(*((TrainingModel *) forward), forward_path, *((TrainingModel *) backward), backward_path,
+                    max_memory);
 
-    // writing all entries of the bitable
-    for (word_t src_word = 0; src_word < fwd_ttable_size; ++src_word) {
-        auto &row = table->at(src_word);
+    if (score_bits == kScoreBitsFloat) {
+        ModelFile::Store(path, vocab, *forward, *backward, rows);
+        return;
+    }
 
-        io_write(out, src_word);
-        io_write(out, row.size());
+    // quantization needs all the scores of the table
+    shared_ptr<TranslationTable> ttable(new TranslationTable);
+    vector<TranslationTable::entry_t> row;
 
-        for (auto tgt_entry = row.begin(); tgt_entry != row.end(); ++tgt_entry) {
-            io_write(out, tgt_entry->first);
-            io_write(out, tgt_entry->second.first);
-            io_write(out, tgt_entry->second.second);
-        }
+    for (word_t src_word = 0; src_word < rows.RowsCount(); ++src_word) {
+        rows.GetRow(src_word, row);
+        ttable->AppendRow(src_word, row);
     }
 
-    // deleting bitable
-    delete table;
+    ttable->ShrinkToFit();
+    ttable = ttable->Quantize(score_bits);
+
+    BidirectionalModel fwd_model(ttable, true, forward->use_null, forward->favor_diagonal, forward->prob_align_null,
+                                 forward->diagonal_tension);
+    BidirectionalModel bwd_model(ttable, false, forward->use_null, forward->favor_diagonal, forward->prob_align_null,
+                                 backward->diagonal_tension);
+
+    ModelFile::Store(path, vocab, fwd_model, bwd_model);
 }
@@ -5,18 +5,21 @@
 #ifndef FASTALIGN_BUILDER_H
 #define FASTALIGN_BUILDER_H
 
+#include <functional>
 #include <string>
 #include <vector>
 #include "Model.h"
 #include "Corpus.h"
 #include "Vocabulary.h"
+#include "EncodedCorpus.h"
+#include "TranslationTable.h"
 
 namespace mmt {
     namespace fastalign {
 
         struct Options {
             bool case_sensitive = true;
-            int iterations = 5;
+            int iterations = 5; // maximum number of EM iterations if convergence_threshold is not zero
             bool favor_diagonal = true;
             double prob_align_null = 0.08;
             double initial_diagonal_tension = 4.0;
@@ -27,8 +30,29 @@ namespace mmt {
             int threads = 0; // Default is number of CPUs
             size_t buffer_size = 10000;
             double vocabulary_threshold = 0.9999;
+            size_t vocabulary_memory = 0; // bytes for approximate vocabulary counting, 0 counts all the terms exactly
             double pruning_threshold = 1.e-20;
             size_t max_line_length = 80;
+            int score_bits = kScoreBitsFloat; // 8 or 16 to store quantized scores
+            bool mmap_corpus = false; // keep the encoded corpus in a memory-mapped file instead of the heap
+            bool joint_training = false; // train both directions together, reading the corpus once per iteration
+            size_t max_memory = 0; // bytes available to the training (0 is no limit): above it directions are
+                                   // trained one after the other, then translation tables are trained out-of-core
+            std::string base_model; // existing model to start the training from (warm start), see Builder::Build()
+            bool checkpoint = false; // save the training state after every EM iteration, see Builder::Build()
+            bool resume = false; // resume the training from its checkpoint if there is one, implies checkpoint
+            double convergence_threshold = 0; // stop the EM iterations when the relative improvement of the
+                                              // log-likelihood is not above it (0 runs all the iterations)
+        };
+
+        /**
+         * Statistics of an EM iteration: the log-likelihood of the corpus is the one of the probabilities
+         * the iteration started from, the t-table change is the one made by its M-step.
+         */
+        struct iteration_stats_t {
+            double log_likelihood; // natural log of p(target | source) over the corpus
+            double cross_entropy; // bits per target token
+            double ttable_change; // mean total variation distance between the rows before and after the M-step
         };
 
         typedef int BuilderStep;
@@ -39,9 +63,19 @@ namespace mmt {
         static const BuilderStep kBuilderStepNormalizing = 4;
         static const BuilderStep kBuilderStepPruning = 5;
 
+        class PairSet;
+
+        class BidirectionalModel;
+
+        class Checkpoint;
+
         class Builder {
         public:
 
+            /**
+             * With joint training the two directions share the iterations and the aligning step, these
+             * are notified only once with forward equal to true.
+             */
             class Listener {
             public:
                 virtual void BuildStart(const std::string &opts) = 0;
@@ -50,14 +84,25 @@ namespace mmt {
 
                 virtual void VocabularyBuildBegin() = 0;
 
+                virtual void VocabularyBuildProgress(size_t sentences) = 0;
+
                 virtual void VocabularyBuildEnd() = 0;
 
+                virtual void CorpusEncodingBegin() = 0;
+
+                virtual void CorpusEncodingEnd() = 0;
+
                 virtual void IterationBegin(bool forward, int iteration) = 0;
 
                 virtual void Begin(bool forward, BuilderStep step, int iteration) = 0;
 
                 virtual void End(bool forward, BuilderStep step, int iteration) = 0;
 
+                /**
+                 * Called for every direction before IterationEnd(), also with joint training.
+                 */
+                virtual void IterationStatistics(bool forward, int iteration, const iteration_stats_t &stats) = 0;
+
                 virtual void IterationEnd(bool forward, int iteration) = 0;
 
                 virtual void End(bool forward) = 0;
@@ -71,6 +116,17 @@ namespace mmt {
 
             void setListener(Listener *listener);
 
+            /**
+             * Trains a new model on the given corpora. With a base model, its terms keep their ids in the new
+             * vocabulary and the EM iterations start from its translation probabilities: the rows of the words
+             * that do not occur in the corpora keep the base probabilities, so that the model can be updated
+             * training only on new data with a few iterations.
+             *
+             * With checkpoints, the training state is saved after every EM iteration in the directory
+             * "<path>.checkpoint", that is deleted when the model is stored: a resumed training skips the
+             * vocabulary, the setup and the iterations already completed. The options that change the trained
+             * tables must be the same, and so must be the corpora.
+             */
             void Build(const std::vector<Corpus> &corpora, const std::string &path);
 
         private:
@@ -87,20 +143,65 @@ namespace mmt {
             double pruning;
             size_t max_length;
             double vocabulary_threshold;
+            const size_t vocabulary_memory;
             const int threads;
+            const int score_bits;
+            const bool mmap_corpus;
+            const bool joint_training;
+            const size_t max_memory;
+            const std::string base_model;
+            const bool save_checkpoints;
+            const bool resume;
+            const double convergence_threshold;
 
             Listener *listener;
 
-            void AllocateTTableSpace(Model *_model, const std::unordered_map<word_t, wordvec_t> &values,
-                                     word_t sourceWordMaxValue);
+            struct direction_t {
+                Model *model = nullptr;
+                bool forward = true;
+                int iteration = 0; // completed EM iterations
+                double log_likelihood = 0; // of the corpus in the last iteration, 0 if unknown
+                double n_target_tokens = 0;
+                std::vector<std::pair<std::pair<length_t, length_t>, size_t>> size_counts;
+            };
 
-            void InitialPass(const Vocabulary &vocab, Model *model, const std::vector<Corpus> &corpora,
-                             double *n_target_tokens,
+            void InitialPass(const EncodedCorpus &corpus, bool reverse, PairSet &pairs, double *n_target_tokens,
                              std::vector<std::pair<std::pair<length_t, length_t>, size_t>> *size_counts);
 
-            Model *BuildModel(const Vocabulary &vocab, const std::vector<Corpus> &corpora, bool forward);
-
-            void MergeAndStore(std::ostream &out, const std::string &fwd_path, const std::string &bwd_path);
+            /**
+             * Creates the training model of a direction, seeded with the base model if not null. If its table
+             * does not fit max_memory, the table is trained out-of-core with temporary files in tempDir.
+             */
+            void Setup(const EncodedCorpus &corpus, bool forward, const BidirectionalModel *base,
+                       const std::string &tempDir, direction_t &direction);
+
+            /**
+             * Creates the training model for the cells of the set: in memory if it fits max_memory, otherwise
+             * out-of-core with temporary files in tempDir.
+             */
+            Model *CreateModel(PairSet &pairs, bool forward, double tension, const std::string &tempDir);
+
+            /**
+             * Restores the training model of a direction from the checkpoint if there is one, otherwise it
+             * calls Setup() and saves the new model in the checkpoint (if not null).
+             */
+            void Prepare(const EncodedCorpus &corpus, bool forward, const BidirectionalModel *base,
+                         const std::string &tempDir, Checkpoint *checkpoint, direction_t &direction);
+
+            /**
+             * Returns the job that saves the state of the direction in the checkpoint, to be run in background:
+             * the probabilities are taken when this method is called.
+             */
+            std::function<void()> SaveState(Checkpoint *checkpoint, const direction_t &direction);
+
+            void Train(const EncodedCorpus &corpus, std::vector<direction_t> &directions, Checkpoint *checkpoint);
+
+            /**
+             * Stores the model merging the two trained tables. If forward_path or backward_path is not empty,
+             * the table of that direction has been released and it is read from that file.
+             */
+            void MergeAndStore(const Vocabulary &vocab, Model *forward, const std::string &forward_path,
+                               Model *backward, const std::string &backward_path, const std::string &path);
         };
     }
 }
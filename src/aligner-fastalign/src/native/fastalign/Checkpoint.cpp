@@ -0,0 +1,176 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "Checkpoint.h"
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include "ioutils.h"
+
+namespace fs = boost::filesystem;
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+Checkpoint::Checkpoint(const string &path, const string &options, bool resume) : path(path) {
+    string options_path = GetPath("options");
+
+    if (resume && fs::is_regular(options_path)) {
+        ifstream in(options_path, ios::binary | ios::in);
+        string stored;
+        io_read(in, stored);
+
+        if (!in || stored != options)
+            throw invalid_argument("the checkpoint in " + path + " has been created with different options: " +
+                                   stored);
+
+        return;
+    }
+
+    fs::remove_all(path);
+    fs::create_directories(path);
+
+    string temp = options_path + ".tmp";
+    ofstream out(temp, ios::binary | ios::out);
+    io_write(out, options);
+    out.close();
+
+    if (!out)
+        throw runtime_error("unable to write the checkpoint: " + temp);
+
+    Commit(temp, "options");
+}
+
+Checkpoint::~Checkpoint() {
+    try {
+        Wait();
+    } catch (...) {
+        // the training has already failed
+    }
+}
+
+bool Checkpoint::HasVocabulary() const {
+    return HasFile("vocabulary");
+}
+
+void Checkpoint::LoadVocabulary(Vocabulary &vocabulary) const {
+    ifstream in(GetPath("vocabulary"), ios::binary | ios::in);
+    if (!in)
+        throw runtime_error("unable to read the checkpoint vocabulary: " + path);
+
+    vocabulary = Vocabulary(in);
+}
+
+void Checkpoint::StoreVocabulary(const Vocabulary &vocabulary) {
+    string temp = GetPath("vocabulary.tmp");
+
+    ofstream out(temp, ios::binary | ios::out);
+    vocabulary.Store(out);
+    out.close();
+
+    if (!out)
+        throw runtime_error("unable to write the checkpoint: " + temp);
+
+    Commit(temp, "vocabulary");
+}
+
+bool Checkpoint::HasFile(const string &name) const {
+    return fs::is_regular(GetPath(name));
+}
+
+string Checkpoint::GetPath(const string &name) const {
+    return (fs::path(path) / fs::path(name)).string();
+}
+
+string Checkpoint::GetProbabilitiesPath(const string &direction, int iteration) const {
+    return GetPath(direction + ".probs." + to_string(iteration));
+}
+
+void Checkpoint::Commit(const string &temp, const string &name) const {
+    if (rename(temp.c_str(), GetPath(name).c_str()) != 0)
+        throw runtime_error("unable to write the checkpoint: " + GetPath(name));
+}
+
+bool Checkpoint::LoadState(const string &direction, state_t *outState) const {
+    ifstream in(GetPath(direction + ".state"), ios::binary | ios::in);
+    if (!in)
+        return false;
+
+    outState->iteration = io_read<int>(in);
+    outState->diagonal_tension = io_read<double>(in);
+    outState->keep_unseen = io_read<bool>(in);
+    outState->log_likelihood = io_read<double>(in);
+    outState->n_target_tokens = io_read<double>(in);
+
+    auto size = io_read<size_t>(in);
+    outState->size_counts.resize(size);
+    for (size_t i = 0; i < size; ++i) {
+        outState->size_counts[i].first.first = io_read<length_t>(in);
+        outState->size_counts[i].first.second = io_read<length_t>(in);
+        outState->size_counts[i].second = io_read<size_t>(in);
+    }
+
+    if (!in)
+        throw runtime_error("corrupted checkpoint state: " + GetPath(direction + ".state"));
+
+    return true;
+}
+
+void Checkpoint::StoreState(const string &direction, const state_t &state) const {
+    state_t previous;
+    bool has_previous = LoadState(direction, &previous);
+
+    string temp = GetPath(direction + ".state.tmp");
+    ofstream out(temp, ios::binary | ios::out);
+
+    io_write(out, state.iteration);
+    io_write(out, state.diagonal_tension);
+    io_write(out, state.keep_unseen);
+    io_write(out, state.log_likelihood);
+    io_write(out, state.n_target_tokens);
+
+    io_write(out, state.size_counts.size());
+    for (auto entry = state.size_counts.begin(); entry != state.size_counts.end(); ++entry) {
+        io_write(out, entry->first.first);
+        io_write(out, entry->first.second);
+        io_write(out, entry->second);
+    }
+
+    out.close();
+    if (!out)
+        throw runtime_error("unable to write the checkpoint: " + temp);
+
+    Commit(temp, direction + ".state");
+
+    if (has_previous && previous.iteration != state.iteration)
+        remove(GetProbabilitiesPath(direction, previous.iteration).c_str());
+}
+
+void Checkpoint::RemoveState(const string &direction) {
+    Wait();
+
+    state_t state;
+    if (LoadState(direction, &state))
+        remove(GetProbabilitiesPath(direction, state.iteration).c_str());
+
+    remove(GetPath(direction + ".state").c_str());
+    remove(GetPath(direction + ".cells").c_str());
+}
+
+void Checkpoint::Run(function<void()> job) {
+    Wait();
+    pending = async(launch::async, job);
+}
+
+void Checkpoint::Wait() {
+    if (pending.valid())
+        pending.get();
+}
+
+void Checkpoint::Remove() {
+    Wait();
+    fs::remove_all(path);
+}
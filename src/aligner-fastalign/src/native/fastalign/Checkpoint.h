@@ -0,0 +1,113 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_CHECKPOINT_H
+#define MMT_FASTALIGN_CHECKPOINT_H
+
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+#include "alignment.h"
+#include "Vocabulary.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Training state saved by the Builder after every EM iteration, so that an interrupted training can be
+         * resumed. The checkpoint is a directory with the files:
+         *
+         *   options                 training options the checkpoint has been created with
+         *   vocabulary              vocabulary of the model (Vocabulary::Store format)
+         *   <direction>.cells       cells of the training table of a direction, written once after the setup
+         *   <direction>.probs.<N>   probabilities of the table cells after N iterations, float[] in cells order
+         *   <direction>.state       completed iterations, diagonal tension, log-likelihood and corpus statistics
+         *   <direction>.model       table of a direction whose training is complete
+         *
+         * Every file is written to a temporary name and then renamed, and the state of a direction is written
+         * after its probabilities: the checkpoint is consistent whenever the training is interrupted.
+         */
+        class Checkpoint {
+        public:
+            struct state_t {
+                int iteration = 0; // completed EM iterations
+                double diagonal_tension = 0;
+                bool keep_unseen = false;
+                double log_likelihood = 0; // of the corpus in the last completed iteration
+                double n_target_tokens = 0;
+                std::vector<std::pair<std::pair<length_t, length_t>, size_t>> size_counts;
+            };
+
+            /**
+             * Opens the checkpoint in the given directory. If resume is false or the directory does not exist,
+             * the checkpoint is created empty; otherwise options must be equal to the stored ones.
+             */
+            Checkpoint(const std::string &path, const std::string &options, bool resume);
+
+            Checkpoint(const Checkpoint &) = delete;
+
+            Checkpoint &operator=(const Checkpoint &) = delete;
+
+            /**
+             * Waits for the pending writes, errors are discarded.
+             */
+            ~Checkpoint();
+
+            bool HasVocabulary() const;
+
+            void LoadVocabulary(Vocabulary &vocabulary) const;
+
+            void StoreVocabulary(const Vocabulary &vocabulary);
+
+            bool HasFile(const std::string &name) const;
+
+            /**
+             * Path of a file of the checkpoint, see the class description.
+             */
+            std::string GetPath(const std::string &name) const;
+
+            std::string GetProbabilitiesPath(const std::string &direction, int iteration) const;
+
+            /**
+             * Replaces the file with the one written at the given temporary path.
+             */
+            void Commit(const std::string &temp, const std::string &name) const;
+
+            bool LoadState(const std::string &direction, state_t *outState) const;
+
+            /**
+             * Replaces the state of the direction, then deletes the probabilities of the previous state.
+             */
+            void StoreState(const std::string &direction, const state_t &state) const;
+
+            /**
+             * Deletes the cells, the state and the probabilities of the direction.
+             */
+            void RemoveState(const std::string &direction);
+
+            /**
+             * Runs the job in a background thread, after the previous one has completed.
+             */
+            void Run(std::function<void()> job);
+
+            /**
+             * Waits for the pending job, its errors are thrown here.
+             */
+            void Wait();
+
+            /**
+             * Deletes the checkpoint directory.
+             */
+            void Remove();
+
+        private:
+            const std::string path;
+            std::future<void> pending;
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_CHECKPOINT_H
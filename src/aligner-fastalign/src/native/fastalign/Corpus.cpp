@@ -4,6 +4,8 @@
 
 
 #include <iostream>
+#include <algorithm>
+#include <cstring>
 
 #include "Corpus.h"
 #include "Vocabulary.h"
@@ -16,8 +18,24 @@ using namespace mmt::fastalign;
 
 namespace fs = boost::filesystem;
 
+static inline string GetCompressionExtension(const string &path) {
+    for (const char *const *extension = LineDecoder::GetExtensions(); *extension; ++extension) {
+        size_t length = strlen(*extension);
+        if (path.size() > length && path.compare(path.size() - length, length, *extension) == 0)
+            return *extension;
+    }
+
+    return "";
+}
+
 Corpus::Corpus(const std::string &sourceFile, const std::string &targetFile) :
-        name(fs::path(sourceFile).stem().string()), sourceFile(sourceFile), targetFile(targetFile) {
+        name(fs::path(sourceFile.substr(0, sourceFile.size() - GetCompressionExtension(sourceFile).size()))
+                     .stem().string()),
+        sourceFile(sourceFile), targetFile(targetFile) {
+}
+
+bool Corpus::IsCompressed() const {
+    return LineDecoder::IsCompressed(sourceFile) || LineDecoder::IsCompressed(targetFile);
 }
 
 void Corpus::List(const std::string &path, const std::string &sourceLang, const std::string &targetLang,
@@ -30,158 +48,219 @@ void Corpus::List(const std::string &path, const std::string &sourceLang, const
         if (!fs::is_regular_file(file))
             continue;
 
-        if (file.extension().string() == "." + sourceLang) {
+        // Files can be compressed, i.e. "corpus.en.gz"
+        string compression = GetCompressionExtension(file.string());
+        fs::path base = file.string().substr(0, file.string().size() - compression.size());
+
+        if (base.extension().string() == "." + sourceLang) {
             fs::path sourceFile = file;
-            fs::path targetFile = file;
+            fs::path targetBase = base;
+            targetBase = targetBase.replace_extension(fs::path(targetLang));
+
+            // the target file has the same compression of the source one, or any other
+            vector<string> candidates(1, compression);
+            candidates.push_back("");
+            for (const char *const *extension = LineDecoder::GetExtensions(); *extension; ++extension)
+                candidates.push_back(*extension);
+
+            for (auto candidate = candidates.begin(); candidate != candidates.end(); ++candidate) {
+                fs::path targetFile = targetBase.string() + *candidate;
+
+                if (fs::is_regular_file(targetFile)) {
+                    outList.push_back(Corpus(sourceFile.string(), targetFile.string()));
+                    break;
+                }
+            }
+        }
+    }
+}
 
-            targetFile = targetFile.replace_extension(fs::path(targetLang));
+// Words are separated by single spaces, as with getline(stream, word, ' ') empty words
+// between consecutive spaces are kept, while a trailing space is ignored
 
-            if (!fs::is_regular_file(targetFile))
-                continue;
+static inline void ParseLine(const char *begin, const char *end, sentence_t &output) {
+    output.clear();
 
-            outList.push_back(Corpus(sourceFile.string(), targetFile.string()));
-        }
+    while (begin < end) {
+        auto *space = (const char *) memchr(begin, ' ', (size_t) (end - begin));
+        const char *word_end = space ? space : end;
+
+        output.emplace_back(begin, word_end);
+        begin = word_end + 1;
     }
 }
 
-static inline void ParseLine(const string &line, sentence_t &output) {
+static inline void ParseLine(const Vocabulary *vocab, const char *begin, const char *end, wordvec_t &output) {
     output.clear();
 
-    std::stringstream stream(line);
-    std::string word;
+    while (begin < end) {
+        auto *space = (const char *) memchr(begin, ' ', (size_t) (end - begin));
+        const char *word_end = space ? space : end;
 
-    while (std::getline(stream, word, ' '))
-        output.push_back(word);
+        output.push_back(vocab->Get(begin, (size_t) (word_end - begin)));
+        begin = word_end + 1;
+    }
 }
 
-static inline void ParseLine(const Vocabulary *vocab, const string &line, wordvec_t &output) {
-    output.clear();
+static inline void ParseLine(const Vocabulary *vocab, const char *begin, const char *end, sentence_t &output) {
+    ParseLine(begin, end, output);
+}
 
-    std::stringstream stream(line);
-    std::string word;
+static inline const char *SkipLine(const char *position, const char *end) {
+    auto *newline = (const char *) memchr(position, '\n', (size_t) (end - position));
+    return newline ? newline + 1 : end;
+}
 
-    while (std::getline(stream, word, ' '))
-        output.push_back(vocab->Get(word));
+void CorpusReader::input_t::Open(const string &path) {
+    if (LineDecoder::IsCompressed(path)) {
+        decoder.reset(new LineDecoder(path));
+    } else {
+        file.reset(new MappedFile(path));
+        position = file->GetData();
+        end = position + file->GetSize();
+    }
 }
 
 CorpusReader::CorpusReader(const Corpus &corpus, const Vocabulary *vocabulary,
                            const size_t maxLineLength, const bool skipEmptyLines)
-        : drained(false), vocabulary(vocabulary), source(corpus.sourceFile.c_str()), target(corpus.targetFile.c_str()),
-          maxLineLength(maxLineLength), skipEmptyLines(skipEmptyLines) {
+        : vocabulary(vocabulary), maxLineLength(maxLineLength), skipEmptyLines(skipEmptyLines) {
+    source.Open(corpus.sourceFile);
+    target.Open(corpus.targetFile);
+
+    if (source.file)
+        source.file->AdviseSequential();
+    if (target.file)
+        target.file->AdviseSequential();
 }
 
-bool CorpusReader::Read(sentence_t &outSource, sentence_t &outTarget) {
-    if (drained)
-        return false;
-
-    string sourceLine, targetLine;
-    while (true) {
-        if (!getline(source, sourceLine) || !getline(target, targetLine)) {
-            drained = true;
-            return false;
-        }
+CorpusReader::CorpusReader(const Corpus &corpus, const corpus_range_t &range, const Vocabulary *vocabulary,
+                           const size_t maxLineLength, const bool skipEmptyLines)
+        : vocabulary(vocabulary), maxLineLength(maxLineLength), skipEmptyLines(skipEmptyLines) {
+    if (corpus.IsCompressed())
+        throw invalid_argument("compressed corpus cannot be read by ranges: " + corpus.GetName());
 
-        ParseLine(sourceLine, outSource);
-        ParseLine(targetLine, outTarget);
+    source.Open(corpus.sourceFile);
+    target.Open(corpus.targetFile);
 
-        if (Skip(outSource, outTarget))
-            continue;
+    if (range.source_begin > range.source_end || range.source_end > source.file->GetSize() ||
+        range.target_begin > range.target_end || range.target_end > target.file->GetSize())
+        throw invalid_argument("invalid range for corpus " + corpus.GetName());
 
-        return true;
-    }
+    source.position = source.file->GetData() + range.source_begin;
+    source.end = source.file->GetData() + range.source_end;
+    target.position = target.file->GetData() + range.target_begin;
+    target.end = target.file->GetData() + range.target_end;
 }
 
-bool CorpusReader::Read(vector<pair<sentence_t, sentence_t>> &outBuffer, size_t limit) {
-    if (drained)
-        return false;
-
-    vector<pair<string, string>> batch;
-    for (size_t i = 0; i < limit; ++i) {
-        string sourceLine, targetLine;
-        if (!getline(source, sourceLine) || !getline(target, targetLine)) {
-            drained = true;
-            break;
-        }
+void CorpusReader::Split(const Corpus &corpus, size_t rangeSize, vector<corpus_range_t> &outRanges) {
+    if (corpus.IsCompressed())
+        throw invalid_argument("compressed corpus cannot be split: " + corpus.GetName());
 
-        batch.push_back(pair<string, string>(sourceLine, targetLine));
-    }
+    MappedFile source(corpus.sourceFile);
+    MappedFile target(corpus.targetFile);
 
-    if (batch.empty())
-        return false;
+    const char *source_data = source.GetData();
+    const char *source_end = source_data + source.GetSize();
+    const char *target_data = target.GetData();
+    const char *target_end = target_data + target.GetSize();
 
-    outBuffer.resize(batch.size());
-#pragma omp parallel for schedule(dynamic)
-    for (size_t i = 0; i < batch.size(); ++i) {
-        ParseLine(batch[i].first, outBuffer[i].first);
-        ParseLine(batch[i].second, outBuffer[i].second);
+    const char *source_position = source_data;
+    const char *target_position = target_data;
+
+    // Target lines are skipped together with the source ones, so that ranges stay parallel
+    while (source_position < source_end && target_position < target_end) {
+        corpus_range_t range{};
+        range.source_begin = (size_t) (source_position - source_data);
+        range.target_begin = (size_t) (target_position - target_data);
+
+        do {
+            source_position = SkipLine(source_position, source_end);
+            target_position = SkipLine(target_position, target_end);
+        } while (source_position < source_end && target_position < target_end &&
+                 (size_t) (source_position - source_data) - range.source_begin < rangeSize);
+
+        range.source_end = (size_t) (source_position - source_data);
+        range.target_end = (size_t) (target_position - target_data);
+        outRanges.push_back(range);
     }
+}
 
-    if (skipEmptyLines || maxLineLength > 0) {
-        for (auto sentence = outBuffer.begin(); sentence != outBuffer.end(); /* no increment */) {
-            if (Skip(sentence->first, sentence->second))
-                sentence = outBuffer.erase(sentence);
-            else
-                ++sentence;
-        }
+bool CorpusReader::Read(sentence_t &outSource, sentence_t &outTarget) {
+    source.Release();
+    target.Release();
+
+    line_t sourceLine{}, targetLine{};
+
+    while (NextLines(sourceLine, targetLine)) {
+        ParseLine(sourceLine.begin, sourceLine.end, outSource);
+        ParseLine(targetLine.begin, targetLine.end, outTarget);
+
+        if (!Skip(outSource, outTarget))
+            return true;
     }
 
-    return !outBuffer.empty();
+    return false;
 }
 
 bool CorpusReader::Read(wordvec_t &outSource, wordvec_t &outTarget) {
-    if (drained)
-        return false;
-
-    string sourceLine, targetLine;
-    while (true) {
-        if (!getline(source, sourceLine) || !getline(target, targetLine)) {
-            drained = true;
-            return false;
-        }
+    source.Release();
+    target.Release();
 
-        ParseLine(vocabulary, sourceLine, outSource);
-        ParseLine(vocabulary, targetLine, outTarget);
+    line_t sourceLine{}, targetLine{};
 
-        if (Skip(outSource, outTarget))
-            continue;
+    while (NextLines(sourceLine, targetLine)) {
+        ParseLine(vocabulary, sourceLine.begin, sourceLine.end, outSource);
+        ParseLine(vocabulary, targetLine.begin, targetLine.end, outTarget);
 
-        return true;
+        if (!Skip(outSource, outTarget))
+            return true;
     }
+
+    return false;
 }
 
-bool CorpusReader::Read(std::vector<std::pair<wordvec_t, wordvec_t>> &outBuffer, size_t limit) {
-    if (drained)
-        return false;
+template<typename Sentence>
+bool CorpusReader::ReadBatch(vector<pair<Sentence, Sentence>> &outBuffer, size_t limit) {
+    vector<pair<line_t, line_t>> lines;
+    lines.reserve(limit);
 
-    vector<pair<string, string>> batch;
-    for (size_t i = 0; i < limit; ++i) {
-        string sourceLine, targetLine;
-        if (!getline(source, sourceLine) || !getline(target, targetLine)) {
-            drained = true;
-            break;
-        }
+    while (true) {
+        source.Release();
+        target.Release();
 
-        batch.push_back(pair<string, string>(sourceLine, targetLine));
-    }
+        pair<line_t, line_t> line;
+        while (lines.size() < limit && NextLines(line.first, line.second))
+            lines.push_back(line);
 
-    if (batch.empty())
-        return false;
+        if (lines.empty())
+            return false;
 
-    outBuffer.resize(batch.size());
+        // lines are parsed in place, the vectors of the buffer are reused
+        outBuffer.resize(lines.size());
 #pragma omp parallel for schedule(dynamic)
-    for (size_t i = 0; i < batch.size(); ++i) {
-        ParseLine(vocabulary, batch[i].first, outBuffer[i].first);
-        ParseLine(vocabulary, batch[i].second, outBuffer[i].second);
-    }
+        for (size_t i = 0; i < lines.size(); ++i) {
+            ParseLine(vocabulary, lines[i].first.begin, lines[i].first.end, outBuffer[i].first);
+            ParseLine(vocabulary, lines[i].second.begin, lines[i].second.end, outBuffer[i].second);
+        }
 
-    if (skipEmptyLines || maxLineLength > 0) {
-        for (auto sentence = outBuffer.begin(); sentence != outBuffer.end(); /* no increment */) {
-            if (Skip(sentence->first, sentence->second))
-                sentence = outBuffer.erase(sentence);
-            else
-                ++sentence;
+        if (skipEmptyLines || maxLineLength > 0) {
+            auto end = remove_if(outBuffer.begin(), outBuffer.end(), [this](const pair<Sentence, Sentence> &sentence) {
+                return Skip(sentence.first, sentence.second);
+            });
+            outBuffer.erase(end, outBuffer.end());
         }
+
+        if (!outBuffer.empty())
+            return true;
+
+        lines.clear();
     }
+}
+
+bool CorpusReader::Read(vector<pair<sentence_t, sentence_t>> &outBuffer, size_t limit) {
+    return ReadBatch(outBuffer, limit);
+}
 
-    return !outBuffer.empty();
+bool CorpusReader::Read(vector<pair<wordvec_t, wordvec_t>> &outBuffer, size_t limit) {
+    return ReadBatch(outBuffer, limit);
 }
@@ -5,11 +5,13 @@
 #ifndef FASTALIGN_CORPUS_H
 #define FASTALIGN_CORPUS_H
 
+#include <cstring>
 #include <string>
 #include <vector>
-#include <fstream>
-#include <sstream>
+#include <memory>
 #include "alignment.h"
+#include "MappedFile.h"
+#include "LineDecoder.h"
 
 namespace mmt {
     namespace fastalign {
@@ -29,17 +31,47 @@ namespace mmt {
                 return name;
             }
 
+            /**
+             * Returns true if at least one of the files is compressed: the corpus can be read only sequentially.
+             */
+            bool IsCompressed() const;
+
         private:
             const std::string name;
             const std::string sourceFile;
             const std::string targetFile;
         };
 
+        /**
+         * A range of whole lines of a corpus, as byte offsets in the source and target files.
+         */
+        struct corpus_range_t {
+            size_t source_begin;
+            size_t source_end;
+            size_t target_begin;
+            size_t target_end;
+        };
+
+        /**
+         * Reads a corpus from the memory-mapped source and target files: lines are found with memchr()
+         * and words are encoded in place, without intermediate strings.
+         * Compressed files are decoded in background threads (see LineDecoder) and read in the same way.
+         */
         class CorpusReader {
         public:
             explicit CorpusReader(const Corpus &corpus, const Vocabulary *vocabulary = nullptr,
                                   size_t maxLineLength = 0, bool skipEmptyLines = false);
 
+            CorpusReader(const Corpus &corpus, const corpus_range_t &range, const Vocabulary *vocabulary = nullptr,
+                         size_t maxLineLength = 0, bool skipEmptyLines = false);
+
+            /**
+             * Splits the corpus in consecutive ranges of lines, each one with about rangeSize bytes
+             * of source text, that can be read in parallel by different readers.
+             * Compressed corpora cannot be split.
+             */
+            static void Split(const Corpus &corpus, size_t rangeSize, std::vector<corpus_range_t> &outRanges);
+
             bool Read(sentence_t &outSource, sentence_t &outTarget);
 
             bool Read(std::vector<std::pair<sentence_t, sentence_t>> &outBuffer, size_t limit);
@@ -49,28 +81,77 @@ namespace mmt {
             bool Read(std::vector<std::pair<wordvec_t, wordvec_t>> &outBuffer, size_t limit);
 
         private:
-            bool drained;
+            struct line_t {
+                const char *begin;
+                const char *end;
+            };
+
+            // A side of the corpus: a memory-mapped file, or the decoded blocks of a compressed one
+            struct input_t {
+                std::shared_ptr<MappedFile> file;
+                std::unique_ptr<LineDecoder> decoder;
+                std::vector<std::shared_ptr<const std::string>> blocks; // referenced by the lines read last
+
+                const char *position = nullptr;
+                const char *end = nullptr;
+
+                void Open(const std::string &path);
+
+                inline bool HasNext() {
+                    while (position >= end) {
+                        std::shared_ptr<const std::string> block = decoder ? decoder->Next() : nullptr;
+                        if (!block)
+                            return false;
+
+                        blocks.push_back(block);
+                        position = block->data();
+                        end = position + block->size();
+                    }
+
+                    return true;
+                }
+
+                inline void NextLine(line_t &outLine) {
+                    auto *newline = (const char *) memchr(position, '\n', (size_t) (end - position));
+
+                    outLine.begin = position;
+                    outLine.end = newline ? newline : end;
+                    position = newline ? newline + 1 : end;
+                }
+
+                // Blocks are released when their lines have been parsed, but the current one
+                inline void Release() {
+                    if (blocks.size() > 1)
+                        blocks.erase(blocks.begin(), blocks.end() - 1);
+                }
+            };
 
             const Vocabulary *vocabulary;
-            std::ifstream source;
-            std::ifstream target;
+            input_t source;
+            input_t target;
 
             const size_t maxLineLength;
             const bool skipEmptyLines;
 
-            inline bool Skip(const sentence_t &source, const sentence_t &target) const {
-                if (skipEmptyLines && (source.empty() || target.empty()))
-                    return true;
+            inline bool NextLines(line_t &outSource, line_t &outTarget) {
+                if (!source.HasNext() || !target.HasNext())
+                    return false;
 
-                return maxLineLength > 0 && (source.size() > maxLineLength || target.size() > maxLineLength);
+                source.NextLine(outSource);
+                target.NextLine(outTarget);
+                return true;
             }
 
-            inline bool Skip(const wordvec_t &source, const wordvec_t &target) const {
+            template<typename Sentence>
+            inline bool Skip(const Sentence &source, const Sentence &target) const {
                 if (skipEmptyLines && (source.empty() || target.empty()))
                     return true;
 
                 return maxLineLength > 0 && (source.size() > maxLineLength || target.size() > maxLineLength);
             }
+
+            template<typename Sentence>
+            bool ReadBatch(std::vector<std::pair<Sentence, Sentence>> &outBuffer, size_t limit);
         };
     }
 }
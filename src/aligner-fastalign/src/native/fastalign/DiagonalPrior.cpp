@@ -0,0 +1,95 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "DiagonalPrior.h"
+#include "DiagonalAlignment.h"
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+const length_t DiagonalPrior::kMaxLength;
+const size_t DiagonalPrior::kDefaultBudget;
+
+static void ComputePrior(length_t m, length_t n, double tension, double prob_align_null, double *output) {
+    for (length_t j = 0; j < m; ++j) {
+        // same operations of the alignment kernel, so that cached values are bit-identical
+        double az = DiagonalAlignment::ComputeZ(j + 1, m, n, tension) / (1. - prob_align_null);
+
+        for (length_t i = 1; i <= n; ++i)
+            output[j * n + (i - 1)] = DiagonalAlignment::UnnormalizedProb(j + 1, i, m, n, tension) / az;
+    }
+}
+
+DiagonalPrior::DiagonalPrior(double tension, double prob_align_null, size_t budget)
+        : tension(tension), prob_align_null(prob_align_null), budget(budget), allocated(0),
+          tables(new atomic<double *>[((size_t) kMaxLength) * kMaxLength]) {
+    for (size_t i = 0; i < ((size_t) kMaxLength) * kMaxLength; ++i)
+        tables[i].store(nullptr, memory_order_relaxed);
+}
+
+DiagonalPrior::~DiagonalPrior() {
+    Clear();
+}
+
+const double *DiagonalPrior::Compute(length_t m, length_t n, vector<double> &buffer) const {
+    buffer.resize(((size_t) m) * n);
+    ComputePrior(m, n, tension, prob_align_null, buffer.data());
+    return buffer.data();
+}
+
+const double *DiagonalPrior::Fill(length_t m, length_t n, vector<double> &buffer) const {
+    size_t size = ((size_t) m) * n * sizeof(double);
+
+    if (allocated.fetch_add(size, memory_order_relaxed) + size > budget) {
+        allocated.fetch_sub(size, memory_order_relaxed);
+        return Compute(m, n, buffer);
+    }
+
+    auto *table = new double[((size_t) m) * n];
+    ComputePrior(m, n, tension, prob_align_null, table);
+
+    // another thread may have filled the same table in the meantime: the first one wins
+    double *expected = nullptr;
+    if (tables[(m - 1) * kMaxLength + (n - 1)].compare_exchange_strong(expected, table, memory_order_acq_rel)) {
+        return table;
+    } else {
+        delete[] table;
+        allocated.fetch_sub(size, memory_order_relaxed);
+        return expected;
+    }
+}
+
+void DiagonalPrior::Precompute(length_t length) {
+    if (length > kMaxLength)
+        length = kMaxLength;
+
+#pragma omp parallel
+    {
+        vector<double> buffer;
+
+#pragma omp for schedule(dynamic)
+        for (size_t k = 0; k < ((size_t) length) * length; ++k) {
+            auto m = (length_t) (k / length + 1);
+            auto n = (length_t) (k % length + 1);
+
+            if (!tables[(m - 1) * kMaxLength + (n - 1)].load(memory_order_acquire))
+                Fill(m, n, buffer);
+        }
+    }
+}
+
+void DiagonalPrior::Reset(double tension) {
+    Clear();
+    this->tension = tension;
+}
+
+void DiagonalPrior::Clear() {
+    for (size_t i = 0; i < ((size_t) kMaxLength) * kMaxLength; ++i) {
+        double *table = tables[i].exchange(nullptr, memory_order_relaxed);
+        delete[] table;
+    }
+
+    allocated.store(0, memory_order_relaxed);
+}
@@ -0,0 +1,80 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_DIAGONALPRIOR_H
+#define MMT_FASTALIGN_DIAGONALPRIOR_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "alignment.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Cache of the normalized diagonal prior of every (target length, source length) pair.
+         *
+         * The table of lengths (m, n) holds m rows of n values: the value (j, i) is the probability that
+         * the j-th target word is aligned to the i-th source word (both 0-based), as computed by
+         * DiagonalAlignment for the given tension and null alignment probability.
+         *
+         * Tables are filled lazily and published with atomic pointers, so Get() can be called concurrently.
+         * Lengths greater than kMaxLength, or tables that exceed the memory budget, are computed on the fly
+         * in the caller's buffer.
+         */
+        class DiagonalPrior {
+        public:
+            static const length_t kMaxLength = 256;
+            static const size_t kDefaultBudget = 128 * 1024 * 1024;
+
+            DiagonalPrior(double tension, double prob_align_null, size_t budget = kDefaultBudget);
+
+            DiagonalPrior(const DiagonalPrior &) = delete;
+
+            DiagonalPrior &operator=(const DiagonalPrior &) = delete;
+
+            ~DiagonalPrior();
+
+            inline double GetTension() const {
+                return tension;
+            }
+
+            inline const double *Get(length_t m, length_t n, std::vector<double> &buffer) const {
+                if (m == 0 || n == 0 || m > kMaxLength || n > kMaxLength)
+                    return Compute(m, n, buffer);
+
+                const double *table = tables[(m - 1) * kMaxLength + (n - 1)].load(std::memory_order_acquire);
+                return table ? table : Fill(m, n, buffer);
+            }
+
+            /**
+             * Fills all the tables with both lengths lower or equal to "length".
+             */
+            void Precompute(length_t length);
+
+            /**
+             * Drops all the tables and sets a new tension, it must not be called concurrently with Get().
+             */
+            void Reset(double tension);
+
+        private:
+            double tension;
+            const double prob_align_null;
+            const size_t budget;
+
+            mutable std::atomic<size_t> allocated;
+            std::unique_ptr<std::atomic<double *>[]> tables;
+
+            const double *Compute(length_t m, length_t n, std::vector<double> &buffer) const;
+
+            const double *Fill(length_t m, length_t n, std::vector<double> &buffer) const;
+
+            void Clear();
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_DIAGONALPRIOR_H
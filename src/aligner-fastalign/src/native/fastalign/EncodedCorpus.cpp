@@ -0,0 +1,141 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "EncodedCorpus.h"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+#include "Vocabulary.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace fs = boost::filesystem;
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+// Bytes of source text encoded by a thread at once
+static const size_t kEncodingRangeSize = 4 * 1024 * 1024;
+
+EncodedCorpus::EncodedCorpus(const vector<Corpus> &corpora, const Vocabulary &vocabulary, size_t maxLineLength,
+                             size_t bufferSize, const string &path) : size(0), data(nullptr), length(0) {
+    ofstream out;
+    if (!path.empty()) {
+        out.open(path, ios::binary | ios::out | ios::trunc);
+        if (!out)
+            throw runtime_error("unable to write corpus file: " + path);
+    }
+
+#ifdef _OPENMP
+    auto threads = (size_t) omp_get_max_threads();
+#else
+    size_t threads = 1;
+#endif
+
+    size_t written = 0;
+
+    for (auto corpus = corpora.begin(); corpus != corpora.end(); ++corpus) {
+        // Compressed corpora can be read only sequentially, the whole corpus is a single range
+        vector<corpus_range_t> ranges;
+        if (corpus->IsCompressed())
+            ranges.resize(1);
+        else
+            CorpusReader::Split(*corpus, kEncodingRangeSize, ranges);
+
+        // Every thread encodes its own range, chunks are then appended in order
+        for (size_t first = 0; first < ranges.size(); first += threads) {
+            size_t count = min(threads, ranges.size() - first);
+            vector<vector<uint32_t>> chunks(count);
+            vector<size_t> sizes(count, 0);
+
+#pragma omp parallel for schedule(dynamic)
+            for (size_t i = 0; i < count; ++i) {
+                unique_ptr<CorpusReader> reader(corpus->IsCompressed() ?
+                                                new CorpusReader(*corpus, &vocabulary, maxLineLength, true) :
+                                                new CorpusReader(*corpus, ranges[first + i], &vocabulary,
+                                                                 maxLineLength, true));
+                vector<pair<wordvec_t, wordvec_t>> batch;
+
+                while (reader->Read(batch, bufferSize)) {
+                    for (auto sentence = batch.begin(); sentence != batch.end(); ++sentence) {
+                        chunks[i].push_back((uint32_t) sentence->first.size());
+                        chunks[i].push_back((uint32_t) sentence->second.size());
+                        chunks[i].insert(chunks[i].end(), sentence->first.begin(), sentence->first.end());
+                        chunks[i].insert(chunks[i].end(), sentence->second.begin(), sentence->second.end());
+                    }
+
+                    sizes[i] += batch.size();
+                }
+            }
+
+            for (size_t i = 0; i < count; ++i) {
+                if (path.empty())
+                    memory.insert(memory.end(), chunks[i].begin(), chunks[i].end());
+                else
+                    out.write((const char *) chunks[i].data(), chunks[i].size() * sizeof(uint32_t));
+
+                written += chunks[i].size();
+                size += sizes[i];
+            }
+        }
+
+        boundaries.push_back(written);
+    }
+
+    if (path.empty()) {
+        memory.shrink_to_fit();
+        data = memory.data();
+        length = memory.size();
+    } else {
+        out.close();
+        if (!out)
+            throw runtime_error("error while writing corpus file: " + path);
+
+        file.reset(new MappedFile(path));
+        fs::remove(path);  // the mapping keeps the content available
+
+        data = (const uint32_t *) file->GetData();
+        length = file->GetSize() / sizeof(uint32_t);
+    }
+}
+
+EncodedCorpus::Reader::Reader(const EncodedCorpus &corpus) : corpus(corpus), position(corpus.data), index(0) {
+}
+
+bool EncodedCorpus::Reader::Read(vector<pair<wordvec_t, wordvec_t>> &outBuffer, size_t limit) {
+    // inner vectors are reused, so that their memory is not reallocated at every batch
+    while (index < corpus.boundaries.size() && position == corpus.data + corpus.boundaries[index])
+        index++;
+
+    if (index == corpus.boundaries.size()) {
+        outBuffer.clear();
+        return false;
+    }
+
+    const uint32_t *end = corpus.data + corpus.boundaries[index];
+
+    size_t count = 0;
+    while (count < limit && position < end) {
+        uint32_t source_size = position[0];
+        uint32_t target_size = position[1];
+        position += 2;
+
+        if (outBuffer.size() <= count)
+            outBuffer.resize(count + 1);
+
+        outBuffer[count].first.assign(position, position + source_size);
+        position += source_size;
+        outBuffer[count].second.assign(position, position + target_size);
+        position += target_size;
+
+        count++;
+    }
+
+    outBuffer.resize(count);
+    return count > 0;
+}
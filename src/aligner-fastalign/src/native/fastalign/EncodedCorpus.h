@@ -0,0 +1,65 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_ENCODEDCORPUS_H
+#define MMT_FASTALIGN_ENCODEDCORPUS_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "alignment.h"
+#include "Corpus.h"
+#include "MappedFile.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * A collection of parallel corpora, tokenized and encoded with a vocabulary only once.
+         *
+         * Sentence pairs are stored as a single stream of 32-bit values: source length, target length,
+         * source word ids and target word ids. The stream is kept in memory or, if a path is given,
+         * in a temporary file that is memory-mapped and removed as soon as it is mapped.
+         * Batches never span two corpora, so that they are the same ones returned by CorpusReader.
+         */
+        class EncodedCorpus {
+        public:
+            class Reader {
+            public:
+                explicit Reader(const EncodedCorpus &corpus);
+
+                bool Read(std::vector<std::pair<wordvec_t, wordvec_t>> &outBuffer, size_t limit);
+
+            private:
+                const EncodedCorpus &corpus;
+                const uint32_t *position;
+                size_t index;
+            };
+
+            EncodedCorpus(const std::vector<Corpus> &corpora, const Vocabulary &vocabulary, size_t maxLineLength,
+                          size_t bufferSize, const std::string &path = "");
+
+            EncodedCorpus(const EncodedCorpus &) = delete;
+
+            EncodedCorpus &operator=(const EncodedCorpus &) = delete;
+
+            inline size_t Size() const {
+                return size;
+            }
+
+        private:
+            size_t size;
+
+            const uint32_t *data;
+            size_t length;
+
+            std::vector<size_t> boundaries; // stream offsets where each corpus ends
+            std::vector<uint32_t> memory;
+            std::unique_ptr<MappedFile> file;
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_ENCODEDCORPUS_H
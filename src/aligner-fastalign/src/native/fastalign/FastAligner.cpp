@@ -5,8 +5,10 @@
 #include <symal/SymAlignment.h>
 #include "FastAligner.h"
 #include <thread>
+#include <fstream>
 #include <boost/filesystem.hpp>
 #include "BidirectionalModel.h"
+#include "ModelFile.h"
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -18,40 +20,87 @@ using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
 
-FastAligner::FastAligner(const string &path, int threads) {
-    fs::path model_path = fs::absolute(fs::path(path));
-    if (!fs::is_regular(model_path))
-        throw invalid_argument("file not found: " + model_path.string());
+// Sentence pairs with both lengths up to this value get their diagonal prior computed at load time
+static const length_t kPrecomputedPriorLength = 40;
 
-    ifstream in(model_path.string(), ios::binary | ios::in);
-    vocabulary = Vocabulary(in);
-    BidirectionalModel::Open(in, &forwardModel, &backwardModel);
-    in.close();
+// Weight of the model probabilities in the online updates, as occurrences of every word
+static const double kOnlinePriorMass = 10.;
 
+FastAligner::FastAligner(const string &path, int threads) {
     this->threads = threads > 0 ? threads : (int) thread::hardware_concurrency();
 #ifdef _OPENMP
     omp_set_dynamic(0);
     omp_set_num_threads(this->threads);
 #endif
+
+    model = Load(path);
+}
+
+FastAligner::~FastAligner() = default;
+
+shared_ptr<const FastAligner::model_t> FastAligner::Load(const string &path) {
+    fs::path model_path = fs::absolute(fs::path(path));
+    if (!fs::is_regular(model_path))
+        throw invalid_argument("file not found: " + model_path.string());
+
+    shared_ptr<model_t> model(new model_t);
+    Model *forwardModel = nullptr;
+    Model *backwardModel = nullptr;
+
+    if (ModelFile::IsModelFile(model_path.string())) {
+        ModelFile::Open(model_path.string(), &model->vocabulary, &forwardModel, &backwardModel);
+    } else {
+        ifstream in(model_path.string(), ios::binary | ios::in);
+        model->vocabulary = Vocabulary(in);
+        BidirectionalModel::Open(in, &forwardModel, &backwardModel);
+        in.close();
+    }
+
+    model->forward.reset((BidirectionalModel *) forwardModel);
+    model->backward.reset((BidirectionalModel *) backwardModel);
+
+    model->forward->PrecomputeDiagonalPrior(kPrecomputedPriorLength);
+    model->backward->PrecomputeDiagonalPrior(kPrecomputedPriorLength);
+
+    model->online.reset(new OnlineTable(model->vocabulary.Size(), kOnlinePriorMass));
+    model->forward->SetOnlineTable(model->online);
+    model->backward->SetOnlineTable(model->online);
+
+    return model;
+}
+
+void FastAligner::Reload(const string &path) {
+    lock_guard<mutex> lock(reload_mutex);
+
+    shared_ptr<const model_t> next = Load(path);
+    atomic_store(&model, next);
 }
 
-FastAligner::~FastAligner() {
-    delete forwardModel;
-    delete backwardModel;
+shared_ptr<const Vocabulary> FastAligner::GetVocabulary() const {
+    shared_ptr<const model_t> current = Acquire();
+    return shared_ptr<const Vocabulary>(current, &current->vocabulary);
 }
 
 alignment_t FastAligner::GetAlignment(const sentence_t &_source, const sentence_t &_target,
                                       Symmetrization symmetrization) {
+    shared_ptr<const model_t> current = Acquire();
+
     wordvec_t source, target;
-    vocabulary.Encode(_source, source);
-    vocabulary.Encode(_target, target);
+    current->vocabulary.Encode(_source, source);
+    current->vocabulary.Encode(_target, target);
 
-    return GetAlignment(source, target, symmetrization);
+    return Align(*current, source, target, symmetrization);
 }
 
 alignment_t FastAligner::GetAlignment(const wordvec_t &source, const wordvec_t &target, Symmetrization symmetrization) {
-    alignment_t forward = forwardModel->ComputeAlignment(source, target, &vocabulary);
-    alignment_t backward = backwardModel->ComputeAlignment(source, target, &vocabulary);
+    return Align(*Acquire(), source, target, symmetrization);
+}
+
+alignment_t FastAligner::Align(const model_t &model, const wordvec_t &source, const wordvec_t &target,
+                               Symmetrization symmetrization) {
+    alignment_t forward, backward;
+    BidirectionalModel::ComputeAlignment(model.forward.get(), model.backward.get(),
+                                         source, target, &forward, &backward, &model.vocabulary);
 
     SymAlignment symmetrizer(source.size(), target.size());
 
@@ -75,6 +124,9 @@ alignment_t FastAligner::GetAlignment(const wordvec_t &source, const wordvec_t &
 
 void FastAligner::GetAlignments(const std::vector<std::pair<sentence_t, sentence_t>> &_batch,
                                 std::vector<alignment_t> &outAlignments, Symmetrization symmetrization) {
+    shared_ptr<const model_t> current = Acquire();
+    const Vocabulary &vocabulary = current->vocabulary;
+
     vector<pair<wordvec_t, wordvec_t>> batch;
     batch.resize(_batch.size());
 
@@ -84,16 +136,21 @@ void FastAligner::GetAlignments(const std::vector<std::pair<sentence_t, sentence
         vocabulary.Encode(_batch[i].second, batch[i].second);
     }
 
-    GetAlignments(batch, outAlignments, symmetrization);
+    Align(*current, batch, outAlignments, symmetrization);
 }
 
 void FastAligner::GetAlignments(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
                                 std::vector<alignment_t> &outAlignments, Symmetrization symmetrization) {
+    Align(*Acquire(), batch, outAlignments, symmetrization);
+}
+
+void FastAligner::Align(const model_t &model, const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                        std::vector<alignment_t> &outAlignments, Symmetrization symmetrization) {
     vector<alignment_t> forwards;
     vector<alignment_t> backwards;
 
-    forwardModel->ComputeAlignments(batch, forwards, &vocabulary);
-    backwardModel->ComputeAlignments(batch, backwards, &vocabulary);
+    BidirectionalModel::ComputeAlignments(model.forward.get(), model.backward.get(),
+                                          batch, forwards, backwards, &model.vocabulary);
 
     outAlignments.resize(batch.size());
 
@@ -122,4 +179,28 @@ void FastAligner::GetAlignments(const std::vector<std::pair<wordvec_t, wordvec_t
 
         outAlignments[i] = symal.ToAlignment();
     }
-}
\ No newline at end of file
+}
+
+void FastAligner::Update(const std::vector<std::pair<sentence_t, sentence_t>> &_batch) {
+    shared_ptr<const model_t> current = Acquire();
+    const Vocabulary &vocabulary = current->vocabulary;
+
+    vector<pair<wordvec_t, wordvec_t>> batch(_batch.size());
+
+    for (size_t i = 0; i < batch.size(); ++i) {
+        vocabulary.Encode(_batch[i].first, batch[i].first);
+        vocabulary.Encode(_batch[i].second, batch[i].second);
+    }
+
+    Update(*current, batch);
+}
+
+void FastAligner::Update(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch) {
+    Update(*Acquire(), batch);
+}
+
+void FastAligner::Update(const model_t &model, const std::vector<std::pair<wordvec_t, wordvec_t>> &batch) {
+    OnlineTable::counts_t counts;
+    BidirectionalModel::ComputeExpectedCounts(model.forward.get(), model.backward.get(), batch, counts);
+    model.online->Update(counts);
+}
@@ -5,6 +5,8 @@
 #ifndef FASTALIGN_ALIGNER_H
 #define FASTALIGN_ALIGNER_H
 
+#include <memory>
+#include <mutex>
 #include <string>
 #include "Model.h"
 #include "Vocabulary.h"
@@ -19,12 +21,24 @@ namespace mmt {
             Union = 4
         };
 
+        class OnlineTable;
+
+        class BidirectionalModel;
+
+        /**
+         * Aligner that can replace its model while serving requests: every call works on the model that is
+         * current when it starts, and a model is released when the last call that uses it returns.
+         */
         class FastAligner {
         public:
             explicit FastAligner(const std::string &path, int threads = 0);
 
             alignment_t GetAlignment(const sentence_t &source, const sentence_t &target, Symmetrization symmetrization);
 
+            /**
+             * Word ids are the ones of the vocabulary returned by GetVocabulary(): if the model has been
+             * reloaded in the meantime, they are resolved with the vocabulary of the new model.
+             */
             alignment_t GetAlignment(const wordvec_t &source, const wordvec_t &target, Symmetrization symmetrization);
 
             void GetAlignments(const std::vector<std::pair<sentence_t, sentence_t>> &batch,
@@ -33,18 +47,57 @@ namespace mmt {
             void GetAlignments(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
                                std::vector<alignment_t> &outAlignments, Symmetrization symmetrization);
 
-            const Vocabulary &GetVocabulary() const {
-                return vocabulary;
-            }
+            /**
+             * Updates the model with new sentence pairs (online EM). The alignments computed concurrently
+             * read a consistent version of the model, that includes all the batches completed before they
+             * started. Words that are not in the vocabulary are updated as the unknown word.
+             */
+            void Update(const std::vector<std::pair<sentence_t, sentence_t>> &batch);
+
+            void Update(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch);
+
+            /**
+             * Replaces the model with the one stored at the given path. The new model is loaded in the calling
+             * thread while the current one keeps serving requests, then it is published atomically: calls in
+             * progress complete with the previous model, that is freed when the last of them returns.
+             * Online updates of the previous model are discarded. Concurrent reloads are serialized.
+             */
+            void Reload(const std::string &path);
+
+            /**
+             * Returns the vocabulary of the current model, that stays valid after a reload.
+             */
+            std::shared_ptr<const Vocabulary> GetVocabulary() const;
 
             virtual ~FastAligner();
 
         private:
-            Vocabulary vocabulary;
-            Model *forwardModel;
-            Model *backwardModel;
+            struct model_t {
+                Vocabulary vocabulary;
+                std::unique_ptr<BidirectionalModel> forward;
+                std::unique_ptr<BidirectionalModel> backward;
+                std::shared_ptr<OnlineTable> online;
+            };
+
+            // read and replaced with std::atomic_load() and std::atomic_store()
+            std::shared_ptr<const model_t> model;
+            std::mutex reload_mutex;
 
             int threads;
+
+            static std::shared_ptr<const model_t> Load(const std::string &path);
+
+            inline std::shared_ptr<const model_t> Acquire() const {
+                return std::atomic_load(&model);
+            }
+
+            static alignment_t Align(const model_t &model, const wordvec_t &source, const wordvec_t &target,
+                                     Symmetrization symmetrization);
+
+            static void Align(const model_t &model, const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
+                              std::vector<alignment_t> &outAlignments, Symmetrization symmetrization);
+
+            static void Update(const model_t &model, const std::vector<std::pair<wordvec_t, wordvec_t>> &batch);
         };
 
     }
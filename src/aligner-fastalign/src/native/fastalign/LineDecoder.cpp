@@ -0,0 +1,236 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "LineDecoder.h"
+#include <cstring>
+#include <stdexcept>
+#include <zlib.h>
+
+#ifdef HAVE_ZSTD
+#include <vector>
+#include <zstd.h>
+#include <cstdio>
+#endif
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+static const size_t kReadSize = 1024 * 1024;
+static const size_t kMaxQueuedBlocks = 8;
+
+#ifdef HAVE_ZSTD
+static const char *const kExtensions[] = {".gz", ".zst", nullptr};
+#else
+static const char *const kExtensions[] = {".gz", nullptr};
+#endif
+
+static inline bool EndsWith(const string &str, const char *suffix) {
+    size_t length = strlen(suffix);
+    return str.size() > length && str.compare(str.size() - length, length, suffix) == 0;
+}
+
+namespace {
+
+    /**
+     * Sequential decompression of a whole file, Read() returns 0 at the end of the file.
+     */
+    class Decompressor {
+    public:
+        virtual ~Decompressor() = default;
+
+        virtual size_t Read(char *buffer, size_t size) = 0;
+    };
+
+    class GzipDecompressor : public Decompressor {
+    public:
+        explicit GzipDecompressor(const string &path) : path(path) {
+            file = gzopen(path.c_str(), "rb");
+            if (!file)
+                throw runtime_error("unable to open file: " + path);
+
+            gzbuffer(file, (unsigned) kReadSize);
+        }
+
+        ~GzipDecompressor() override {
+            gzclose(file);
+        }
+
+        size_t Read(char *buffer, size_t size) override {
+            int read = gzread(file, buffer, (unsigned) size);
+
+            // a truncated file is reported only once the available data has been read
+            int error = Z_OK;
+            if (read <= 0)
+                gzerror(file, &error);
+
+            if (read < 0 || (error != Z_OK && error != Z_STREAM_END))
+                throw runtime_error("invalid gzip file: " + path);
+
+            return (size_t) read;
+        }
+
+    private:
+        const string path;
+        gzFile file;
+    };
+
+#ifdef HAVE_ZSTD
+
+    class ZstdDecompressor : public Decompressor {
+    public:
+        explicit ZstdDecompressor(const string &path) : path(path), input(ZSTD_DStreamInSize()) {
+            file = fopen(path.c_str(), "rb");
+            if (!file)
+                throw runtime_error("unable to open file: " + path);
+
+            stream = ZSTD_createDStream();
+            ZSTD_initDStream(stream);
+
+            in_buffer.src = input.data();
+            in_buffer.size = 0;
+            in_buffer.pos = 0;
+        }
+
+        ~ZstdDecompressor() override {
+            ZSTD_freeDStream(stream);
+            fclose(file);
+        }
+
+        size_t Read(char *buffer, size_t size) override {
+            ZSTD_outBuffer out_buffer = {buffer, size, 0};
+
+            while (out_buffer.pos == 0) {
+                if (in_buffer.pos == in_buffer.size) {
+                    in_buffer.size = fread(input.data(), 1, input.size(), file);
+                    in_buffer.pos = 0;
+
+                    if (in_buffer.size == 0)
+                        break;
+                }
+
+                size_t result = ZSTD_decompressStream(stream, &out_buffer, &in_buffer);
+                if (ZSTD_isError(result))
+                    throw runtime_error("invalid zstd file: " + path + " (" + ZSTD_getErrorName(result) + ")");
+            }
+
+            return out_buffer.pos;
+        }
+
+    private:
+        const string path;
+        FILE *file;
+        ZSTD_DStream *stream;
+        vector<char> input;
+        ZSTD_inBuffer in_buffer;
+    };
+
+#endif
+
+}
+
+bool LineDecoder::IsCompressed(const string &path) {
+    for (const char *const *extension = kExtensions; *extension; ++extension) {
+        if (EndsWith(path, *extension))
+            return true;
+    }
+
+    return false;
+}
+
+const char *const *LineDecoder::GetExtensions() {
+    return kExtensions;
+}
+
+LineDecoder::LineDecoder(const string &path) : path(path), completed(false), stopped(false) {
+    if (!IsCompressed(path))
+        throw invalid_argument("unsupported compressed file: " + path);
+
+    worker = thread(&LineDecoder::Run, this);
+}
+
+LineDecoder::~LineDecoder() {
+    stopped = true;
+    consumed.notify_all();
+    worker.join();
+}
+
+shared_ptr<const string> LineDecoder::Next() {
+    unique_lock<std::mutex> lock(mutex);
+    produced.wait(lock, [this] { return !blocks.empty() || completed; });
+
+    if (!blocks.empty()) {
+        shared_ptr<const string> block = blocks.front();
+        blocks.pop_front();
+        consumed.notify_one();
+        return block;
+    }
+
+    if (error)
+        rethrow_exception(error);
+
+    return nullptr;
+}
+
+bool LineDecoder::Push(shared_ptr<const string> block) {
+    unique_lock<std::mutex> lock(mutex);
+    consumed.wait(lock, [this] { return blocks.size() < kMaxQueuedBlocks || stopped; });
+
+    if (stopped)
+        return false;
+
+    blocks.push_back(block);
+    produced.notify_one();
+    return true;
+}
+
+void LineDecoder::Run() {
+    try {
+        unique_ptr<Decompressor> decompressor;
+#ifdef HAVE_ZSTD
+        if (EndsWith(path, ".zst"))
+            decompressor.reset(new ZstdDecompressor(path));
+        else
+#endif
+            decompressor.reset(new GzipDecompressor(path));
+
+        // Blocks end with a newline, the incomplete last line is moved to the following block
+        string tail;
+
+        while (!stopped) {
+            shared_ptr<string> block(new string());
+            block->swap(tail);
+
+            size_t offset = block->size();
+            block->resize(offset + kReadSize);
+            size_t read = decompressor->Read(&(*block)[offset], kReadSize);
+            block->resize(offset + read);
+
+            if (read == 0) {
+                if (!block->empty())
+                    Push(block);
+                break;
+            }
+
+            size_t newline = block->rfind('\n');
+            if (newline == string::npos) {
+                tail.swap(*block);
+                continue;
+            }
+
+            tail.assign(*block, newline + 1, string::npos);
+            block->resize(newline + 1);
+
+            if (!Push(block))
+                break;
+        }
+    } catch (...) {
+        lock_guard<std::mutex> lock(mutex);
+        error = current_exception();
+    }
+
+    lock_guard<std::mutex> lock(mutex);
+    completed = true;
+    produced.notify_all();
+}
@@ -0,0 +1,72 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_LINEDECODER_H
+#define MMT_FASTALIGN_LINEDECODER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Decompresses a gzip (or zstd, if available at build time) file in a background thread.
+         * The decoded text is returned in blocks of whole lines; a bounded number of blocks is
+         * decoded ahead, so that decompression runs while the previous lines are processed.
+         */
+        class LineDecoder {
+        public:
+            explicit LineDecoder(const std::string &path);
+
+            LineDecoder(const LineDecoder &) = delete;
+
+            LineDecoder &operator=(const LineDecoder &) = delete;
+
+            ~LineDecoder();
+
+            /**
+             * Returns the next block of lines, or nullptr at the end of the file.
+             * Decoding errors are thrown here, in the reading thread.
+             */
+            std::shared_ptr<const std::string> Next();
+
+            /**
+             * Returns true if the path has a compression extension supported by this build.
+             */
+            static bool IsCompressed(const std::string &path);
+
+            /**
+             * Returns the supported compression extensions, including the dot.
+             */
+            static const char *const *GetExtensions();
+
+        private:
+            const std::string path;
+
+            std::mutex mutex;
+            std::condition_variable produced;
+            std::condition_variable consumed;
+            std::deque<std::shared_ptr<const std::string>> blocks;
+            bool completed;
+            std::exception_ptr error;
+            std::atomic<bool> stopped;
+
+            std::thread worker;
+
+            void Run();
+
+            bool Push(std::shared_ptr<const std::string> block);
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_LINEDECODER_H
@@ -0,0 +1,51 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "MappedFile.h"
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+MappedFile::MappedFile(const string &path) : data(nullptr), size(0) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("unable to open file: " + path);
+
+    struct stat info{};
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw runtime_error("unable to stat file: " + path);
+    }
+
+    size = (size_t) info.st_size;
+
+    if (size > 0) {
+        void *ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("unable to map file: " + path);
+        }
+
+        data = (const char *) ptr;
+    }
+
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data)
+        munmap((void *) data, size);
+}
+
+void MappedFile::AdviseSequential() const {
+    if (data)
+        madvise((void *) data, size, MADV_SEQUENTIAL);
+}
@@ -0,0 +1,50 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_MAPPEDFILE_H
+#define MMT_FASTALIGN_MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Read-only, shared memory mapping of a whole file.
+         * Pages are backed by the OS page cache, so several processes mapping
+         * the same file share the same physical memory.
+         */
+        class MappedFile {
+        public:
+            explicit MappedFile(const std::string &path);
+
+            MappedFile(const MappedFile &) = delete;
+
+            MappedFile &operator=(const MappedFile &) = delete;
+
+            ~MappedFile();
+
+            inline const char *GetData() const {
+                return data;
+            }
+
+            inline size_t GetSize() const {
+                return size;
+            }
+
+            /**
+             * Hints the OS that the file will be read sequentially, so pages are read ahead aggressively.
+             */
+            void AdviseSequential() const;
+
+        private:
+            const char *data;
+            size_t size;
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_MAPPEDFILE_H
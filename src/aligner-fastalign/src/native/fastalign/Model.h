@@ -8,16 +8,42 @@
 #include <string>
 #include <vector>
 #include <unordered_map>
+#include <cassert>
+#include <cmath>
+#include <memory>
 #include "alignment.h"
 #include "Vocabulary.h"
+#include "DiagonalAlignment.h"
+#include "DiagonalPrior.h"
+#include "vectorutils.h"
 
 namespace mmt {
     namespace fastalign {
 
         const double kNullProbability = 1e-9;
 
+        /**
+         * Appends N runtime flags to the compile-time ones, then calls job.Run<kFlags...>().
+         * This way a kernel is selected once and its loops contain no branches on the flags.
+         */
+        template<typename Job, size_t N, bool... kFlags>
+        struct KernelDispatcher {
+            static inline double Run(Job &job, const bool *flags) {
+                return flags[0] ? KernelDispatcher<Job, N - 1, kFlags..., true>::Run(job, flags + 1) :
+                       KernelDispatcher<Job, N - 1, kFlags..., false>::Run(job, flags + 1);
+            }
+        };
+
+        template<typename Job, bool... kFlags>
+        struct KernelDispatcher<Job, 0, kFlags...> {
+            static inline double Run(Job &job, const bool *) {
+                return job.template Run<kFlags...>();
+            }
+        };
+
         class Model {
             friend class Builder;
+            friend class ModelFile;
 
         public:
             Model(bool is_reverse, bool use_null, bool favor_diagonal, double prob_align_null, double diagonal_tension);
@@ -34,6 +60,12 @@ namespace mmt {
                 ComputeAlignments(batch, nullptr, &outAlignments, vocab);
             }
 
+            /**
+             * Fills the diagonal prior cache for all the sentence pairs with both lengths lower or equal
+             * to "length", it has no effect if the model does not favor diagonal alignments.
+             */
+            void PrecomputeDiagonalPrior(length_t length);
+
             virtual double GetProbability(word_t source, word_t target) = 0;
 
             virtual void IncrementProbability(word_t source, word_t target, double amount) = 0;
@@ -47,6 +79,13 @@ namespace mmt {
             const double prob_align_null;
 
             double diagonal_tension;
+            std::unique_ptr<DiagonalPrior> diagonal_prior;
+
+            /**
+             * Changes the diagonal tension and invalidates the prior cache, it must not be called
+             * while aligning.
+             */
+            void SetDiagonalTension(double tension);
 
             double ComputeAlignment(const wordvec_t &source, const wordvec_t &target, Model *outModel,
                                     alignment_t *outAlignment, const Vocabulary *vocab = nullptr);
@@ -54,8 +93,159 @@ namespace mmt {
             double ComputeAlignments(const std::vector<std::pair<wordvec_t, wordvec_t>> &batch,
                                      Model *outModel, std::vector<alignment_t> *outAlignments,
                                      const Vocabulary *vocab = nullptr);
+
+            /**
+             * Alignment kernel of a single sentence pair, in the model direction ("src" generates "trg").
+             *
+             * "probability(i, j)" is the probability of the j-th word of "trg" given the i-th word of "src",
+             * with i = 0 being the null word; if kTrain, "count(i, j, p)" receives the posterior of every cell
+             * and the function returns the expected diagonal feature, if kViterbi the best alignment is
+             * stored in "outAlignment". Probability and Count should be non-virtual, inlineable functors.
+             * If kTrain and outLogLikelihood is not null, the log-likelihood of "trg" is added to it.
+             */
+            template<bool kTrain, bool kViterbi, bool kUseNull, bool kFavorDiagonal,
+                    typename Probability, typename Count>
+            double ComputeAlignment(const wordvec_t &src, const wordvec_t &trg, const Probability &probability,
+                                    const Count &count, alignment_t *outAlignment, const Vocabulary *vocab,
+                                    double *outLogLikelihood = nullptr) const;
+
+            /**
+             * Selects the kernel for the current flags and aligns a single sentence pair.
+             */
+            template<typename Probability, typename Count>
+            inline double DispatchAlignment(const wordvec_t &src, const wordvec_t &trg, const Probability &probability,
+                                            const Count &count, bool train, alignment_t *outAlignment,
+                                            const Vocabulary *vocab) const {
+                SentenceJob<Probability, Count> job{this, src, trg, probability, count, outAlignment, vocab};
+                bool flags[] = {train, outAlignment != nullptr, use_null, favor_diagonal};
+                return KernelDispatcher<SentenceJob<Probability, Count>, 4>::Run(job, flags);
+            }
+
+        private:
+            template<typename Probability, typename Count>
+            struct SentenceJob {
+                const Model *model;
+                const wordvec_t &src;
+                const wordvec_t &trg;
+                const Probability &probability;
+                const Count &count;
+                alignment_t *outAlignment;
+                const Vocabulary *vocab;
+
+                template<bool kTrain, bool kViterbi, bool kUseNull, bool kFavorDiagonal>
+                inline double Run() {
+                    return model->ComputeAlignment<kTrain, kViterbi, kUseNull, kFavorDiagonal>(
+                            src, trg, probability, count, outAlignment, vocab);
+                }
+            };
         };
 
+        template<bool kTrain, bool kViterbi, bool kUseNull, bool kFavorDiagonal, typename Probability, typename Count>
+        double Model::ComputeAlignment(const wordvec_t &src, const wordvec_t &trg, const Probability &probability,
+                                       const Count &count, alignment_t *outAlignment, const Vocabulary *vocab,
+                                       double *outLogLikelihood) const {
+            double emp_feat = 0.0;
+
+            std::vector<double> probs(src.size() + 1);
+            std::vector<double> prior_buffer;
+
+            auto src_size = (length_t) src.size();
+            auto trg_size = (length_t) trg.size();
+
+            // Geometric mean of grouped data: antilog(sum(f * log x) / N)
+            double alg_prob = 0.0;
+            double alg_prob_d = 0.0;
+
+            const vector_ops_t &ops = GetVectorOps();
+
+            double uniform = 1.0 / (src_size +
+                                    // uniform (model 1), Diagonal Alignment (distortion model)
+                                    // ****** DIFFERENT FROM LEXICAL TRANSLATION PROBABILITY *****
+                                    (kUseNull ? 1 : 0));
+
+            // Alignment prior of source words: a row for each target word, or a single uniform row
+            const double *prior;
+            if (kFavorDiagonal) {
+                prior = diagonal_prior->Get(trg_size, src_size, prior_buffer);
+            } else {
+                prior_buffer.assign(src_size, uniform);
+                prior = prior_buffer.data();
+            }
+
+            for (length_t j = 0; j < trg_size; ++j) {
+                double sum = 0;
+                if (kUseNull) {
+                    double prob_a_i = kFavorDiagonal ? prob_align_null : uniform;
+                    probs[0] = probability(0, j) * prob_a_i;
+                    sum += probs[0];
+                }
+
+                for (length_t i = 1; i <= src_size; ++i)
+                    probs[i] = probability(i, j);
+                sum += ops.scale_and_sum(probs.data() + 1, prior + (kFavorDiagonal ? j * src_size : 0), src_size);
+                assert(std::isnormal(sum));
+
+                // Viterbi first: the posteriors below are normalized in place
+                if (kViterbi) {
+                    double max_p = -1;
+                    int max_index = -1;
+
+                    if (kUseNull) {
+                        max_index = 0;
+                        max_p = probs[0];
+                    }
+
+                    if (src_size > 0) {
+                        size_t i = ops.argmax(probs.data() + 1, src_size) + 1;
+                        if (probs[i] > max_p) {
+                            max_index = (int) i;
+                            max_p = probs[i];
+                        }
+                    }
+
+                    score_t word_score = 1;
+                    if (vocab)
+                        word_score = vocab->GetProbability(trg[j], is_reverse);
+
+                    alg_prob += word_score * log(max_p);
+                    alg_prob_d += word_score;
+
+                    if (max_index > 0) {
+                        if (is_reverse)
+                            outAlignment->points.emplace_back(j, max_index - 1);
+                        else
+                            outAlignment->points.emplace_back(max_index - 1, j);
+                    }
+                }
+
+                if (kTrain) {
+                    // the normalizer of the posteriors is the probability of the target word
+                    if (outLogLikelihood)
+                        *outLogLikelihood += log(sum);
+
+                    if (kUseNull) {
+                        double p = probs[0] / sum;
+                        assert(std::isnormal(p));
+                        count(0, j, p);
+                    }
+
+                    emp_feat += ops.normalize_and_feature(probs.data() + 1, src_size, sum, j, trg_size);
+
+                    for (length_t i = 1; i <= src_size; ++i) {
+                        assert(std::isnormal(probs[i]));
+                        count(i, j, probs[i]);
+                    }
+
+                    assert(std::isnormal(emp_feat));
+                }
+            }
+
+            if (kViterbi)
+                outAlignment->score = (score_t) (alg_prob / alg_prob_d);
+
+            return emp_feat;
+        }
+
     }
 }
 
@@ -0,0 +1,383 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "ModelFile.h"
+#include <cstring>
+#include <cstddef>
+#include <fstream>
+#include <stdexcept>
+#include "ioutils.h"
+#include "Pipeline.h"
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+static const uint64_t kSectionAlignment = 64;
+
+// Version 2 headers end right after the first kSectionForwardCodebook sections
+static const size_t kModelHeaderSizeV2 = offsetof(model_header_t, sections) +
+                                         kSectionForwardCodebook * sizeof(model_section_t);
+
+static_assert(sizeof(vocabulary_slot_t) == 8, "unexpected vocabulary_slot_t size");
+static_assert(sizeof(pair<score_t, score_t>) == 2 * sizeof(score_t), "unexpected term probabilities size");
+
+template<typename T>
+static const T *GetSection(const MappedFile &file, const model_header_t &header, ModelFileSection id,
+                           uint64_t count) {
+    const model_section_t &section = header.sections[id];
+
+    if (section.size != count * sizeof(T) || section.offset % kSectionAlignment != 0 ||
+        section.offset + section.size > file.GetSize())
+        throw runtime_error("corrupted model file, invalid section " + to_string((int) id));
+
+    return (const T *) (file.GetData() + section.offset);
+}
+
+/**
+ * Output file written in large blocks by a background thread, so that the caller can prepare the
+ * next block while the previous one is written.
+ */
+class BlockWriter {
+public:
+    static const size_t kBlockSize = 4 * 1024 * 1024;
+
+    explicit BlockWriter(const string &path) : path(path), out(path, ios::binary | ios::out),
+                                               writer([this](vector<char> &block) {
+                                                   out.write(block.data(), block.size());
+                                                   if (!out)
+                                                       throw runtime_error("error while writing model file: " +
+                                                                           this->path);
+                                               }, 4) {
+        if (!out)
+            throw runtime_error("unable to write model file: " + path);
+
+        block.reserve(kBlockSize);
+    }
+
+    inline uint64_t GetPosition() const {
+        return position;
+    }
+
+    void Write(const void *data, size_t size) {
+        const char *bytes = (const char *) data;
+        position += size;
+
+        while (size > 0) {
+            size_t chunk = min(size, kBlockSize - block.size());
+            block.insert(block.end(), bytes, bytes + chunk);
+            bytes += chunk;
+            size -= chunk;
+
+            if (block.size() == kBlockSize)
+                Flush();
+        }
+    }
+
+    void Pad(size_t alignment) {
+        static const char zeros[kSectionAlignment] = {0};
+
+        size_t padding = (alignment - position % alignment) % alignment;
+        Write(zeros, padding);
+    }
+
+    /**
+     * Writes all the pending blocks, then overwrites the given bytes at the beginning of the file.
+     */
+    void Close(const void *head, size_t size) {
+        Flush();
+        writer.Close();
+
+        out.seekp(0);
+        out.write((const char *) head, size);
+        out.close();
+
+        if (!out)
+            throw runtime_error("error while writing model file: " + path);
+    }
+
+private:
+    const string path;
+    ofstream out;
+    AsyncConsumer<vector<char>> writer;
+
+    vector<char> block;
+    uint64_t position = 0;
+
+    void Flush() {
+        if (block.empty())
+            return;
+
+        writer.Push(move(block));
+        block = vector<char>();
+        block.reserve(kBlockSize);
+    }
+};
+
+static void BeginSection(BlockWriter &out, model_header_t &header, ModelFileSection id, uint64_t size) {
+    out.Pad(kSectionAlignment);
+
+    header.sections[id].offset = out.GetPosition();
+    header.sections[id].size = size;
+}
+
+template<typename T>
+static void WriteSection(BlockWriter &out, model_header_t &header, ModelFileSection id, const T *data,
+                         uint64_t count) {
+    BeginSection(out, header, id, count * sizeof(T));
+
+    if (count > 0)
+        out.Write(data, header.sections[id].size);
+}
+
+void ModelFile::InitHeader(model_header_t &header, const Vocabulary &vocabulary, const Model &forward,
+                           const Model &backward) {
+    header = model_header_t();
+    memcpy(header.magic, kModelFileMagic, sizeof(kModelFileMagic));
+    header.version = kModelFileVersion;
+    header.flags = (forward.use_null ? kModelFlagUseNull : 0) |
+                   (forward.favor_diagonal ? kModelFlagFavorDiagonal : 0) |
+                   (vocabulary.IsCaseSensitive() ? kModelFlagCaseSensitive : 0);
+    header.prob_align_null = forward.prob_align_null;
+    header.fwd_diagonal_tension = forward.diagonal_tension;
+    header.bwd_diagonal_tension = backward.diagonal_tension;
+    header.vocabulary_size = vocabulary.terms.size;
+    header.index_size = vocabulary.index.size;
+    header.index_buckets = vocabulary.index.buckets;
+    header.index_seed = vocabulary.index.seed;
+}
+
+template<typename Writer>
+void ModelFile::WriteVocabulary(Writer &out, model_header_t &header, const Vocabulary &vocabulary) {
+    // Vocabulary index: displacements, padded to 8 bytes, followed by the slots
+    uint64_t displacements_size = vocabulary.index.buckets * sizeof(uint32_t);
+    uint64_t padding = (8 - displacements_size % 8) % 8;
+
+    WriteSection(out, header, kSectionTermProbs, vocabulary.terms.probs, vocabulary.terms.size);
+    WriteSection(out, header, kSectionTermOffsets, vocabulary.terms.offsets, vocabulary.terms.size + 1);
+    WriteSection(out, header, kSectionTermPool, vocabulary.terms.pool,
+                 vocabulary.terms.offsets[vocabulary.terms.size]);
+
+    BeginSection(out, header, kSectionTermIndex,
+                 displacements_size + padding + vocabulary.index.size * sizeof(vocabulary_slot_t));
+    out.Write(vocabulary.index.displacements, displacements_size);
+    out.Pad(8);
+    out.Write(vocabulary.index.slots, vocabulary.index.size * sizeof(vocabulary_slot_t));
+}
+
+bool ModelFile::IsModelFile(const string &path) {
+    ifstream in(path, ios::binary | ios::in);
+
+    char magic[sizeof(kModelFileMagic)];
+    if (!in.read(magic, sizeof(magic)))
+        return false;
+
+    return memcmp(magic, kModelFileMagic, sizeof(kModelFileMagic)) == 0;
+}
+
+void ModelFile::Open(const string &path, Vocabulary *outVocabulary, Model **outForward, Model **outBackward) {
+    shared_ptr<MappedFile> file(new MappedFile(path));
+
+    if (file->GetSize() < kModelHeaderSizeV2)
+        throw runtime_error("invalid model file: " + path);
+
+    const model_header_t &header = *((const model_header_t *) file->GetData());
+
+    if (memcmp(header.magic, kModelFileMagic, sizeof(kModelFileMagic)) != 0)
+        throw runtime_error("invalid model file: " + path);
+    if (header.version < 2 || header.version > kModelFileVersion)
+        throw runtime_error("unsupported model file version " + to_string(header.version) + ": " + path);
+    if (header.version > 2 && file->GetSize() < offsetof(model_header_t, index_buckets))
+        throw runtime_error("invalid model file: " + path);
+    if (header.version > 3 && file->GetSize() < sizeof(model_header_t))
+        throw runtime_error("invalid model file: " + path);
+
+    // Vocabulary
+    outVocabulary->case_sensitive = (header.flags & kModelFlagCaseSensitive) != 0;
+
+    outVocabulary->terms_storage = file;
+    outVocabulary->terms.size = header.vocabulary_size;
+    outVocabulary->terms.probs = GetSection<pair<score_t, score_t>>(*file, header, kSectionTermProbs,
+                                                                    header.vocabulary_size);
+    outVocabulary->terms.offsets = GetSection<uint64_t>(*file, header, kSectionTermOffsets,
+                                                        header.vocabulary_size + 1);
+    outVocabulary->terms.pool = GetSection<char>(*file, header, kSectionTermPool,
+                                                 outVocabulary->terms.offsets[header.vocabulary_size]);
+
+    if (header.version > 3) {
+        uint64_t displacements_size = header.index_buckets * sizeof(uint32_t);
+        displacements_size += (8 - displacements_size % 8) % 8;
+
+        const char *index = GetSection<char>(*file, header, kSectionTermIndex,
+                                             displacements_size + header.index_size * sizeof(vocabulary_slot_t));
+
+        outVocabulary->index_storage = file;
+        outVocabulary->index.seed = header.index_seed;
+        outVocabulary->index.buckets = header.index_buckets;
+        outVocabulary->index.size = header.index_size;
+        outVocabulary->index.displacements = (const uint32_t *) index;
+        outVocabulary->index.slots = (const vocabulary_slot_t *) (index + displacements_size);
+    } else {
+        // older versions have a different index, the perfect hash is built at load time
+        outVocabulary->BuildIndex();
+    }
+
+    // Translation table
+    int score_bits = header.version > 2 ? (int) header.score_bits : kScoreBitsFloat;
+    if (score_bits != 8 && score_bits != 16 && score_bits != kScoreBitsFloat)
+        throw runtime_error("corrupted model file, invalid score size: " + path);
+
+    const float *forward_codebook = nullptr;
+    const float *backward_codebook = nullptr;
+
+    if (score_bits != kScoreBitsFloat) {
+        forward_codebook = GetSection<float>(*file, header, kSectionForwardCodebook, ((uint64_t) 1) << score_bits);
+        backward_codebook = GetSection<float>(*file, header, kSectionBackwardCodebook, ((uint64_t) 1) << score_bits);
+    }
+
+    uint64_t scores_size = header.ttable_size * (score_bits / 8);
+
+    shared_ptr<TranslationTable> table(new TranslationTable(
+            file, header.ttable_rows, header.ttable_size,
+            GetSection<uint64_t>(*file, header, kSectionRowOffsets, header.ttable_rows + 1),
+            GetSection<word_t>(*file, header, kSectionTargets, header.ttable_size),
+            score_bits,
+            GetSection<char>(*file, header, kSectionForward, scores_size),
+            GetSection<char>(*file, header, kSectionBackward, scores_size),
+            forward_codebook, backward_codebook
+    ));
+
+    bool use_null = (header.flags & kModelFlagUseNull) != 0;
+    bool favor_diagonal = (header.flags & kModelFlagFavorDiagonal) != 0;
+
+    *outForward = new BidirectionalModel(table, true, use_null, favor_diagonal, header.prob_align_null,
+                                         header.fwd_diagonal_tension);
+    *outBackward = new BidirectionalModel(table, false, use_null, favor_diagonal, header.prob_align_null,
+                                          header.bwd_diagonal_tension);
+}
+
+void ModelFile::Store(const string &path, const Vocabulary &vocabulary,
+                      const BidirectionalModel &forward, const BidirectionalModel &backward) {
+    const TranslationTable &table = *forward.table;
+
+    model_header_t header;
+    InitHeader(header, vocabulary, forward, backward);
+    header.ttable_rows = table.RowsCount();
+    header.ttable_size = table.Size();
+    header.score_bits = (uint32_t) table.GetScoreBits();
+
+    // header is written twice: the first time as placeholder, then with the sections table
+    BlockWriter out(path);
+    out.Write(&header, sizeof(header));
+
+    WriteVocabulary(out, header, vocabulary);
+    WriteSection(out, header, kSectionRowOffsets, table.GetOffsets(), table.RowsCount() + 1);
+    WriteSection(out, header, kSectionTargets, table.GetTargets(), table.Size());
+    uint64_t scores_size = table.Size() * (table.GetScoreBits() / 8);
+
+    WriteSection(out, header, kSectionForward, (const char *) table.GetForwardScores(), scores_size);
+    WriteSection(out, header, kSectionBackward, (const char *) table.GetBackwardScores(), scores_size);
+    WriteSection(out, header, kSectionForwardCodebook, table.GetForwardCodebook(), table.GetCodebookSize());
+    WriteSection(out, header, kSectionBackwardCodebook, table.GetBackwardCodebook(), table.GetCodebookSize());
+
+    out.Close(&header, sizeof(header));
+}
+
+/**
+ * Writes one of the translation table sections, with one value for each cell.
+ */
+template<typename T, typename Getter>
+static void WriteTableSection(BlockWriter &out, model_header_t &header, ModelFileSection id,
+                              ModelFile::RowSource &rows, Getter getter) {
+    BeginSection(out, header, id, header.ttable_size * sizeof(T));
+
+    vector<TranslationTable::entry_t> entries;
+    vector<T> values;
+
+    for (word_t source = 0; source < header.ttable_rows; ++source) {
+        rows.GetRow(source, entries);
+
+        values.resize(entries.size());
+        for (size_t i = 0; i < entries.size(); ++i)
+            values[i] = getter(entries[i]);
+
+        out.Write(values.data(), values.size() * sizeof(T));
+    }
+}
+
+void ModelFile::Store(const string &path, const Vocabulary &vocabulary, const Model &forward,
+                      const Model &backward, RowSource &rows) {
+    model_header_t header;
+    InitHeader(header, vocabulary, forward, backward);
+    header.ttable_rows = rows.RowsCount();
+    header.score_bits = (uint32_t) kScoreBitsFloat;
+
+    // header is written twice: the first time as placeholder, then with the sections table
+    BlockWriter out(path);
+    out.Write(&header, sizeof(header));
+
+    // the vocabulary is written in background while the table rows are merged
+    WriteVocabulary(out, header, vocabulary);
+
+    vector<TranslationTable::entry_t> entries;
+
+    BeginSection(out, header, kSectionRowOffsets, (header.ttable_rows + 1) * sizeof(uint64_t));
+    out.Write(&header.ttable_size, sizeof(uint64_t));
+
+    for (word_t source = 0; source < header.ttable_rows; ++source) {
+        rows.GetRow(source, entries);
+        header.ttable_size += entries.size();
+        out.Write(&header.ttable_size, sizeof(uint64_t));
+    }
+
+    WriteTableSection<word_t>(out, header, kSectionTargets, rows,
+                              [](const TranslationTable::entry_t &e) { return e.first; });
+    WriteTableSection<float>(out, header, kSectionForward, rows,
+                             [](const TranslationTable::entry_t &e) { return e.second.first; });
+    WriteTableSection<float>(out, header, kSectionBackward, rows,
+                             [](const TranslationTable::entry_t &e) { return e.second.second; });
+    WriteSection<float>(out, header, kSectionForwardCodebook, nullptr, 0);
+    WriteSection<float>(out, header, kSectionBackwardCodebook, nullptr, 0);
+
+    out.Close(&header, sizeof(header));
+}
+
+void ModelFile::Convert(const string &inputPath, const string &path, int score_bits,
+                        quantization_error_t *outForwardError, quantization_error_t *outBackwardError) {
+    Vocabulary vocabulary;
+    Model *forward, *backward;
+
+    if (IsModelFile(inputPath)) {
+        Open(inputPath, &vocabulary, &forward, &backward);
+    } else {
+        ifstream in(inputPath, ios::binary | ios::in);
+        if (!in)
+            throw invalid_argument("file not found: " + inputPath);
+
+        vocabulary = Vocabulary(in);
+        BidirectionalModel::Open(in, &forward, &backward);
+        in.close();
+    }
+
+    auto *fwd_model = (BidirectionalModel *) forward;
+    auto *bwd_model = (BidirectionalModel *) backward;
+
+    if (score_bits == kScoreBitsFloat && fwd_model->table->GetScoreBits() == kScoreBitsFloat) {
+        Store(path, vocabulary, *fwd_model, *bwd_model);
+    } else {
+        shared_ptr<TranslationTable> table = score_bits == kScoreBitsFloat ?
+                                             fwd_model->table->Dequantize() :
+                                             fwd_model->table->Quantize(score_bits, outForwardError, outBackwardError);
+
+        BidirectionalModel quantized_fwd(table, true, fwd_model->use_null, fwd_model->favor_diagonal,
+                                         fwd_model->prob_align_null, fwd_model->diagonal_tension);
+        BidirectionalModel quantized_bwd(table, false, bwd_model->use_null, bwd_model->favor_diagonal,
+                                         bwd_model->prob_align_null, bwd_model->diagonal_tension);
+
+        Store(path, vocabulary, quantized_fwd, quantized_bwd);
+    }
+
+    delete forward;
+    delete backward;
+}
@@ -0,0 +1,147 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_MODELFILE_H
+#define MMT_FASTALIGN_MODELFILE_H
+
+#include <cstdint>
+#include <string>
+#include "Model.h"
+#include "Vocabulary.h"
+#include "BidirectionalModel.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /*
+         * Versioned model file, designed to be memory-mapped and used in place.
+         *
+         * The file starts with a fixed-size header followed by a list of 64-byte aligned sections:
+         *
+         *   kSectionTermProbs     pair<score_t, score_t>[vocabulary_size]  idf scores indexed by word id
+         *   kSectionTermOffsets   uint64_t[vocabulary_size + 1]            term boundaries in the string pool
+         *   kSectionTermPool      char[]                                   concatenated terms
+         *   kSectionTermIndex     uint32_t[index_buckets] (8-byte padded)  perfect hash displacements, followed by
+         *                         vocabulary_slot_t[index_size]            perfect hash slots
+         *   kSectionRowOffsets    uint64_t[ttable_rows + 1]                translation table CSR rows
+         *   kSectionTargets       word_t[ttable_size]                      sorted target ids within each row
+         *   kSectionForward       score[ttable_size]                       forward scores
+         *   kSectionBackward      score[ttable_size]                       backward scores
+         *   kSectionForwardCodebook   float[1 << score_bits]               forward codebook (quantized models)
+         *   kSectionBackwardCodebook  float[1 << score_bits]               backward codebook (quantized models)
+         *
+         * Scores are 32-bit floats, or 8/16-bit codes into the codebooks (see TranslationTable::Quantize).
+         * All values are stored in native byte order.
+         *
+         * Version history:
+         *   2 - first memory-mappable format, float scores only
+         *   3 - adds score_bits and the codebook sections
+         *   4 - the vocabulary index is a perfect hash (index_buckets, index_seed)
+         */
+
+        static const char kModelFileMagic[8] = {'F', 'A', 'S', 'T', 'A', 'L', 'G', 'N'};
+        static const uint32_t kModelFileVersion = 4;
+
+        static const uint32_t kModelFlagUseNull = 1;
+        static const uint32_t kModelFlagFavorDiagonal = 1 << 1;
+        static const uint32_t kModelFlagCaseSensitive = 1 << 2;
+
+        enum ModelFileSection {
+            kSectionTermProbs = 0,
+            kSectionTermOffsets,
+            kSectionTermPool,
+            kSectionTermIndex,
+            kSectionRowOffsets,
+            kSectionTargets,
+            kSectionForward,
+            kSectionBackward,
+            kSectionForwardCodebook,
+            kSectionBackwardCodebook,
+            kSectionsCount
+        };
+
+        struct model_section_t {
+            uint64_t offset;
+            uint64_t size;
+        };
+
+        struct model_header_t {
+            char magic[8];
+            uint32_t version;
+            uint32_t flags;
+            double prob_align_null;
+            double fwd_diagonal_tension;
+            double bwd_diagonal_tension;
+            uint64_t vocabulary_size;
+            uint64_t index_size;
+            uint64_t ttable_rows;
+            uint64_t ttable_size;
+            model_section_t sections[kSectionsCount];
+            uint32_t score_bits;
+            uint32_t reserved;
+            uint64_t index_buckets;
+            uint64_t index_seed;
+        };
+
+        class ModelFile {
+        public:
+            /**
+             * Returns true if the file at the given path is a versioned (memory-mappable) model file.
+             */
+            static bool IsModelFile(const std::string &path);
+
+            /**
+             * Maps the model file in memory: no data is copied or parsed.
+             */
+            static void Open(const std::string &path, Vocabulary *outVocabulary,
+                             Model **outForward, Model **outBackward);
+
+            /**
+             * Translation table rows produced on the fly, so that a model can be stored without having its
+             * table in memory. Rows are requested in ascending order, once for every section of the file.
+             */
+            class RowSource {
+            public:
+                virtual ~RowSource() = default;
+
+                virtual size_t RowsCount() = 0;
+
+                /**
+                 * Fills entries with the cells of the given row, sorted by target word.
+                 */
+                virtual void GetRow(word_t source, std::vector<TranslationTable::entry_t> &entries) = 0;
+            };
+
+            static void Store(const std::string &path, const Vocabulary &vocabulary,
+                              const BidirectionalModel &forward, const BidirectionalModel &backward);
+
+            /**
+             * Stores a model with float scores, reading the translation table from "rows": the forward and
+             * backward models only provide the model parameters.
+             */
+            static void Store(const std::string &path, const Vocabulary &vocabulary,
+                              const Model &forward, const Model &backward, RowSource &rows);
+
+            /**
+             * Converts a model stored with any supported format, optionally quantizing its scores
+             * (score_bits equal to 8 or 16). If not null, the quantization errors are stored in the
+             * last two parameters.
+             */
+            static void Convert(const std::string &inputPath, const std::string &path,
+                                int score_bits = kScoreBitsFloat,
+                                quantization_error_t *outForwardError = nullptr,
+                                quantization_error_t *outBackwardError = nullptr);
+
+        private:
+            static void InitHeader(model_header_t &header, const Vocabulary &vocabulary, const Model &forward,
+                                   const Model &backward);
+
+            template<typename Writer>
+            static void WriteVocabulary(Writer &out, model_header_t &header, const Vocabulary &vocabulary);
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_MODELFILE_H
@@ -0,0 +1,125 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "OnlineTable.h"
+#include <thread>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+OnlineTable::Snapshot::Snapshot(const OnlineTable *table) : table(table), version(0) {
+    if (!table)
+        return;
+
+    // the reader is counted with the parity of the version it has pinned: if the version changed in the
+    // meantime, the writer may not be waiting for this counter anymore
+    while (true) {
+        version = table->version.load();
+        table->readers[version & 1].fetch_add(1);
+
+        if (table->version.load() == version)
+            break;
+
+        table->readers[version & 1].fetch_sub(1);
+    }
+}
+
+OnlineTable::Snapshot::~Snapshot() {
+    if (table)
+        table->readers[version & 1].fetch_sub(1);
+}
+
+OnlineTable::OnlineTable(size_t words, double priorMass)
+        : words(words), prior_mass(priorMass), heads(new atomic<const record_t *>[words]) {
+    for (size_t i = 0; i < words; ++i)
+        heads[i].store(nullptr);
+
+    version.store(0);
+    readers[0].store(0);
+    readers[1].store(0);
+}
+
+OnlineTable::~OnlineTable() {
+    for (size_t i = 0; i < words; ++i)
+        delete heads[i].load();
+}
+
+void OnlineTable::Update(const counts_t &counts) {
+    lock_guard<mutex> lock(update_mutex);
+
+    const uint64_t current = version.load();
+    const uint64_t next = current + 1;
+
+    // new cells grouped by source word
+    unordered_map<word_t, vector<pair<word_t, pair<double, double>>>> rows;
+    for (auto cell = counts.cells.begin(); cell != counts.cells.end(); ++cell) {
+        auto source = (word_t) (cell->first >> 32);
+        if (source < words)
+            rows[source].emplace_back((word_t) (cell->first & 0xffffffff), cell->second);
+    }
+
+    for (auto total = counts.totals.begin(); total != counts.totals.end(); ++total) {
+        if (total->first < words)
+            rows[total->first];
+    }
+
+    // the new records are built aside, readers do not see them until the version changes
+    vector<pair<word_t, record_t *>> records;
+    records.reserve(rows.size());
+
+    for (auto row = rows.begin(); row != rows.end(); ++row) {
+        const record_t *old = heads[row->first].load();
+        vector<pair<word_t, pair<double, double>>> &cells = row->second;
+        sort(cells.begin(), cells.end());
+
+        auto *record = new record_t;
+        record->version = next;
+        record->previous.store(old);
+        record->forward_total = old ? old->forward_total : 0;
+        record->backward_total = old ? old->backward_total : 0;
+
+        auto total = counts.totals.find(row->first);
+        if (total != counts.totals.end()) {
+            record->forward_total += total->second.first;
+            record->backward_total += total->second.second;
+        }
+
+        // merge of the sorted cells of the old record and the new ones
+        size_t old_size = old ? old->targets.size() : 0;
+        size_t i = 0, j = 0;
+
+        while (i < old_size || j < cells.size()) {
+            if (j == cells.size() || (i < old_size && old->targets[i] < cells[j].first)) {
+                record->targets.push_back(old->targets[i]);
+                record->counts.push_back(old->counts[i]);
+                i++;
+            } else if (i == old_size || cells[j].first < old->targets[i]) {
+                record->targets.push_back(cells[j].first);
+                record->counts.push_back(cells[j].second);
+                j++;
+            } else {
+                record->targets.push_back(cells[j].first);
+                record->counts.emplace_back(old->counts[i].first + cells[j].second.first,
+                                            old->counts[i].second + cells[j].second.second);
+                i++;
+                j++;
+            }
+        }
+
+        records.emplace_back(row->first, record);
+    }
+
+    for (auto record = records.begin(); record != records.end(); ++record)
+        heads[record->first].store(record->second, memory_order_release);
+
+    version.store(next);
+
+    // grace period: only the readers of the previous version can reach the replaced records
+    while (readers[current & 1].load() > 0)
+        this_thread::yield();
+
+    for (auto record = records.begin(); record != records.end(); ++record)
+        delete record->second->previous.exchange(nullptr);
+}
@@ -0,0 +1,155 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_ONLINETABLE_H
+#define MMT_FASTALIGN_ONLINETABLE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include "alignment.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Translation probabilities updated online, on top of the read-only translation table of a model.
+         *
+         * Updates are the expected counts of new sentence pairs (online EM): the probabilities of the model
+         * count as priorMass occurrences of every word, so that p(t|s) = (m * p0(t|s) + c(s, t)) / (m + c(s)),
+         * and the same holds for the backward direction. Counts are kept in immutable records, one for every
+         * updated word, with its forward cells (the word as source) and its backward total (the word as target).
+         *
+         * Readers never lock: a Snapshot pins a version of the table, and every word is resolved to its newest
+         * record not newer than the snapshot (RCU-style row versioning). A writer publishes all the records of
+         * a batch with a single version increment, then frees the replaced records as soon as the readers of
+         * the previous version are gone.
+         */
+        class OnlineTable {
+        public:
+            struct record_t {
+                uint64_t version;
+                std::atomic<const record_t *> previous;
+
+                double forward_total;
+                double backward_total;
+
+                // cells of the word as source, sorted by target: forward and backward expected counts
+                std::vector<word_t> targets;
+                std::vector<std::pair<double, double>> counts;
+
+                inline const std::pair<double, double> *Find(word_t target) const {
+                    auto cell = std::lower_bound(targets.begin(), targets.end(), target);
+                    return (cell != targets.end() && *cell == target) ? &counts[cell - targets.begin()] : nullptr;
+                }
+            };
+
+            /**
+             * Expected counts of a batch of sentence pairs.
+             */
+            struct counts_t {
+                // (source << 32 | target) -> (forward count, backward count)
+                std::unordered_map<uint64_t, std::pair<double, double>> cells;
+                // word -> (forward total as source, backward total as target)
+                std::unordered_map<word_t, std::pair<double, double>> totals;
+            };
+
+            class Snapshot {
+            public:
+                /**
+                 * Pins the current version of the table, that can be null.
+                 */
+                explicit Snapshot(const OnlineTable *table);
+
+                Snapshot(const Snapshot &) = delete;
+
+                Snapshot &operator=(const Snapshot &) = delete;
+
+                ~Snapshot();
+
+                /**
+                 * True if no update is visible: the probabilities are the ones of the model.
+                 */
+                inline bool IsEmpty() const {
+                    return version == 0;
+                }
+
+                inline const record_t *Get(word_t word) const {
+                    if (word >= table->words)
+                        return nullptr;
+
+                    const record_t *record = table->heads[word].load(std::memory_order_acquire);
+                    while (record && record->version > version)
+                        record = record->previous.load(std::memory_order_acquire);
+
+                    return record;
+                }
+
+                /**
+                 * Returns the updated (forward, backward) probabilities of a cell, given the ones of the
+                 * model and the records of its source and target words.
+                 */
+                inline std::pair<float, float> Adjust(const std::pair<float, float> &probabilities,
+                                                      const record_t *source, const record_t *target,
+                                                      word_t targetWord) const {
+                    if (!source && !target)
+                        return probabilities;
+
+                    const double m = table->prior_mass;
+                    const std::pair<double, double> *cell = source ? source->Find(targetWord) : nullptr;
+                    std::pair<float, float> result = probabilities;
+
+                    if (source && source->forward_total > 0)
+                        result.first = (float) ((m * probabilities.first + (cell ? cell->first : 0)) /
+                                                (m + source->forward_total));
+                    if (target && target->backward_total > 0)
+                        result.second = (float) ((m * probabilities.second + (cell ? cell->second : 0)) /
+                                                 (m + target->backward_total));
+
+                    return result;
+                }
+
+            private:
+                const OnlineTable *table;
+                uint64_t version;
+            };
+
+            /**
+             * Creates an empty table for a vocabulary of the given size.
+             */
+            OnlineTable(size_t words, double priorMass);
+
+            OnlineTable(const OnlineTable &) = delete;
+
+            OnlineTable &operator=(const OnlineTable &) = delete;
+
+            ~OnlineTable();
+
+            /**
+             * Adds the counts to the table and publishes the new version, it returns when the replaced
+             * records have been released. Concurrent updates are serialized.
+             */
+            void Update(const counts_t &counts);
+
+        private:
+            const size_t words;
+            const double prior_mass;
+
+            std::unique_ptr<std::atomic<const record_t *>[]> heads;
+            std::atomic<uint64_t> version;
+
+            // active readers by the parity of their version
+            mutable std::atomic<size_t> readers[2];
+
+            std::mutex update_mutex;
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_ONLINETABLE_H
@@ -0,0 +1,213 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_PIPELINE_H
+#define MMT_FASTALIGN_PIPELINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Blocking FIFO queue with a maximum size, once closed Push() fails and Pop() drains the queue.
+         */
+        template<typename T>
+        class BoundedQueue {
+        public:
+            explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {
+            }
+
+            bool Push(T &&item) {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_full.wait(lock, [this] { return items.size() < capacity || closed; });
+
+                if (closed)
+                    return false;
+
+                items.push_back(std::move(item));
+                not_empty.notify_one();
+                return true;
+            }
+
+            bool Pop(T &outItem) {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_empty.wait(lock, [this] { return !items.empty() || closed; });
+
+                if (items.empty())
+                    return false;
+
+                outItem = std::move(items.front());
+                items.pop_front();
+                not_full.notify_one();
+                return true;
+            }
+
+            bool TryPop(T &outItem) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (items.empty())
+                    return false;
+
+                outItem = std::move(items.front());
+                items.pop_front();
+                not_full.notify_one();
+                return true;
+            }
+
+            void Close() {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                not_empty.notify_all();
+                not_full.notify_all();
+            }
+
+        private:
+            const size_t capacity;
+            bool closed;
+            std::deque<T> items;
+            std::mutex mutex;
+            std::condition_variable not_empty;
+            std::condition_variable not_full;
+        };
+
+        /**
+         * Produces items in a background thread, at most depth items ahead of the consumer.
+         * The producer is a callable bool(T &) that fills the given item and returns false at the end:
+         * the items returned to Next() are recycled, so that their memory is reused.
+         *
+         * The producer runs with a single OpenMP thread, leaving the thread pool to the consumer.
+         */
+        template<typename T>
+        class Prefetcher {
+        public:
+            template<typename Producer>
+            explicit Prefetcher(Producer producer, size_t depth = 2) : ready(depth), recycled(depth + 1) {
+                worker = std::thread([this, producer]() mutable {
+#ifdef _OPENMP
+                    omp_set_num_threads(1);
+#endif
+                    try {
+                        while (true) {
+                            T item;
+                            recycled.TryPop(item);
+
+                            if (!producer(item) || !ready.Push(std::move(item)))
+                                break;
+                        }
+                    } catch (...) {
+                        error = std::current_exception();
+                    }
+
+                    ready.Close();
+                    recycled.Close();
+                });
+            }
+
+            Prefetcher(const Prefetcher &) = delete;
+
+            Prefetcher &operator=(const Prefetcher &) = delete;
+
+            ~Prefetcher() {
+                if (worker.joinable()) {
+                    ready.Close();
+                    worker.join();
+                }
+            }
+
+            /**
+             * Replaces item with the next one, returns false at the end. Errors of the producer are thrown here.
+             */
+            bool Next(T &item) {
+                recycled.Push(std::move(item));
+
+                if (ready.Pop(item))
+                    return true;
+
+                if (worker.joinable())
+                    worker.join();
+
+                if (error)
+                    std::rethrow_exception(error);
+
+                return false;
+            }
+
+        private:
+            BoundedQueue<T> ready;
+            BoundedQueue<T> recycled;
+            std::exception_ptr error;
+            std::thread worker;
+        };
+
+        /**
+         * Consumes items in a background thread, in the same order of Push(). At most depth items are queued.
+         */
+        template<typename T>
+        class AsyncConsumer {
+        public:
+            template<typename Consumer>
+            explicit AsyncConsumer(Consumer consumer, size_t depth = 2) : queue(depth) {
+                worker = std::thread([this, consumer]() mutable {
+                    try {
+                        T item;
+                        while (queue.Pop(item))
+                            consumer(item);
+                    } catch (...) {
+                        error = std::current_exception();
+                        queue.Close();
+                    }
+                });
+            }
+
+            AsyncConsumer(const AsyncConsumer &) = delete;
+
+            AsyncConsumer &operator=(const AsyncConsumer &) = delete;
+
+            ~AsyncConsumer() {
+                if (worker.joinable()) {
+                    queue.Close();
+                    worker.join();
+                }
+            }
+
+            /**
+             * Queues the item, errors of the consumer are thrown here or by Close().
+             */
+            void Push(T &&item) {
+                if (!queue.Push(std::move(item)))
+                    Close();
+            }
+
+            /**
+             * Waits for all the queued items to be consumed.
+             */
+            void Close() {
+                if (worker.joinable()) {
+                    queue.Close();
+                    worker.join();
+                }
+
+                if (error)
+                    std::rethrow_exception(error);
+            }
+
+        private:
+            BoundedQueue<T> queue;
+            std::exception_ptr error;
+            std::thread worker;
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_PIPELINE_H
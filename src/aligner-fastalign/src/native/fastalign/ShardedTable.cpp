@@ -0,0 +1,320 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "ShardedTable.h"
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+// Keys read at once from every run of a PairSet
+static const size_t kRunBufferSize = 64 * 1024;
+
+// Cells written at once to the files of a ShardedTable
+static const size_t kWriteBufferSize = 1024 * 1024;
+
+void mmt::fastalign::RadixSort(vector<uint64_t> &keys, vector<uint64_t> &buffer) {
+#ifdef _OPENMP
+    auto threads = (size_t) omp_get_max_threads();
+#else
+    size_t threads = 1;
+#endif
+    const size_t size = keys.size();
+    const size_t block = (size + threads - 1) / max(threads, (size_t) 1);
+    buffer.resize(size);
+
+    vector<size_t> histograms(threads * 256);
+
+    // one byte per pass, passes on bytes that are equal for all the keys are skipped
+    for (unsigned int shift = 0; shift < 64; shift += 8) {
+        fill(histograms.begin(), histograms.end(), 0);
+
+#pragma omp parallel for schedule(static, 1)
+        for (size_t t = 0; t < threads; ++t) {
+            size_t *histogram = &histograms[t * 256];
+            for (size_t i = t * block; i < min(size, (t + 1) * block); ++i)
+                histogram[(keys[i] >> shift) & 0xff]++;
+        }
+
+        // offsets ordered by digit, then by thread: the sort is stable
+        size_t offset = 0;
+        bool uniform = false;
+        for (size_t digit = 0; digit < 256; ++digit) {
+            size_t digit_count = 0;
+            for (size_t t = 0; t < threads; ++t) {
+                size_t count = histograms[t * 256 + digit];
+                histograms[t * 256 + digit] = offset;
+                offset += count;
+                digit_count += count;
+            }
+
+            if (digit_count == size)
+                uniform = true;
+        }
+
+        if (uniform)
+            continue;
+
+#pragma omp parallel for schedule(static, 1)
+        for (size_t t = 0; t < threads; ++t) {
+            size_t *offsets = &histograms[t * 256];
+            for (size_t i = t * block; i < min(size, (t + 1) * block); ++i)
+                buffer[offsets[(keys[i] >> shift) & 0xff]++] = keys[i];
+        }
+
+        keys.swap(buffer);
+    }
+}
+
+/* PairSet */
+
+PairSet::PairSet(const string &path, size_t chunkSize, size_t memoryBudget)
+        : path(path), chunk_size(chunkSize), memory_budget(memoryBudget) {
+}
+
+PairSet::~PairSet() {
+    for (auto run = runs.begin(); run != runs.end(); ++run)
+        remove(run->c_str());
+}
+
+void PairSet::Add(vector<uint64_t> &keys) {
+    chunk.insert(chunk.end(), keys.begin(), keys.end());
+    keys.clear();
+
+    size_t limit = max(chunk_size, pairs.size());
+    if (memory_budget > 0)
+        limit = min(limit, max((size_t) 1, memory_budget / (4 * sizeof(uint64_t))));
+
+    if (chunk.size() > limit)
+        Merge();
+}
+
+void PairSet::Finish() {
+    Merge();
+
+    if (!runs.empty())
+        Spill();
+
+    vector<uint64_t>().swap(chunk);
+    vector<uint64_t>().swap(buffer);
+}
+
+void PairSet::Merge() {
+    if (chunk.empty())
+        return;
+
+    RadixSort(chunk, buffer);
+    chunk.erase(unique(chunk.begin(), chunk.end()), chunk.end());
+
+    // the union needs a buffer as large as both the inputs
+    if (memory_budget > 0 && (2 * (pairs.size() + chunk.size()) + buffer.size()) * sizeof(uint64_t) > memory_budget)
+        Spill();
+
+    buffer.resize(pairs.size() + chunk.size());
+    auto end = set_union(pairs.begin(), pairs.end(), chunk.begin(), chunk.end(), buffer.begin());
+    buffer.resize((size_t) (end - buffer.begin()));
+
+    pairs.swap(buffer);
+    chunk.clear();
+}
+
+void PairSet::Spill() {
+    if (pairs.empty())
+        return;
+
+    string filename = path + "." + to_string(runs.size());
+    runs.push_back(filename);
+
+    ofstream out(filename, ios::binary | ios::out);
+    out.write((const char *) pairs.data(), pairs.size() * sizeof(uint64_t));
+    if (!out)
+        throw runtime_error("unable to write file: " + filename);
+
+    vector<uint64_t>().swap(pairs);
+}
+
+PairSet::Reader::Reader(PairSet &set) : set(set) {
+    for (size_t i = 0; i < set.runs.size(); ++i) {
+        runs.emplace_back(new run_t);
+        runs[i]->in.open(set.runs[i], ios::binary | ios::in);
+        if (!runs[i]->in)
+            throw runtime_error("unable to read file: " + set.runs[i]);
+
+        if (Fill(i))
+            heap.emplace_back(runs[i]->buffer[0], i);
+    }
+
+    make_heap(heap.begin(), heap.end(), greater<pair<uint64_t, size_t>>());
+}
+
+bool PairSet::Reader::Fill(size_t run) {
+    run_t &r = *runs[run];
+
+    r.buffer.resize(kRunBufferSize);
+    r.in.read((char *) r.buffer.data(), kRunBufferSize * sizeof(uint64_t));
+    r.buffer.resize((size_t) r.in.gcount() / sizeof(uint64_t));
+    r.position = 0;
+
+    return !r.buffer.empty();
+}
+
+bool PairSet::Reader::Next(uint64_t &key) {
+    if (set.IsInMemory()) {
+        if (index == set.pairs.size())
+            return false;
+
+        key = set.pairs[index++];
+        return true;
+    }
+
+    // k-way merge of the runs, duplicates are adjacent in the merged sequence
+    while (!heap.empty()) {
+        pop_heap(heap.begin(), heap.end(), greater<pair<uint64_t, size_t>>());
+        uint64_t value = heap.back().first;
+        size_t run = heap.back().second;
+        heap.pop_back();
+
+        run_t &r = *runs[run];
+        if (++r.position < r.buffer.size() || Fill(run)) {
+            heap.emplace_back(r.buffer[r.position], run);
+            push_heap(heap.begin(), heap.end(), greater<pair<uint64_t, size_t>>());
+        }
+
+        if (!has_last || value != last) {
+            has_last = true;
+            last = value;
+            key = value;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* ShardedTable */
+
+ShardedTable::ShardedTable(const string &path, PairSet &pairs, size_t memoryBudget, float probability)
+        : path(path), targets(nullptr), probs(nullptr), next_shard(0) {
+    // files left by an interrupted training can be hard links to other files (see GetProbabilitiesPath()):
+    // they are replaced, not truncated
+    remove((path + ".targets").c_str());
+    remove((path + ".probs").c_str());
+
+    ofstream targets_out(path + ".targets", ios::binary | ios::out);
+    ofstream probs_out(path + ".probs", ios::binary | ios::out);
+
+    vector<word_t> block;
+    block.reserve(kWriteBufferSize);
+    const vector<float> probabilities(kWriteBufferSize, probability);
+
+    uint64_t size = 0;
+    offsets.push_back(0);
+
+    PairSet::Reader reader(pairs);
+    uint64_t key;
+
+    while (reader.Next(key)) {
+        auto source = (word_t) (key >> 32);
+        while (offsets.size() <= source)
+            offsets.push_back(size);
+
+        block.push_back((word_t) (key & 0xffffffff));
+        size++;
+
+        if (block.size() == kWriteBufferSize) {
+            targets_out.write((const char *) block.data(), block.size() * sizeof(word_t));
+            probs_out.write((const char *) probabilities.data(), block.size() * sizeof(float));
+            block.clear();
+        }
+    }
+
+    targets_out.write((const char *) block.data(), block.size() * sizeof(word_t));
+    probs_out.write((const char *) probabilities.data(), block.size() * sizeof(float));
+    offsets.push_back(size);
+
+    targets_out.close();
+    probs_out.close();
+
+    if (!targets_out || !probs_out)
+        throw runtime_error("unable to write the translation table: " + path);
+
+    // shards of consecutive rows, every shard has at least one row
+    size_t offsets_memory = offsets.size() * sizeof(uint64_t);
+    uint64_t shard_limit = memoryBudget > offsets_memory ?
+                           (memoryBudget - offsets_memory) / (sizeof(double) + sizeof(float)) : 0;
+
+    shards.push_back(0);
+    for (word_t row = 0; row < RowsCount(); ++row) {
+        uint64_t shard_size = offsets[row + 1] - offsets[shards.back()];
+
+        if (shard_size > shard_limit && row > shards.back())
+            shards.push_back(row);
+    }
+    shards.push_back((word_t) RowsCount());
+
+    Map();
+}
+
+ShardedTable::~ShardedTable() {
+    targets_file.reset();
+    probs_file.reset();
+
+    if (next_probs.is_open())
+        next_probs.close();
+
+    remove((path + ".targets").c_str());
+    remove((path + ".probs").c_str());
+    remove((path + ".probs.next").c_str());
+}
+
+void ShardedTable::Map() {
+    if (!targets_file) {
+        targets_file.reset(new MappedFile(path + ".targets"));
+        targets = (const word_t *) targets_file->GetData();
+    }
+
+    probs_file.reset(new MappedFile(path + ".probs"));
+    probs = (const float *) probs_file->GetData();
+}
+
+void ShardedTable::WriteShard(size_t shard, const float *values) {
+    if (shard != next_shard)
+        throw logic_error("shards must be written in order");
+
+    if (shard == 0)
+        next_probs.open(path + ".probs.next", ios::binary | ios::out | ios::trunc);
+
+    uint64_t begin = offsets[shards[shard]];
+    uint64_t end = offsets[shards[shard + 1]];
+
+    next_probs.write((const char *) values, (end - begin) * sizeof(float));
+    if (!next_probs)
+        throw runtime_error("unable to write the translation table: " + path);
+
+    next_shard++;
+}
+
+void ShardedTable::Commit() {
+    if (next_shard != ShardsCount())
+        throw logic_error("missing shards in the translation table");
+
+    next_probs.close();
+
+    probs_file.reset();
+    probs = nullptr;
+
+    if (rename((path + ".probs.next").c_str(), (path + ".probs").c_str()) != 0)
+        throw runtime_error("unable to replace the translation table: " + path);
+
+    next_shard = 0;
+    Map();
+}
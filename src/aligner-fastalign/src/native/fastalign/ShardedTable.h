@@ -0,0 +1,222 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_SHARDEDTABLE_H
+#define MMT_FASTALIGN_SHARDEDTABLE_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "alignment.h"
+#include "MappedFile.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Sorts the keys with a parallel LSD radix sort, buffer is used as scratch space.
+         */
+        void RadixSort(std::vector<uint64_t> &keys, std::vector<uint64_t> &buffer);
+
+        /**
+         * Set of (source << 32 | target) word pairs collected with bounded memory.
+         *
+         * Keys are sorted and merged in memory; if the memory budget is not zero and the set
+         * grows over it, the keys are spilled to sorted runs on disk that are merged while reading.
+         */
+        class PairSet {
+        public:
+            class Reader {
+            public:
+                explicit Reader(PairSet &set);
+
+                /**
+                 * Returns the next key in ascending order, without duplicates.
+                 */
+                bool Next(uint64_t &key);
+
+            private:
+                struct run_t {
+                    std::ifstream in;
+                    std::vector<uint64_t> buffer;
+                    size_t position = 0;
+                };
+
+                PairSet &set;
+                size_t index = 0;
+                bool has_last = false;
+                uint64_t last = 0;
+
+                std::vector<std::unique_ptr<run_t>> runs;
+                std::vector<std::pair<uint64_t, size_t>> heap;
+
+                bool Fill(size_t run);
+            };
+
+            /**
+             * Keys are merged in chunks of at least chunkSize keys, that grow with the set so that merges
+             * take linear time overall. Runs are stored in files named after path.
+             */
+            PairSet(const std::string &path, size_t chunkSize, size_t memoryBudget);
+
+            PairSet(const PairSet &) = delete;
+
+            PairSet &operator=(const PairSet &) = delete;
+
+            ~PairSet();
+
+            /**
+             * Adds the keys, in any order and with duplicates, then clears the vector.
+             */
+            void Add(std::vector<uint64_t> &keys);
+
+            /**
+             * Merges the pending keys, no more keys can be added after this call.
+             */
+            void Finish();
+
+            inline bool IsInMemory() const {
+                return runs.empty();
+            }
+
+            /**
+             * Sorted unique keys, available only if the set is in memory.
+             */
+            inline std::vector<uint64_t> &GetKeys() {
+                return pairs;
+            }
+
+        private:
+            const std::string path;
+            const size_t chunk_size;
+            const size_t memory_budget;
+
+            std::vector<uint64_t> pairs;
+            std::vector<uint64_t> chunk;
+            std::vector<uint64_t> buffer;
+            std::vector<std::string> runs;
+
+            void Merge();
+
+            void Spill();
+        };
+
+        /**
+         * Translation table of the out-of-core training, partitioned in shards of consecutive source words.
+         *
+         * Row offsets are kept in memory, while target words and probabilities are stored in files that
+         * are memory-mapped, so that they are paged in and out by the OS. The trainer keeps in memory the
+         * expected counts of a single shard: the new probabilities of every shard are appended to a second
+         * file, that replaces the current one with Commit().
+         */
+        class ShardedTable {
+        public:
+            static const size_t kNotFound = SIZE_MAX;
+
+            /**
+             * Creates the table with the cells of the given set, all with the same initial probability.
+             * Shards are sized so that counts and new probabilities of a shard (12 bytes per cell) fit,
+             * with the row offsets, in the memory budget.
+             */
+            ShardedTable(const std::string &path, PairSet &pairs, size_t memoryBudget, float probability);
+
+            ShardedTable(const ShardedTable &) = delete;
+
+            ShardedTable &operator=(const ShardedTable &) = delete;
+
+            ~ShardedTable();
+
+            inline size_t RowsCount() const {
+                return offsets.size() - 1;
+            }
+
+            inline size_t Size() const {
+                return offsets.back();
+            }
+
+            inline const uint64_t *GetOffsets() const {
+                return offsets.data();
+            }
+
+            inline const word_t *GetTargets() const {
+                return targets;
+            }
+
+            inline const float *GetProbabilities() const {
+                return probs;
+            }
+
+            /**
+             * File of the committed probabilities: it is replaced, never modified, by Commit().
+             */
+            inline std::string GetProbabilitiesPath() const {
+                return path + ".probs";
+            }
+
+            inline size_t ShardsCount() const {
+                return shards.size() - 1;
+            }
+
+            /**
+             * Source words of the shard are in [GetShardBegin(shard), GetShardBegin(shard + 1)).
+             */
+            inline word_t GetShardBegin(size_t shard) const {
+                return shards[shard];
+            }
+
+            /**
+             * Returns the index of the cell, or kNotFound.
+             */
+            inline size_t Find(word_t source, word_t target) const {
+                if (source >= RowsCount())
+                    return kNotFound;
+
+                const word_t *cell = targets + offsets[source];
+                size_t length = offsets[source + 1] - offsets[source];
+
+                if (length == 0)
+                    return kNotFound;
+
+                while (length > 1) {
+                    size_t half = length / 2;
+                    cell = (cell[half] <= target) ? cell + half : cell;
+                    length -= half;
+                }
+
+                return *cell == target ? (size_t) (cell - targets) : kNotFound;
+            }
+
+            /**
+             * Appends the new probabilities of the shard, shards must be written in order.
+             */
+            void WriteShard(size_t shard, const float *values);
+
+            /**
+             * Replaces the probabilities with the ones written by WriteShard().
+             */
+            void Commit();
+
+        private:
+            const std::string path;
+
+            std::vector<uint64_t> offsets;
+            std::vector<word_t> shards;
+
+            std::unique_ptr<MappedFile> targets_file;
+            std::unique_ptr<MappedFile> probs_file;
+            const word_t *targets;
+            const float *probs;
+
+            std::ofstream next_probs;
+            size_t next_shard;
+
+            void Map();
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_SHARDEDTABLE_H
@@ -0,0 +1,265 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "TranslationTable.h"
+#include "Model.h"
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+
+using namespace std;
+using namespace mmt;
+using namespace mmt::fastalign;
+
+// Codebooks are trained on at most this number of values, sampled uniformly from the table
+static const size_t kQuantizationMaxSamples = 16 * 1024 * 1024;
+static const int kQuantizationIterations = 10;
+
+static bool __entry_compare(const TranslationTable::entry_t &a, const TranslationTable::entry_t &b) {
+    return a.first < b.first;
+}
+
+TranslationTable::TranslationTable() : score_bits(kScoreBitsFloat) {
+    storage.offsets.push_back(0);
+    Bind();
+}
+
+TranslationTable::TranslationTable(shared_ptr<MappedFile> file, size_t rows, size_t size,
+                                   const uint64_t *offsets, const word_t *targets, int score_bits,
+                                   const void *forward, const void *backward,
+                                   const float *forward_codebook, const float *backward_codebook)
+        : rows(rows), size(size), offsets(offsets), targets(targets), score_bits(score_bits),
+          forward(forward), backward(backward), forward_codebook(forward_codebook),
+          backward_codebook(backward_codebook), file(file) {
+    if (score_bits != 8 && score_bits != 16 && score_bits != kScoreBitsFloat)
+        throw invalid_argument("unsupported score size: " + to_string(score_bits) + " bits");
+}
+
+void TranslationTable::Bind() {
+    rows = storage.offsets.size() - 1;
+    size = storage.targets.size();
+    offsets = storage.offsets.data();
+    targets = storage.targets.data();
+
+    if (score_bits == kScoreBitsFloat) {
+        forward = storage.forward.data();
+        backward = storage.backward.data();
+        forward_codebook = nullptr;
+        backward_codebook = nullptr;
+    } else {
+        forward = storage.forward_codes.data();
+        backward = storage.backward_codes.data();
+        forward_codebook = storage.forward_codebook.data();
+        backward_codebook = storage.backward_codebook.data();
+    }
+}
+
+void TranslationTable::AppendRow(word_t source, vector<entry_t> &entries) {
+    if (file || score_bits != kScoreBitsFloat)
+        throw logic_error("cannot modify a read-only translation table");
+    if (source < RowsCount())
+        throw invalid_argument("translation table rows must be appended in ascending order");
+
+    Resize(source);
+
+    std::sort(entries.begin(), entries.end(), __entry_compare);
+
+    for (auto entry = entries.begin(); entry != entries.end(); ++entry) {
+        storage.targets.push_back(entry->first);
+        storage.forward.push_back(entry->second.first);
+        storage.backward.push_back(entry->second.second);
+    }
+
+    storage.offsets.push_back(storage.targets.size());
+    Bind();
+}
+
+void TranslationTable::Resize(size_t rows) {
+    if (file || score_bits != kScoreBitsFloat)
+        throw logic_error("cannot modify a read-only translation table");
+
+    while (storage.offsets.size() - 1 < rows)
+        storage.offsets.push_back(storage.targets.size());
+    Bind();
+}
+
+void TranslationTable::ShrinkToFit() {
+    storage.offsets.shrink_to_fit();
+    storage.targets.shrink_to_fit();
+    storage.forward.shrink_to_fit();
+    storage.backward.shrink_to_fit();
+    Bind();
+}
+
+/* Quantization */
+
+class Quantizer {
+public:
+    Quantizer(int bits) : codebook_size(((size_t) 1) << bits), null_probability((float) kNullProbability) {
+    }
+
+    void Train(const TranslationTable &table, bool forward) {
+        vector<float> samples;
+
+        size_t step = max((size_t) 1, table.Size() / kQuantizationMaxSamples);
+        for (size_t i = 0; i < table.Size(); i += step) {
+            float value = forward ? table.GetForward(i) : table.GetBackward(i);
+            if (value != null_probability)
+                samples.push_back(log(value));
+        }
+
+        std::sort(samples.begin(), samples.end());
+
+        // code 0 is reserved to kNullProbability
+        size_t k = codebook_size - 1;
+        centroids.assign(k, samples.empty() ? (float) log(kNullProbability) : 0.f);
+
+        if (!samples.empty()) {
+            // quantile initialization
+            for (size_t c = 0; c < k; ++c)
+                centroids[c] = samples[min(samples.size() - 1, (2 * c + 1) * samples.size() / (2 * k))];
+
+            // Lloyd iterations: in one dimension every cluster is a contiguous range of the sorted samples
+            vector<double> sums(k);
+            vector<size_t> counts(k);
+
+            for (int iteration = 0; iteration < kQuantizationIterations; ++iteration) {
+                UpdateBoundaries();
+
+                std::fill(sums.begin(), sums.end(), 0.);
+                std::fill(counts.begin(), counts.end(), 0);
+
+                size_t c = 0;
+                for (auto sample = samples.begin(); sample != samples.end(); ++sample) {
+                    while (c < boundaries.size() && *sample >= boundaries[c])
+                        ++c;
+
+                    sums[c] += *sample;
+                    counts[c] += 1;
+                }
+
+                for (c = 0; c < k; ++c) {
+                    if (counts[c] > 0)
+                        centroids[c] = (float) (sums[c] / counts[c]);
+                }
+            }
+        }
+
+        UpdateBoundaries();
+
+        codebook.resize(codebook_size);
+        codebook[0] = null_probability;
+        for (size_t c = 0; c < k; ++c)
+            codebook[c + 1] = exp(centroids[c]);
+    }
+
+    template<typename T>
+    void Encode(const TranslationTable &table, bool forward, T *output, quantization_error_t *outError) const {
+        double error_sum = 0;
+        double error_max = 0;
+        size_t error_count = 0;
+
+#pragma omp parallel for reduction(+:error_sum, error_count) reduction(max:error_max)
+        for (size_t i = 0; i < table.Size(); ++i) {
+            float value = forward ? table.GetForward(i) : table.GetBackward(i);
+
+            if (value == null_probability) {
+                output[i] = 0;
+            } else {
+                float log_value = log(value);
+                auto c = (size_t) (std::upper_bound(boundaries.begin(), boundaries.end(), log_value) -
+                                   boundaries.begin());
+                output[i] = (T) (c + 1);
+
+                double error = fabs(log_value - centroids[c]);
+                error_sum += error;
+                error_max = max(error_max, error);
+                error_count++;
+            }
+        }
+
+        if (outError) {
+            outError->mean = error_count > 0 ? error_sum / error_count : 0;
+            outError->max = error_max;
+        }
+    }
+
+    const vector<float> &GetCodebook() const {
+        return codebook;
+    }
+
+private:
+    const size_t codebook_size;
+    const float null_probability;
+
+    vector<float> centroids;
+    vector<float> boundaries;
+    vector<float> codebook;
+
+    void UpdateBoundaries() {
+        boundaries.resize(centroids.size() - 1);
+        for (size_t c = 0; c < boundaries.size(); ++c)
+            boundaries[c] = (centroids[c] + centroids[c + 1]) / 2.f;
+    }
+};
+
+template<typename T>
+static void QuantizeDirection(const TranslationTable &table, bool forward, int bits,
+                              vector<uint8_t> &outCodes, vector<float> &outCodebook,
+                              quantization_error_t *outError) {
+    Quantizer quantizer(bits);
+    quantizer.Train(table, forward);
+
+    outCodes.resize(table.Size() * sizeof(T));
+    quantizer.Encode(table, forward, (T *) outCodes.data(), outError);
+    outCodebook = quantizer.GetCodebook();
+}
+
+shared_ptr<TranslationTable> TranslationTable::Quantize(int bits, quantization_error_t *outForwardError,
+                                                        quantization_error_t *outBackwardError) const {
+    if (bits != 8 && bits != 16)
+        throw invalid_argument("unsupported quantization: " + to_string(bits) + " bits");
+
+    shared_ptr<TranslationTable> result(new TranslationTable);
+    storage_t &output = result->storage;
+
+    output.offsets.assign(offsets, offsets + rows + 1);
+    output.targets.assign(targets, targets + size);
+
+    if (bits == 8) {
+        QuantizeDirection<uint8_t>(*this, true, bits, output.forward_codes, output.forward_codebook,
+                                   outForwardError);
+        QuantizeDirection<uint8_t>(*this, false, bits, output.backward_codes, output.backward_codebook,
+                                   outBackwardError);
+    } else {
+        QuantizeDirection<uint16_t>(*this, true, bits, output.forward_codes, output.forward_codebook,
+                                    outForwardError);
+        QuantizeDirection<uint16_t>(*this, false, bits, output.backward_codes, output.backward_codebook,
+                                    outBackwardError);
+    }
+
+    result->score_bits = bits;
+    result->Bind();
+
+    return result;
+}
+
+shared_ptr<TranslationTable> TranslationTable::Dequantize() const {
+    shared_ptr<TranslationTable> result(new TranslationTable);
+    storage_t &output = result->storage;
+
+    output.offsets.assign(offsets, offsets + rows + 1);
+    output.targets.assign(targets, targets + size);
+    output.forward.resize(size);
+    output.backward.resize(size);
+
+    for (size_t i = 0; i < size; ++i) {
+        output.forward[i] = GetForward(i);
+        output.backward[i] = GetBackward(i);
+    }
+
+    result->Bind();
+
+    return result;
+}
@@ -0,0 +1,186 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_TRANSLATIONTABLE_H
+#define MMT_FASTALIGN_TRANSLATIONTABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <utility>
+#include "alignment.h"
+#include "MappedFile.h"
+
+namespace mmt {
+    namespace fastalign {
+
+        static const int kScoreBitsFloat = 32;
+
+        struct quantization_error_t {
+            double mean; // mean absolute error of the log-probabilities
+            double max; // max absolute error of the log-probabilities
+        };
+
+        /**
+         * Read-only bidirectional translation table in compressed-sparse-row form.
+         *
+         * Row "s" spans the cells [offsets[s], offsets[s + 1]), target ids are sorted within each row
+         * and forward/backward scores are stored in two parallel arrays.
+         *
+         * Scores are either 32-bit floats or 8/16-bit codes into a per-direction codebook of probabilities.
+         * Arrays are either owned by the table or point into a memory-mapped model file.
+         */
+        class TranslationTable {
+        public:
+            typedef std::pair<word_t, std::pair<float, float>> entry_t;
+
+            TranslationTable();
+
+            TranslationTable(std::shared_ptr<MappedFile> file, size_t rows, size_t size,
+                             const uint64_t *offsets, const word_t *targets, int score_bits,
+                             const void *forward, const void *backward,
+                             const float *forward_codebook, const float *backward_codebook);
+
+            TranslationTable(const TranslationTable &) = delete;
+
+            TranslationTable &operator=(const TranslationTable &) = delete;
+
+            inline size_t RowsCount() const {
+                return rows;
+            }
+
+            inline size_t Size() const {
+                return size;
+            }
+
+            inline int GetScoreBits() const {
+                return score_bits;
+            }
+
+            inline bool Find(word_t source, word_t target, size_t *outIndex) const {
+                if (source >= rows)
+                    return false;
+
+                const word_t *base = targets + offsets[source];
+                size_t length = offsets[source + 1] - offsets[source];
+
+                if (length == 0)
+                    return false;
+
+                // Branch-free lower bound: the loop count only depends on the row length
+                while (length > 1) {
+                    size_t half = length / 2;
+                    base = (base[half] <= target) ? base + half : base;
+                    length -= half;
+                }
+
+                *outIndex = (size_t) (base - targets);
+                return *base == target;
+            }
+
+            inline float GetForward(size_t index) const {
+                return Decode(forward, forward_codebook, index);
+            }
+
+            inline float GetBackward(size_t index) const {
+                return Decode(backward, backward_codebook, index);
+            }
+
+            inline const uint64_t *GetOffsets() const {
+                return offsets;
+            }
+
+            inline const word_t *GetTargets() const {
+                return targets;
+            }
+
+            inline const void *GetForwardScores() const {
+                return forward;
+            }
+
+            inline const void *GetBackwardScores() const {
+                return backward;
+            }
+
+            inline const float *GetForwardCodebook() const {
+                return forward_codebook;
+            }
+
+            inline const float *GetBackwardCodebook() const {
+                return backward_codebook;
+            }
+
+            inline size_t GetCodebookSize() const {
+                return score_bits == kScoreBitsFloat ? 0 : ((size_t) 1) << score_bits;
+            }
+
+            /**
+             * Appends the row of the given source word, rows must be appended in ascending order.
+             * The entries vector is sorted in place.
+             */
+            void AppendRow(word_t source, std::vector<entry_t> &entries);
+
+            /**
+             * Appends empty rows until the table contains exactly "rows" rows.
+             */
+            void Resize(size_t rows);
+
+            void ShrinkToFit();
+
+            /**
+             * Creates a copy of this table with scores encoded with "bits" bits (8 or 16).
+             * Each direction has its own codebook, trained with Lloyd's algorithm on the log-probabilities;
+             * code 0 is reserved to kNullProbability so that missing entries are represented exactly.
+             */
+            std::shared_ptr<TranslationTable> Quantize(int bits, quantization_error_t *outForwardError = nullptr,
+                                                       quantization_error_t *outBackwardError = nullptr) const;
+
+            /**
+             * Creates a copy of this table with 32-bit float scores.
+             */
+            std::shared_ptr<TranslationTable> Dequantize() const;
+
+        private:
+            size_t rows;
+            size_t size;
+            const uint64_t *offsets;
+            const word_t *targets;
+
+            int score_bits;
+            const void *forward;
+            const void *backward;
+            const float *forward_codebook;
+            const float *backward_codebook;
+
+            std::shared_ptr<MappedFile> file;
+
+            struct storage_t {
+                std::vector<uint64_t> offsets;
+                std::vector<word_t> targets;
+                std::vector<float> forward;
+                std::vector<float> backward;
+                std::vector<uint8_t> forward_codes;
+                std::vector<uint8_t> backward_codes;
+                std::vector<float> forward_codebook;
+                std::vector<float> backward_codebook;
+            } storage;
+
+            inline float Decode(const void *scores, const float *codebook, size_t index) const {
+                switch (score_bits) {
+                    case 8:
+                        return codebook[((const uint8_t *) scores)[index]];
+                    case 16:
+                        return codebook[((const uint16_t *) scores)[index]];
+                    default:
+                        return ((const float *) scores)[index];
+                }
+            }
+
+            void Bind();
+        };
+
+    }
+}
+
+#endif //MMT_FASTALIGN_TRANSLATIONTABLE_H
@@ -4,11 +4,18 @@
 
 #include "Vocabulary.h"
 #include <iostream>
+#include <sstream>
+#include <iterator>
 #include <unordered_map>
 #include <algorithm>
+#include <numeric>
 #include <math.h>
 #include "ioutils.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace std;
 using namespace mmt;
 using namespace mmt::fastalign;
@@ -37,46 +44,332 @@ void ParseHeader(const string &header, size_t *outSize, bool *outCaseSensitive)
     }
 }
 
-bool __terms_compare(const pair<string, size_t> &a, const pair<string, size_t> &b) {
-    return b.second < a.second;
+struct term_counts_t {
+    size_t src = 0;
+    size_t tgt = 0;
+    size_t src_docs = 0;
+    size_t tgt_docs = 0;
+};
+
+typedef unordered_map<string, term_counts_t> term_map_t;
+typedef pair<string, term_counts_t> term_entry_t;
+
+static const size_t kBuildBatchSize = 10000;
+
+/**
+ * Returns the count of the term at which the cumulative frequency of the terms, taken by
+ * decreasing count, reaches the threshold of the total, or 0 if it is never reached.
+ * Runs in linear expected time: counts are partially ordered with nth_element.
+ */
+static size_t FindThresholdCount(vector<size_t> &counts, double threshold, double total) {
+    auto begin = counts.begin();
+    auto end = counts.end();
+    double covered = 0;  // sum of the counts before begin
+
+    while (begin != end) {
+        auto middle = begin + (end - begin) / 2;
+        nth_element(begin, middle, end, greater<size_t>());
+
+        double sum = covered + accumulate(begin, middle + 1, 0.);
+
+        if ((sum - *middle) / total >= threshold) {
+            end = middle;
+        } else if (sum / total >= threshold) {
+            return *middle;
+        } else {
+            covered = sum;
+            begin = middle + 1;
+        }
+    }
+
+    return 0;
 }
 
-inline void PruneTerms(unordered_map<string, size_t> &terms, double threshold) {
-    vector<pair<string, size_t>> entries;
-    entries.resize(terms.size());
+/**
+ * Counts terms and document frequencies of the corpora in parallel, optionally only for the terms in filter.
+ * Terms are split in shards by hash: every thread counts a batch in its own shards, then every shard is merged
+ * by a single thread. Memory is bounded by the batch size and the number of distinct terms.
+ * Returns the number of sentence pairs read, the tokens of each side are added to outTokens.
+ */
+template<typename Normalizer>
+static size_t CountTerms(const vector<Corpus> &corpora, size_t maxLineLength, const Normalizer &normalize,
+                         const unordered_map<string, bool> *filter, vector<term_entry_t> &outEntries,
+                         double outTokens[2], const function<void(size_t)> &progress, size_t progressOffset) {
+#ifdef _OPENMP
+    auto threads = (size_t) omp_get_max_threads();
+#else
+    size_t threads = 1;
+#endif
+
+    vector<term_map_t> shards(threads);
+    vector<vector<term_map_t>> local_shards(threads, vector<term_map_t>(threads));
+
+    vector<pair<sentence_t, sentence_t>> batch;
+    size_t n_docs = 0;
+
+    for (auto corpus = corpora.begin(); corpus != corpora.end(); ++corpus) {
+        CorpusReader reader(*corpus, nullptr, maxLineLength, true);
+
+        while (reader.Read(batch, kBuildBatchSize)) {
+#pragma omp parallel
+            {
+#ifdef _OPENMP
+                vector<term_map_t> &local = local_shards[omp_get_thread_num()];
+#else
+                vector<term_map_t> &local = local_shards[0];
+#endif
+                vector<string> words;
+
+                // equal words are sorted together: counted with a single lookup, once per document
+                auto count = [&local, &words, filter, threads](bool source) {
+                    sort(words.begin(), words.end());
+
+                    for (auto w = words.begin(); w != words.end(); /* no increment */) {
+                        auto next = upper_bound(w, words.end(), *w);
+
+                        if (!filter || filter->find(*w) != filter->end()) {
+                            term_counts_t &counts = local[hash_reduce(hash_term(w->data(), w->size(), 0),
+                                                                      threads)][*w];
+                            if (source) {
+                                counts.src += next - w;
+                                counts.src_docs += 1;
+                            } else {
+                                counts.tgt += next - w;
+                                counts.tgt_docs += 1;
+                            }
+                        }
+
+                        w = next;
+                    }
+                };
+
+#pragma omp for schedule(dynamic, 64)
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    words.clear();
+                    for (auto w = batch[i].first.begin(); w != batch[i].first.end(); ++w)
+                        words.push_back(normalize(*w));
+                    count(true);
+
+                    words.clear();
+                    for (auto w = batch[i].second.begin(); w != batch[i].second.end(); ++w)
+                        words.push_back(normalize(*w));
+                    count(false);
+                }
+            }
+
+#pragma omp parallel for schedule(dynamic)
+            for (size_t shard = 0; shard < threads; ++shard) {
+                term_map_t &terms = shards[shard];
 
-    size_t total = 0;
-    size_t i = 0;
-    for (auto entry = terms.begin(); entry != terms.end(); ++entry) {
-        entries[i].first = entry->first;
-        entries[i].second = entry->second;
+                for (auto local = local_shards.begin(); local != local_shards.end(); ++local) {
+                    term_map_t &local_terms = (*local)[shard];
 
-        total += entry->second;
+                    for (auto entry = local_terms.begin(); entry != local_terms.end(); ++entry) {
+                        term_counts_t &counts = terms[entry->first];
+                        counts.src += entry->second.src;
+                        counts.tgt += entry->second.tgt;
+                        counts.src_docs += entry->second.src_docs;
+                        counts.tgt_docs += entry->second.tgt_docs;
+                    }
 
-        i++;
+                    local_terms.clear();
+                }
+            }
+
+            for (auto pair = batch.begin(); pair != batch.end(); ++pair) {
+                outTokens[0] += pair->first.size();
+                outTokens[1] += pair->second.size();
+            }
+
+            n_docs += batch.size();
+            batch.clear();
+
+            if (progress)
+                progress(progressOffset + n_docs);
+        }
     }
 
-    std::sort(entries.begin(), entries.end(), __terms_compare);
+    for (auto shard = shards.begin(); shard != shards.end(); ++shard) {
+        for (auto entry = shard->begin(); entry != shard->end(); ++entry)
+            outEntries.emplace_back(entry->first, entry->second);
+        term_map_t().swap(*shard);
+    }
 
-    double counter = 0;
-    size_t min_size = 0;
-    for (auto entry = entries.begin(); entry != entries.end(); ++entry) {
-        counter += entry->second;
+    return n_docs;
+}
 
-        if (counter / total >= threshold) {
-            min_size = entry->second;
-            break;
+/**
+ * Count-min sketch with conservative update: estimates never underestimate the real counts.
+ */
+class CountMinSketch {
+public:
+    static const size_t kDepth = 4;
+
+    explicit CountMinSketch(size_t bytes) {
+        size_t width = 1024;
+        while (width * 2 * kDepth * sizeof(uint32_t) <= bytes)
+            width *= 2;
+
+        mask = width - 1;
+        counters.resize(width * kDepth, 0);
+    }
+
+    /**
+     * Adds an occurrence of the term with the given hash and returns its new estimated count.
+     */
+    inline size_t Add(uint64_t hash) {
+        size_t indexes[kDepth];
+        uint32_t estimate = UINT32_MAX;
+
+        for (size_t row = 0; row < kDepth; ++row) {
+            indexes[row] = row * (mask + 1) + (hash_displace(hash, (uint32_t) row) & mask);
+            estimate = min(estimate, counters[indexes[row]]);
         }
+
+        if (estimate < UINT32_MAX)
+            estimate++;
+
+        for (size_t row = 0; row < kDepth; ++row)
+            counters[indexes[row]] = max(counters[indexes[row]], estimate);
+
+        return estimate;
+    }
+
+private:
+    size_t mask;
+    vector<uint32_t> counters;
+};
+
+/**
+ * Keeps the terms with the highest estimated counts: when the candidates are twice the capacity,
+ * only the top ones are kept and the following terms must have an higher estimate to be admitted.
+ */
+class HeavyHitters {
+public:
+    explicit HeavyHitters(size_t capacity) : capacity(max(capacity, (size_t) 1)), floor(0) {
     }
 
-    if (min_size > 1) {
+    inline void Add(const string &term, size_t estimate) {
+        auto entry = terms.find(term);
+
+        if (entry != terms.end()) {
+            entry->second = estimate;
+        } else if (estimate > floor) {
+            terms.emplace(term, estimate);
+
+            if (terms.size() >= 2 * capacity)
+                Shrink();
+        }
+    }
+
+    const unordered_map<string, size_t> &GetTerms() const {
+        return terms;
+    }
+
+private:
+    const size_t capacity;
+    size_t floor;
+    unordered_map<string, size_t> terms;
+
+    void Shrink() {
+        vector<size_t> estimates;
+        estimates.reserve(terms.size());
+        for (auto entry = terms.begin(); entry != terms.end(); ++entry)
+            estimates.push_back(entry->second);
+
+        nth_element(estimates.begin(), estimates.begin() + capacity, estimates.end(), greater<size_t>());
+        floor = estimates[capacity];
+
         for (auto entry = terms.begin(); entry != terms.end(); /* no increment */) {
-            if (entry->second < min_size)
+            if (entry->second <= floor)
                 entry = terms.erase(entry);
             else
                 ++entry;
         }
     }
+};
+
+/* Perfect hash index */
+
+static const double kIndexLoadFactor = 0.99;
+static const uint64_t kIndexBucketSize = 4;
+static const uint32_t kIndexMaxDisplacement = 1 << 20;
+static const uint64_t kIndexMaxSeeds = 16;
+
+struct vocabulary_terms_t {
+    vector<pair<score_t, score_t>> probs;
+    vector<uint64_t> offsets;
+    string pool;
+};
+
+struct vocabulary_index_t {
+    vector<uint32_t> displacements;
+    vector<vocabulary_slot_t> slots;
+};
+
+// "Hash and displace": keys are grouped in buckets, then buckets are placed from the largest to the
+// smallest, searching for each one the first displacement that maps all its keys to free slots.
+static bool BuildPerfectHash(const vector<uint64_t> &hashes, uint64_t buckets, uint64_t size,
+                             vector<uint32_t> &displacements, vector<vocabulary_slot_t> &slots) {
+    vector<uint64_t> bucket_offsets(buckets + 1, 0);
+    for (auto hash = hashes.begin(); hash != hashes.end(); ++hash)
+        bucket_offsets[hash_reduce(*hash, buckets) + 1]++;
+    std::partial_sum(bucket_offsets.begin(), bucket_offsets.end(), bucket_offsets.begin());
+
+    vector<uint64_t> cursor(bucket_offsets.begin(), bucket_offsets.end() - 1);
+    vector<uint32_t> keys(hashes.size());
+    for (uint32_t key = 0; key < hashes.size(); ++key)
+        keys[cursor[hash_reduce(hashes[key], buckets)]++] = key;
+
+    vector<uint32_t> order(buckets);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&bucket_offsets](uint32_t a, uint32_t b) {
+        return (bucket_offsets[a + 1] - bucket_offsets[a]) > (bucket_offsets[b + 1] - bucket_offsets[b]);
+    });
+
+    vector<bool> occupied(size, false);
+    vector<uint64_t> positions;
+
+    displacements.assign(buckets, 0);
+    slots.assign(size, vocabulary_slot_t{0, kNullWord});
+
+    for (auto bucket = order.begin(); bucket != order.end(); ++bucket) {
+        uint64_t begin = bucket_offsets[*bucket];
+        uint64_t end = bucket_offsets[*bucket + 1];
+
+        if (begin == end)
+            break;
+
+        uint32_t displacement = 0;
+        for (; displacement < kIndexMaxDisplacement; ++displacement) {
+            positions.clear();
+
+            for (uint64_t k = begin; k < end; ++k) {
+                uint64_t position = hash_reduce(hash_displace(hashes[keys[k]], displacement), size);
+                if (occupied[position] || std::find(positions.begin(), positions.end(), position) != positions.end())
+                    break;
+
+                positions.push_back(position);
+            }
+
+            if (positions.size() == end - begin)
+                break;
+        }
+
+        if (displacement == kIndexMaxDisplacement)
+            return false;
+
+        displacements[*bucket] = displacement;
+        for (uint64_t k = begin; k < end; ++k) {
+            uint64_t position = positions[k - begin];
+
+            occupied[position] = true;
+            slots[position].fingerprint = (uint32_t) hashes[keys[k]];
+            slots[position].id = keys[k] + 2;
+        }
+    }
+
+    return true;
 }
 
 inline score_t SmoothInverseDocumentFrequency(size_t n_docs, size_t doc_freq) {
@@ -86,6 +379,8 @@ inline score_t SmoothInverseDocumentFrequency(size_t n_docs, size_t doc_freq) {
 Vocabulary::Vocabulary(bool case_sensitive) : case_sensitive(case_sensitive) {
     boost::locale::generator gen;
     locale = gen("C.UTF-8");
+
+    Assign(vector<string>(2), vector<pair<score_t, score_t>>(2, pair<score_t, score_t>(0, 0)));
 }
 
 Vocabulary::Vocabulary(std::istream &in) {
@@ -98,140 +393,275 @@ Vocabulary::Vocabulary(std::istream &in) {
     size_t size;
     ParseHeader(header, &size, &case_sensitive);
 
-    probs.resize(size + 2);
-    vocab.reserve(size + 2);
+    vector<string> words(size + 2);
+    vector<pair<score_t, score_t>> probs(size + 2, pair<score_t, score_t>(0, 0));
 
     for (word_t id = 2; id < size + 2; ++id) {
         probs[id].first = io_read<score_t>(in);
         probs[id].second = io_read<score_t>(in);
 
-        string word;
-        io_read(in, word);
-        vocab[word] = id;
+        io_read(in, words[id]);
+    }
+
+    Assign(words, probs);
+}
+
+void Vocabulary::Assign(const vector<string> &words, const vector<pair<score_t, score_t>> &probs) {
+    shared_ptr<vocabulary_terms_t> storage(new vocabulary_terms_t);
+    storage->probs = probs;
+    storage->offsets.resize(words.size() + 1);
+
+    size_t pool_size = 0;
+    for (auto word = words.begin(); word != words.end(); ++word)
+        pool_size += word->size();
+    storage->pool.reserve(pool_size);
+
+    for (size_t id = 0; id < words.size(); ++id) {
+        storage->offsets[id] = storage->pool.size();
+        storage->pool.append(words[id]);
     }
+    storage->offsets[words.size()] = storage->pool.size();
+
+    terms.size = words.size();
+    terms.probs = storage->probs.data();
+    terms.offsets = storage->offsets.data();
+    terms.pool = storage->pool.data();
+    terms_storage = storage;
+
+    BuildIndex();
 }
 
-void Vocabulary::BuildFromCorpora(const vector<Corpus> &corpora, size_t maxLineLength, double threshold) {
-    // For model efficiency all source words must have the lowest id possible
-    unordered_map<string, size_t> src_terms;
-    unordered_map<string, size_t> tgt_terms;
-    unordered_map<string, size_t> src_doc_term_freq;
-    unordered_map<string, size_t> tgt_doc_term_freq;
+void Vocabulary::BuildIndex() {
+    shared_ptr<vocabulary_index_t> storage(new vocabulary_index_t);
+
+    uint64_t keys = terms.size > 2 ? terms.size - 2 : 0;
+    uint64_t size = keys == 0 ? 0 : (uint64_t) (keys / kIndexLoadFactor) + 1;
+    uint64_t buckets = keys / kIndexBucketSize + 1;
 
-    vector<string> src, trg;
-    unordered_set<string> src_doc_terms, tgt_doc_terms;
+    vector<uint64_t> hashes(keys);
+
+    uint64_t seed = 0;
+    for (; seed < kIndexMaxSeeds; ++seed) {
+        for (word_t id = 2; id < terms.size; ++id)
+            hashes[id - 2] = hash_term(terms.pool + terms.offsets[id], terms.offsets[id + 1] - terms.offsets[id], seed);
+
+        if (BuildPerfectHash(hashes, buckets, size, storage->displacements, storage->slots))
+            break;
+    }
+
+    if (seed == kIndexMaxSeeds)
+        throw runtime_error("unable to build vocabulary index, duplicated terms?");
+
+    index.seed = seed;
+    index.buckets = buckets;
+    index.size = size;
+    index.displacements = storage->displacements.data();
+    index.slots = storage->slots.data();
+    index_storage = storage;
+}
+
+string Vocabulary::Normalize(const string &term) const {
+    if (case_sensitive)
+        return term;
+
+    string lower(term.size(), '\0');
+    if (ToLowerAscii(term.data(), term.size(), &lower[0]))
+        return lower;
+
+    return boost::locale::to_lower(term, locale);
+}
+
+void Vocabulary::SelectCandidates(const vector<Corpus> &corpora, size_t maxLineLength, double threshold,
+                                  size_t memoryBudget, unordered_map<string, bool> &outCandidates,
+                                  size_t *outSentences, const function<void(size_t)> &progress) const {
+    // Half of the budget goes to the sketches, half to the candidates (roughly 64 bytes each)
+    CountMinSketch src_sketch(memoryBudget / 4), tgt_sketch(memoryBudget / 4);
+    HeavyHitters src_hitters(memoryBudget / 4 / 64), tgt_hitters(memoryBudget / 4 / 64);
+    double src_tokens = 0, tgt_tokens = 0;
+
+    vector<pair<sentence_t, sentence_t>> batch;
+    vector<pair<sentence_t, sentence_t>> normalized;
     size_t n_docs = 0;
 
     for (auto corpus = corpora.begin(); corpus != corpora.end(); ++corpus) {
         CorpusReader reader(*corpus, nullptr, maxLineLength, true);
 
-        while (reader.Read(src, trg)) {
-            src_doc_terms.clear();
-            tgt_doc_terms.clear();
+        while (reader.Read(batch, kBuildBatchSize)) {
+            normalized.resize(batch.size());
 
-            for (auto w = src.begin(); w != src.end(); ++w) {
-                string src_term = case_sensitive ? *w : boost::locale::to_lower(*w, locale);
-                src_terms[src_term] += 1;
-                src_doc_terms.insert(src_term);
+#pragma omp parallel for schedule(dynamic, 64)
+            for (size_t i = 0; i < batch.size(); ++i) {
+                normalized[i].first.clear();
+                for (auto w = batch[i].first.begin(); w != batch[i].first.end(); ++w)
+                    normalized[i].first.push_back(Normalize(*w));
+
+                normalized[i].second.clear();
+                for (auto w = batch[i].second.begin(); w != batch[i].second.end(); ++w)
+                    normalized[i].second.push_back(Normalize(*w));
             }
 
-            for (auto w = trg.begin(); w != trg.end(); ++w) {
-                string tgt_term = case_sensitive ? *w : boost::locale::to_lower(*w, locale);
-                tgt_terms[tgt_term] += 1;
-                tgt_doc_terms.insert(tgt_term);
+            // Sketches and heavy hitters are updated in order, that makes the candidates deterministic
+            for (size_t i = 0; i < batch.size(); ++i) {
+                for (auto w = normalized[i].first.begin(); w != normalized[i].first.end(); ++w)
+                    src_hitters.Add(*w, src_sketch.Add(hash_term(w->data(), w->size(), 0)));
+                for (auto w = normalized[i].second.begin(); w != normalized[i].second.end(); ++w)
+                    tgt_hitters.Add(*w, tgt_sketch.Add(hash_term(w->data(), w->size(), 0)));
+
+                src_tokens += normalized[i].first.size();
+                tgt_tokens += normalized[i].second.size();
             }
 
-            n_docs += 1;
-            for (auto w = src_doc_terms.begin(); w != src_doc_terms.end(); ++w)
-                src_doc_term_freq[*w] += 1;
-            for (auto w = tgt_doc_terms.begin(); w != tgt_doc_terms.end(); ++w)
-                tgt_doc_term_freq[*w] += 1;
+            n_docs += batch.size();
+            batch.clear();
+
+            if (progress)
+                progress(n_docs);
         }
     }
 
-    if (threshold > 0) {
-        PruneTerms(src_terms, threshold);
-        PruneTerms(tgt_terms, threshold);
+    // Candidates are the terms whose estimates cover the threshold, or all of them if the budget is too small
+    const HeavyHitters *hitters[] = {&src_hitters, &tgt_hitters};
+    double tokens[] = {src_tokens, tgt_tokens};
+
+    for (size_t side = 0; side < 2; ++side) {
+        const unordered_map<string, size_t> &terms = hitters[side]->GetTerms();
+
+        vector<size_t> estimates;
+        estimates.reserve(terms.size());
+        for (auto entry = terms.begin(); entry != terms.end(); ++entry)
+            estimates.push_back(entry->second);
+
+        size_t min_count = threshold > 0 ? FindThresholdCount(estimates, threshold, tokens[side]) : 0;
+
+        for (auto entry = terms.begin(); entry != terms.end(); ++entry) {
+            if (entry->second >= min_count)
+                outCandidates[entry->first] = true;
+        }
     }
 
-    // Create source and target terms array
+    *outSentences = n_docs;
+}
 
-    vector<pair<string, size_t>> src_terms_array, tgt_terms_array;
-    src_terms_array.reserve(src_terms.size());
-    tgt_terms_array.reserve(tgt_terms.size());
+void Vocabulary::BuildFromCorpora(const vector<Corpus> &corpora, size_t maxLineLength, double threshold,
+                                  size_t memoryBudget, const function<void(size_t)> &progress) {
+    auto normalize = [this](const string &term) -> string {
+        return Normalize(term);
+    };
+
+    vector<term_entry_t> entries;
+    double tokens[2] = {0, 0};
+    size_t n_docs;
+
+    if (memoryBudget > 0) {
+        // Two passes: the frequent terms are estimated within the budget, then counted exactly
+        unordered_map<string, bool> candidates;
+        size_t sentences = 0;
+        SelectCandidates(corpora, maxLineLength, threshold, memoryBudget, candidates, &sentences, progress);
+
+        n_docs = CountTerms(corpora, maxLineLength, normalize, &candidates, entries, tokens, progress,
+                            sentences);
+    } else {
+        n_docs = CountTerms(corpora, maxLineLength, normalize, nullptr, entries, tokens, progress, 0);
+    }
+
+    // Terms below the count that covers the threshold are pruned
+    size_t src_min_count = 0;
+    size_t tgt_min_count = 0;
+
+    if (threshold > 0) {
+        vector<size_t> src_counts, tgt_counts;
+        for (auto entry = entries.begin(); entry != entries.end(); ++entry) {
+            if (entry->second.src > 0)
+                src_counts.push_back(entry->second.src);
+            if (entry->second.tgt > 0)
+                tgt_counts.push_back(entry->second.tgt);
+        }
 
-    for (auto src_term = src_terms.begin(); src_term != src_terms.end(); ++src_term) {
-        src_terms_array.emplace_back(src_term->first, src_term->second);
+        src_min_count = FindThresholdCount(src_counts, threshold, tokens[0]);
+        tgt_min_count = FindThresholdCount(tgt_counts, threshold, tokens[1]);
     }
 
-    for (auto tgt_term = tgt_terms.begin(); tgt_term != tgt_terms.end(); ++tgt_term) {
-        auto src_term = src_terms.find(tgt_term->first);
-        if (src_term == src_terms.end())
-            tgt_terms_array.emplace_back(tgt_term->first, tgt_term->second);
+    // For model efficiency all source words must have the lowest id possible,
+    // terms are sorted by decreasing count, then alphabetically to make ids deterministic
+    vector<const term_entry_t *> src_terms, tgt_terms;
+
+    for (auto entry = entries.begin(); entry != entries.end(); ++entry) {
+        const term_counts_t &counts = entry->second;
+
+        if (counts.src > 0 && (src_min_count <= 1 || counts.src >= src_min_count))
+            src_terms.push_back(&*entry);
+        else if (counts.tgt > 0 && (tgt_min_count <= 1 || counts.tgt >= tgt_min_count))
+            tgt_terms.push_back(&*entry);
     }
 
-    std::sort(src_terms_array.begin(), src_terms_array.end(), __terms_compare);
-    std::sort(tgt_terms_array.begin(), tgt_terms_array.end(), __terms_compare);
+    sort(src_terms.begin(), src_terms.end(), [](const term_entry_t *a, const term_entry_t *b) {
+        return a->second.src != b->second.src ? a->second.src > b->second.src : a->first < b->first;
+    });
+    sort(tgt_terms.begin(), tgt_terms.end(), [](const term_entry_t *a, const term_entry_t *b) {
+        return a->second.tgt != b->second.tgt ? a->second.tgt > b->second.tgt : a->first < b->first;
+    });
 
     // Storing model data
 
     word_t id = 2;
-    size_t size = src_terms_array.size() + tgt_terms_array.size();
-
-    probs.resize(size + 2);
-    vocab.clear();
-    vocab.reserve(size + 2);
-
-    for (auto src_term = src_terms_array.begin(); src_term != src_terms_array.end(); ++src_term) {
-        size_t src_doc_freq = src_doc_term_freq[src_term->first];
-        size_t tgt_doc_freq = 0;
+    size_t size = src_terms.size() + tgt_terms.size();
 
-        auto tgt_term = tgt_doc_term_freq.find(src_term->first);
-        if (tgt_term != tgt_doc_term_freq.end())
-            tgt_doc_freq = tgt_term->second;
+    vector<string> words(size + 2);
+    vector<pair<score_t, score_t>> probs(size + 2, pair<score_t, score_t>(0, 0));
 
-        probs[id].first = SmoothInverseDocumentFrequency(n_docs, src_doc_freq);
-        probs[id].second = SmoothInverseDocumentFrequency(n_docs, tgt_doc_freq);
-        vocab[src_term->first] = id;
+    for (auto term = src_terms.begin(); term != src_terms.end(); ++term) {
+        probs[id].first = SmoothInverseDocumentFrequency(n_docs, (*term)->second.src_docs);
+        probs[id].second = SmoothInverseDocumentFrequency(n_docs, (*term)->second.tgt_docs);
+        words[id] = (*term)->first;
 
         id++;
     }
 
-    for (auto tgt_term = tgt_terms_array.begin(); tgt_term != tgt_terms_array.end(); ++tgt_term) {
-        size_t src_doc_freq = 0;
-        size_t tgt_doc_freq = tgt_doc_term_freq[tgt_term->first];
-
-        probs[id].first = SmoothInverseDocumentFrequency(n_docs, src_doc_freq);
-        probs[id].second = SmoothInverseDocumentFrequency(n_docs, tgt_doc_freq);
-        vocab[tgt_term->first] = id;
+    for (auto term = tgt_terms.begin(); term != tgt_terms.end(); ++term) {
+        probs[id].first = SmoothInverseDocumentFrequency(n_docs, 0);
+        probs[id].second = SmoothInverseDocumentFrequency(n_docs, (*term)->second.tgt_docs);
+        words[id] = (*term)->first;
 
         id++;
     }
+
+    Assign(words, probs);
 }
 
-void Vocabulary::Store(ostream &out) {
-    // Sorting entries by id
-    vector<pair<string, size_t>> entries;
-    entries.reserve(vocab.size());
+void Vocabulary::Extend(const Vocabulary &other) {
+    if (other.case_sensitive != case_sensitive)
+        throw invalid_argument("cannot extend a vocabulary with a different case sensitivity");
+
+    vector<string> words(terms.size);
+    vector<pair<score_t, score_t>> probs(terms.probs, terms.probs + terms.size);
 
-    for (auto entry = vocab.begin(); entry != vocab.end(); ++entry)
-        entries.emplace_back(entry->first, entry->second);
+    for (word_t id = 2; id < terms.size; ++id)
+        words[id] = GetTerm(id);
 
-    std::sort(entries.begin(), entries.end(), __terms_compare);
+    for (word_t id = 2; id < other.terms.size; ++id) {
+        string term = other.GetTerm(id);
 
+        if (Find(term.data(), term.size()) == kUnknownWord) {
+            words.push_back(term);
+            probs.push_back(other.terms.probs[id]);
+        }
+    }
+
+    Assign(words, probs);
+}
+
+void Vocabulary::Store(ostream &out) const {
     // Writing output model
     ostringstream header;
-    header << "size=" << entries.size() << ' '
+    header << "size=" << (terms.size - 2) << ' '
            << "case_sensitive=" << (case_sensitive ? '1' : '0');
 
     string header_str = header.str();
     io_write(out, header_str);
 
-    for (auto entry = entries.rbegin(); entry != entries.rend(); ++entry) {
-        size_t id = entry->second;
-
-        io_write(out, probs[id].first);
-        io_write(out, probs[id].second);
-        io_write(out, entry->first);
+    for (word_t id = 2; id < terms.size; ++id) {
+        io_write(out, terms.probs[id].first);
+        io_write(out, terms.probs[id].second);
+        io_write(out, GetTerm(id));
     }
 }
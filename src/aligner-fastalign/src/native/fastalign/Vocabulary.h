@@ -6,9 +6,15 @@
 #define MMT_FASTALIGN_VOCABULARY_H
 
 #include <string>
-#include <unordered_set>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include "alignment.h"
 #include "Corpus.h"
+#include "MappedFile.h"
+#include "hashutils.h"
 #include <boost/locale.hpp>
 #include <boost/locale/generator.hpp>
 
@@ -18,21 +24,66 @@ namespace mmt {
         static const word_t kNullWord = 0;
         static const word_t kUnknownWord = 1;
 
+        struct vocabulary_slot_t {
+            uint32_t fingerprint;
+            word_t id; // kNullWord marks an empty slot
+        };
+
+        /**
+         * Read-only vocabulary: all the terms are packed in a single string pool and indexed
+         * by a perfect hash function built with the "hash and displace" method. Every lookup
+         * probes exactly one slot, that is then verified with a fingerprint and a string comparison.
+         *
+         * Arrays are shared by copies of the same vocabulary, and are either owned or point
+         * into a memory-mapped model file.
+         */
         class Vocabulary {
+            friend class ModelFile;
+
         public:
             explicit Vocabulary(bool case_sensitive = true);
 
             explicit Vocabulary(std::istream &in);
 
-            void BuildFromCorpora(const std::vector<Corpus> &corpora, size_t maxLineLength = 0, double threshold = 0.);
+            /**
+             * Collects the terms of the corpora, pruning the least frequent ones that are not needed to cover
+             * the given fraction (threshold) of the tokens. If set, progress is called after every batch
+             * with the number of sentence pairs read so far.
+             *
+             * With a memory budget (in bytes) the corpora are read twice: the frequent terms are first estimated
+             * with count-min sketches, then only them are counted exactly.
+             */
+            void BuildFromCorpora(const std::vector<Corpus> &corpora, size_t maxLineLength = 0, double threshold = 0.,
+                                  size_t memoryBudget = 0, const std::function<void(size_t)> &progress = nullptr);
+
+            /**
+             * Appends the terms of other that are not in this vocabulary: the ids of the existing terms,
+             * and their scores, do not change.
+             */
+            void Extend(const Vocabulary &other);
 
             inline const size_t Size() const {
-                return vocab.size() + 2;
+                return terms.size;
+            }
+
+            inline const bool IsCaseSensitive() const {
+                return case_sensitive;
             }
 
             inline const word_t Get(const std::string &term) const {
-                auto result = vocab.find(case_sensitive ? term : boost::locale::to_lower(term, locale));
-                return result == vocab.end() ? kUnknownWord : result->second;
+                return Get(term.data(), term.size());
+            }
+
+            inline const word_t Get(const char *term, size_t length) const {
+                if (case_sensitive)
+                    return Find(term, length);
+
+                char buffer[kMaxInlineTermLength];
+                if (length <= kMaxInlineTermLength && ToLowerAscii(term, length, buffer))
+                    return Find(buffer, length);
+
+                std::string lower = boost::locale::to_lower(term, term + length, locale);
+                return Find(lower.data(), lower.size());
             }
 
             inline const void Encode(const sentence_t &sentence, wordvec_t &output) const {
@@ -46,21 +97,95 @@ namespace mmt {
             }
 
             inline const score_t GetProbability(word_t id, bool is_source) const {
-                if (id < probs.size()) {
-                    const std::pair<score_t, score_t> &pair = probs[id];
+                if (id < terms.size) {
+                    const std::pair<score_t, score_t> &pair = terms.probs[id];
                     return is_source ? pair.first : pair.second;
                 } else {
                     return 0;
                 }
             }
 
-            void Store(std::ostream &out);
+            inline std::string GetTerm(word_t id) const {
+                return id < terms.size ?
+                       std::string(terms.pool + terms.offsets[id], terms.offsets[id + 1] - terms.offsets[id]) :
+                       std::string();
+            }
+
+            void Store(std::ostream &out) const;
 
         private:
+            static const size_t kMaxInlineTermLength = 128;
+
             std::locale locale;
             bool case_sensitive;
-            std::vector<std::pair<score_t, score_t>> probs;
-            std::unordered_map<std::string, word_t> vocab;
+
+            // Keep alive the arrays below: owned vectors or the memory-mapped model file
+            std::shared_ptr<void> terms_storage;
+            std::shared_ptr<void> index_storage;
+
+            struct {
+                size_t size;
+                const std::pair<score_t, score_t> *probs;
+                const uint64_t *offsets;
+                const char *pool;
+            } terms;
+
+            struct {
+                uint64_t seed;
+                uint64_t buckets;
+                uint64_t size;
+                const uint32_t *displacements;
+                const vocabulary_slot_t *slots;
+            } index;
+
+            /**
+             * Replaces the content of this vocabulary; terms and probabilities are indexed by id
+             * and the special words must have an empty term.
+             */
+            void Assign(const std::vector<std::string> &terms, const std::vector<std::pair<score_t, score_t>> &probs);
+
+            std::string Normalize(const std::string &term) const;
+
+            void SelectCandidates(const std::vector<Corpus> &corpora, size_t maxLineLength, double threshold,
+                                  size_t memoryBudget, std::unordered_map<std::string, bool> &outCandidates,
+                                  size_t *outSentences, const std::function<void(size_t)> &progress) const;
+
+            /**
+             * Builds the perfect hash index of the current terms.
+             */
+            void BuildIndex();
+
+            inline const word_t Find(const char *term, size_t length) const {
+                if (index.size == 0)
+                    return kUnknownWord;
+
+                uint64_t hash = hash_term(term, length, index.seed);
+                uint32_t displacement = index.displacements[hash_reduce(hash, index.buckets)];
+                const vocabulary_slot_t &slot = index.slots[hash_reduce(hash_displace(hash, displacement),
+                                                                        index.size)];
+
+                if (slot.fingerprint != (uint32_t) hash || slot.id == kNullWord)
+                    return kUnknownWord;
+
+                uint64_t begin = terms.offsets[slot.id];
+                uint64_t end = terms.offsets[slot.id + 1];
+
+                if (end - begin == length && memcmp(terms.pool + begin, term, length) == 0)
+                    return slot.id;
+                else
+                    return kUnknownWord;
+            }
+
+            static inline bool ToLowerAscii(const char *term, size_t length, char *output) {
+                for (size_t i = 0; i < length; ++i) {
+                    auto c = (unsigned char) term[i];
+                    if (c >= 0x80)
+                        return false;
+                    output[i] = (char) ((c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c);
+                }
+
+                return true;
+            }
         };
 
     }
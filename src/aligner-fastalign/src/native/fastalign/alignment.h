@@ -6,6 +6,7 @@
 #define MMT_FASTALIGN_ALIGNMENT_H
 
 #include <cstdint>
+#include <string>
 #include <vector>
 #include <unordered_map>
 
@@ -0,0 +1,46 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_HASHUTILS_H
+#define MMT_FASTALIGN_HASHUTILS_H
+
+#include <cstdint>
+#include <cstddef>
+
+// Hash functions are stable across platforms, so they can be persisted in model files
+
+// 64-bit FNV-1a, the seed alters the offset basis
+inline uint64_t hash_bytes(const char *data, size_t length, uint64_t seed = 0) {
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (uint8_t) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// splitmix64 finalizer
+inline uint64_t hash_mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+inline uint64_t hash_term(const char *data, size_t length, uint64_t seed) {
+    return hash_mix(hash_bytes(data, length, seed));
+}
+
+// Maps the high 32 bits of the hash to [0, n) without a division, n must be lower than 2^32
+inline uint64_t hash_reduce(uint64_t hash, uint64_t n) {
+    return ((hash >> 32) * n) >> 32;
+}
+
+inline uint64_t hash_displace(uint64_t hash, uint32_t displacement) {
+    return hash_mix(hash + displacement * 0x9E3779B97F4A7C15ULL);
+}
+
+#endif //MMT_FASTALIGN_HASHUTILS_H
@@ -0,0 +1,321 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#include "vectorutils.h"
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MMT_FASTALIGN_X86_DISPATCH
+
+#include <immintrin.h>
+
+#endif
+
+using namespace mmt::fastalign;
+
+/* Portable implementation, also used for the tails of the vectorized loops */
+
+static inline double ScaleAndSumTail(double *values, const double *weights, size_t begin, size_t length) {
+    double sum = 0;
+    for (size_t i = begin; i < length; ++i) {
+        values[i] *= weights[i];
+        sum += values[i];
+    }
+    return sum;
+}
+
+static inline double NormalizeAndFeatureTail(double *values, size_t begin, size_t length, double divisor,
+                                             unsigned j, unsigned m) {
+    const double mn = m * (unsigned) length;
+    const double jn = j * (unsigned) length;
+
+    double sum = 0;
+    for (size_t i = begin; i < length; ++i) {
+        values[i] /= divisor;
+        sum += -(std::fabs((i + 1) * (double) m - jn) / mn) * values[i];
+    }
+    return sum;
+}
+
+static inline size_t FirstIndexOf(const double *values, size_t begin, double value) {
+    size_t i = begin;
+    while (values[i] != value)
+        ++i;
+    return i;
+}
+
+static double ScaleAndSumPortable(double *values, const double *weights, size_t length) {
+    return ScaleAndSumTail(values, weights, 0, length);
+}
+
+static double NormalizeAndFeaturePortable(double *values, size_t length, double divisor, unsigned j, unsigned m) {
+    return NormalizeAndFeatureTail(values, 0, length, divisor, j, m);
+}
+
+static size_t ArgMaxPortable(const double *values, size_t length) {
+    size_t index = 0;
+    for (size_t i = 1; i < length; ++i) {
+        if (values[i] > values[index])
+            index = i;
+    }
+    return index;
+}
+
+#ifdef MMT_FASTALIGN_X86_DISPATCH
+
+// The argmax functions find the maximum value first, then its first occurrence: this way the result
+// is the same of the scalar loop, that keeps the first of equal values.
+
+/* SSE4.2 implementation */
+
+__attribute__((target("sse4.2")))
+static double ScaleAndSumSSE(double *values, const double *weights, size_t length) {
+    __m128d acc = _mm_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 2 <= length; i += 2) {
+        __m128d v = _mm_mul_pd(_mm_loadu_pd(values + i), _mm_loadu_pd(weights + i));
+        _mm_storeu_pd(values + i, v);
+        acc = _mm_add_pd(acc, v);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+
+    return (lanes[0] + lanes[1]) + ScaleAndSumTail(values, weights, i, length);
+}
+
+__attribute__((target("sse4.2")))
+static double NormalizeAndFeatureSSE(double *values, size_t length, double divisor, unsigned j, unsigned m) {
+    const __m128d vdivisor = _mm_set1_pd(divisor);
+    const __m128d vm = _mm_set1_pd(m);
+    const __m128d vmn = _mm_set1_pd(m * (unsigned) length);
+    const __m128d vjn = _mm_set1_pd(j * (unsigned) length);
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d step = _mm_set1_pd(2);
+
+    __m128d index = _mm_set_pd(2, 1);
+    __m128d acc = _mm_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 2 <= length; i += 2) {
+        __m128d v = _mm_div_pd(_mm_loadu_pd(values + i), vdivisor);
+        _mm_storeu_pd(values + i, v);
+
+        __m128d x = _mm_sub_pd(_mm_mul_pd(index, vm), vjn);
+        __m128d feature = _mm_sub_pd(zero, _mm_div_pd(_mm_max_pd(x, _mm_sub_pd(zero, x)), vmn));
+        acc = _mm_add_pd(acc, _mm_mul_pd(feature, v));
+
+        index = _mm_add_pd(index, step);
+    }
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+
+    return (lanes[0] + lanes[1]) + NormalizeAndFeatureTail(values, i, length, divisor, j, m);
+}
+
+__attribute__((target("sse4.2")))
+static size_t ArgMaxSSE(const double *values, size_t length) {
+    if (length < 2)
+        return 0;
+
+    __m128d vmax = _mm_loadu_pd(values);
+
+    size_t i = 2;
+    for (; i + 2 <= length; i += 2)
+        vmax = _mm_max_pd(vmax, _mm_loadu_pd(values + i));
+
+    double lanes[2];
+    _mm_storeu_pd(lanes, vmax);
+
+    double max = lanes[0] > lanes[1] ? lanes[0] : lanes[1];
+    for (; i < length; ++i)
+        max = values[i] > max ? values[i] : max;
+
+    return FirstIndexOf(values, 0, max);
+}
+
+/* AVX2 implementation */
+
+__attribute__((target("avx2")))
+static double ScaleAndSumAVX2(double *values, const double *weights, size_t length) {
+    __m256d acc = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m256d v = _mm256_mul_pd(_mm256_loadu_pd(values + i), _mm256_loadu_pd(weights + i));
+        _mm256_storeu_pd(values + i, v);
+        acc = _mm256_add_pd(acc, v);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ScaleAndSumTail(values, weights, i, length);
+}
+
+__attribute__((target("avx2")))
+static double NormalizeAndFeatureAVX2(double *values, size_t length, double divisor, unsigned j, unsigned m) {
+    const __m256d vdivisor = _mm256_set1_pd(divisor);
+    const __m256d vm = _mm256_set1_pd(m);
+    const __m256d vmn = _mm256_set1_pd(m * (unsigned) length);
+    const __m256d vjn = _mm256_set1_pd(j * (unsigned) length);
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d step = _mm256_set1_pd(4);
+
+    __m256d index = _mm256_set_pd(4, 3, 2, 1);
+    __m256d acc = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 4 <= length; i += 4) {
+        __m256d v = _mm256_div_pd(_mm256_loadu_pd(values + i), vdivisor);
+        _mm256_storeu_pd(values + i, v);
+
+        __m256d x = _mm256_sub_pd(_mm256_mul_pd(index, vm), vjn);
+        __m256d feature = _mm256_sub_pd(zero, _mm256_div_pd(_mm256_max_pd(x, _mm256_sub_pd(zero, x)), vmn));
+        acc = _mm256_add_pd(acc, _mm256_mul_pd(feature, v));
+
+        index = _mm256_add_pd(index, step);
+    }
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) +
+           NormalizeAndFeatureTail(values, i, length, divisor, j, m);
+}
+
+__attribute__((target("avx2")))
+static size_t ArgMaxAVX2(const double *values, size_t length) {
+    if (length < 4)
+        return ArgMaxPortable(values, length);
+
+    __m256d vmax = _mm256_loadu_pd(values);
+
+    size_t i = 4;
+    for (; i + 4 <= length; i += 4)
+        vmax = _mm256_max_pd(vmax, _mm256_loadu_pd(values + i));
+
+    double lanes[4];
+    _mm256_storeu_pd(lanes, vmax);
+
+    double max = lanes[0];
+    for (int k = 1; k < 4; ++k)
+        max = lanes[k] > max ? lanes[k] : max;
+    for (; i < length; ++i)
+        max = values[i] > max ? values[i] : max;
+
+    const __m256d vvalue = _mm256_set1_pd(max);
+    for (i = 0; i + 4 <= length; i += 4) {
+        int mask = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(values + i), vvalue, _CMP_EQ_OQ));
+        if (mask)
+            return i + __builtin_ctz((unsigned) mask);
+    }
+
+    return FirstIndexOf(values, i, max);
+}
+
+/* AVX-512 implementation */
+
+__attribute__((target("avx512f")))
+static inline double ReduceAdd(__m512d values) {
+    double lanes[8];
+    _mm512_storeu_pd(lanes, values);
+    return ((lanes[0] + lanes[1]) + (lanes[2] + lanes[3])) + ((lanes[4] + lanes[5]) + (lanes[6] + lanes[7]));
+}
+
+__attribute__((target("avx512f")))
+static double ScaleAndSumAVX512(double *values, const double *weights, size_t length) {
+    __m512d acc = _mm512_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m512d v = _mm512_mul_pd(_mm512_loadu_pd(values + i), _mm512_loadu_pd(weights + i));
+        _mm512_storeu_pd(values + i, v);
+        acc = _mm512_add_pd(acc, v);
+    }
+
+    return ReduceAdd(acc) + ScaleAndSumTail(values, weights, i, length);
+}
+
+__attribute__((target("avx512f")))
+static double NormalizeAndFeatureAVX512(double *values, size_t length, double divisor, unsigned j, unsigned m) {
+    const __m512d vdivisor = _mm512_set1_pd(divisor);
+    const __m512d vm = _mm512_set1_pd(m);
+    const __m512d vmn = _mm512_set1_pd(m * (unsigned) length);
+    const __m512d vjn = _mm512_set1_pd(j * (unsigned) length);
+    const __m512d zero = _mm512_setzero_pd();
+    const __m512d step = _mm512_set1_pd(8);
+
+    __m512d index = _mm512_set_pd(8, 7, 6, 5, 4, 3, 2, 1);
+    __m512d acc = _mm512_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        __m512d v = _mm512_div_pd(_mm512_loadu_pd(values + i), vdivisor);
+        _mm512_storeu_pd(values + i, v);
+
+        __m512d x = _mm512_sub_pd(_mm512_mul_pd(index, vm), vjn);
+        __m512d feature = _mm512_sub_pd(zero, _mm512_div_pd(_mm512_abs_pd(x), vmn));
+        acc = _mm512_add_pd(acc, _mm512_mul_pd(feature, v));
+
+        index = _mm512_add_pd(index, step);
+    }
+
+    return ReduceAdd(acc) + NormalizeAndFeatureTail(values, i, length, divisor, j, m);
+}
+
+__attribute__((target("avx512f")))
+static size_t ArgMaxAVX512(const double *values, size_t length) {
+    if (length < 8)
+        return ArgMaxPortable(values, length);
+
+    __m512d vmax = _mm512_loadu_pd(values);
+
+    size_t i = 8;
+    for (; i + 8 <= length; i += 8)
+        // full mask: the unmasked _mm512_max_pd triggers a spurious -Wmaybe-uninitialized on GCC
+        vmax = _mm512_mask_max_pd(vmax, 0xFF, vmax, _mm512_loadu_pd(values + i));
+
+    double lanes[8];
+    _mm512_storeu_pd(lanes, vmax);
+
+    double max = lanes[0];
+    for (int k = 1; k < 8; ++k)
+        max = lanes[k] > max ? lanes[k] : max;
+    for (; i < length; ++i)
+        max = values[i] > max ? values[i] : max;
+
+    const __m512d vvalue = _mm512_set1_pd(max);
+    for (i = 0; i + 8 <= length; i += 8) {
+        __mmask8 mask = _mm512_cmp_pd_mask(_mm512_loadu_pd(values + i), vvalue, _CMP_EQ_OQ);
+        if (mask)
+            return i + __builtin_ctz((unsigned) mask);
+    }
+
+    return FirstIndexOf(values, i, max);
+}
+
+#endif
+
+static vector_ops_t SelectVectorOps() {
+#ifdef MMT_FASTALIGN_X86_DISPATCH
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+        return vector_ops_t{"avx512", ScaleAndSumAVX512, NormalizeAndFeatureAVX512, ArgMaxAVX512};
+    if (__builtin_cpu_supports("avx2"))
+        return vector_ops_t{"avx2", ScaleAndSumAVX2, NormalizeAndFeatureAVX2, ArgMaxAVX2};
+    if (__builtin_cpu_supports("sse4.2"))
+        return vector_ops_t{"sse4.2", ScaleAndSumSSE, NormalizeAndFeatureSSE, ArgMaxSSE};
+#endif
+
+    return vector_ops_t{"portable", ScaleAndSumPortable, NormalizeAndFeaturePortable, ArgMaxPortable};
+}
+
+const vector_ops_t &mmt::fastalign::GetVectorOps() {
+    static const vector_ops_t ops = SelectVectorOps();
+    return ops;
+}
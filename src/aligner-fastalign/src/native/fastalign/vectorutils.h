@@ -0,0 +1,43 @@
+//
+// Created by agent on 18/10/26.
+//
+
+#ifndef MMT_FASTALIGN_VECTORUTILS_H
+#define MMT_FASTALIGN_VECTORUTILS_H
+
+#include <cstddef>
+
+namespace mmt {
+    namespace fastalign {
+
+        /**
+         * Vectorized loops of the alignment kernel. Implementations exist for AVX-512, AVX2 and SSE4.2,
+         * plus a portable fallback; the best one for the running CPU is selected at startup.
+         */
+        struct vector_ops_t {
+            const char *name;
+
+            /**
+             * values[i] *= weights[i], returns the sum of the results.
+             */
+            double (*scale_and_sum)(double *values, const double *weights, size_t length);
+
+            /**
+             * values[i] /= divisor, returns the sum of values[i] * feature(i), where feature(i) is the
+             * diagonal feature of the source word i + 1 for the target word "j", "m" is the target length
+             * and the source length is "length" (see DiagonalAlignment::Feature).
+             */
+            double (*normalize_and_feature)(double *values, size_t length, double divisor, unsigned j, unsigned m);
+
+            /**
+             * Returns the index of the first maximum of the values, length must be greater than 0.
+             */
+            size_t (*argmax)(const double *values, size_t length);
+        };
+
+        const vector_ops_t &GetVectorOps();
+
+    }
+}
+
+#endif //MMT_FASTALIGN_VECTORUTILS_H
@@ -0,0 +1 @@
+../../fastalign/DiagonalAlignment.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../fastalign/DiagonalPrior.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../fastalign/LineDecoder.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../fastalign/MappedFile.h
\ No newline at end of file
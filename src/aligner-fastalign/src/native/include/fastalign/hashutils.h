@@ -0,0 +1 @@
+../../fastalign/hashutils.h
\ No newline at end of file
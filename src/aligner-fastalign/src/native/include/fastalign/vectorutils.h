@@ -0,0 +1 @@
+../../fastalign/vectorutils.h
\ No newline at end of file